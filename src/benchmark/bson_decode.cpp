@@ -0,0 +1,113 @@
+#include "database/bson_reflection_struct.hpp"
+
+#include <mongoc/mongoc.h>
+
+#include <chrono>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+
+// Compares loading documents through the libbson visitor against the raw decoder, with documents
+//  shaped like what a shard loads at start: a few scalars, a string, a nested document and fields
+//  that are stored but not reflected
+struct position : bson_reflection_struct<position, "x", "y", "z">::impl<double, double, double>
+{
+    position() :
+        impl(x, y, z)
+    {}
+
+    double x = 0;
+    double y = 0;
+    double z = 0;
+};
+
+struct entity : bson_reflection_struct<entity, "name", "level", "experience", "health", "online", "position">::impl<std::string, int32_t, int64_t, double, bool, position>
+{
+    entity() :
+        impl(name, level, experience, health, online, pos)
+    {}
+
+    std::string name;
+    int32_t level = 0;
+    int64_t experience = 0;
+    double health = 0;
+    bool online = false;
+    position pos;
+};
+
+static bson_t* make_document(int32_t i)
+{
+    bson_t* doc = bson_new();
+    bson_oid_t oid;
+    bson_oid_init(&oid, nullptr);
+    BSON_APPEND_OID(doc, "_id", &oid);
+
+    std::string name = "entity_" + std::to_string(i);
+    BSON_APPEND_UTF8(doc, "name", name.c_str());
+    BSON_APPEND_INT32(doc, "level", i % 100);
+    BSON_APPEND_INT64(doc, "experience", int64_t(i) * 1000);
+    BSON_APPEND_DOUBLE(doc, "health", 100.0 - (i % 50));
+    BSON_APPEND_BOOL(doc, "online", i % 2 == 0);
+    BSON_APPEND_DATE_TIME(doc, "created_at", 1600000000000 + i);
+
+    bson_t child;
+    BSON_APPEND_DOCUMENT_BEGIN(doc, "position", &child);
+    BSON_APPEND_DOUBLE(&child, "x", i * 0.5);
+    BSON_APPEND_DOUBLE(&child, "y", i * 0.25);
+    BSON_APPEND_DOUBLE(&child, "z", 0.0);
+    bson_append_document_end(doc, &child);
+
+    return doc;
+}
+
+template <typename F>
+static double measure(const char* name, const std::vector<bson_t*>& documents, int rounds, F&& decode)
+{
+    // Keep a checksum so the loads can't be optimized away
+    int64_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (int round = 0; round < rounds; ++round)
+    {
+        for (auto document : documents)
+        {
+            entity object;
+            decode(object, document);
+            checksum += object.level + object.experience + static_cast<int64_t>(object.pos.x) + object.name.size();
+        }
+    }
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    double per_document = elapsed.count() / (double(documents.size()) * rounds);
+    printf("%-10s %10.2f ns/doc (checksum %" PRId64 ")\n", name, per_document, checksum);
+    return per_document;
+}
+
+int main(int argc, char** argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 100000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+
+    std::vector<bson_t*> documents;
+    documents.reserve(count);
+    for (int32_t i = 0; i < count; ++i)
+    {
+        documents.push_back(make_document(i));
+    }
+
+    // Warm up caches and branch predictors before timing either path
+    measure("warmup", documents, 1, [](entity& object, const bson_t* document) { object.visit_all(document); });
+
+    double visitor = measure("visitor", documents, rounds, [](entity& object, const bson_t* document) { object.visit_all(document); });
+    double decoder = measure("decoder", documents, rounds, [](entity& object, const bson_t* document) { object.decode(document); });
+    printf("speedup    %10.2fx\n", visitor / decoder);
+
+    for (auto document : documents)
+    {
+        bson_destroy(document);
+    }
+
+    return 0;
+}
@@ -1,15 +1,28 @@
 #pragma once
 
+#include "core/instrumentation.hpp"
+#include "core/metrics.hpp"
+#include "core/thread_placement.hpp"
 #include "database/database.hpp"
 #include "memory/per_thread_pool.hpp"
 
+#include <function2/function2.hpp>
 #include <pool/fiber_pool.hpp>
 #include <synchronization/mutex.hpp>
 #include <synchronization/spinbarrier.hpp>
 #include <ext/executor.hpp>
 
 #include <boost/asio.hpp>
+#include <concurrentqueue.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <concepts>
+#include <memory>
+#include <string>
+#include <thread>
 #include <vector>
 
 #ifdef _MSC_VER 
@@ -43,6 +56,14 @@ struct core_traits
     using core_pool_traits = np::detail::default_fiber_pool_traits;
     using database_pool_traits = secondary_pool_traits;
 
+    // Background lane, handed to the core pool only while the tick is idle and never waited on, with
+    //  at most this many tasks running at once so that the next tick finds free workers
+    static constexpr uint32_t background_max_in_flight = 4;
+
+    // Thread placement, unless the core loop is given an explicit layout
+    static constexpr thread_policy placement = thread_policy::none;
+    static constexpr const char* network_interface = "eth0";
+
     // Network packet size
     static constexpr std::size_t packet_max_size = 500;
 
@@ -54,6 +75,15 @@ struct core_traits
 };
 
 
+enum class task_priority : uint8_t
+{
+    // Tick work, such as client inputs and timers, runs on the core pool right away
+    critical,
+    // Handed to the core pool only while the tick is idle, it waits as long as ticks overrun
+    background
+};
+
+
 template <typename P, typename T>
 concept plugin_has_network_thread_start = requires (P plugin, T* core)
 {
@@ -78,6 +108,12 @@ concept plugin_has_post_tick = requires (P plugin, T* core)
     { plugin.post_tick(core) };
 };
 
+template <typename P, typename T, typename Buff>
+concept plugin_has_route_network_packet = requires (P plugin, T* core, uint8_t unique_id, udp::endpoint* endpoint, Buff* buffer)
+{
+    { plugin.route_network_packet(core, unique_id, endpoint, buffer) } -> std::same_as<bool>;
+};
+
 template <typename P, typename T, typename Buff>
 concept plugin_has_handle_network_packet = requires (P plugin, T* core, uint8_t unique_id, udp::endpoint* endpoint, Buff* buffer)
 {
@@ -88,14 +124,39 @@ concept plugin_has_handle_network_packet = requires (P plugin, T* core, uint8_t
 template <typename traits, typename... plugins>
 class core_loop : public plugins...
 {
+    using background_task_t = fu2::unique_function<void()>;
+
+    struct core_metrics
+    {
+        metrics_registry::histogram tick_time;
+        metrics_registry::histogram pre_tick_time;
+        metrics_registry::histogram plugins_tick_time;
+        metrics_registry::histogram background_time;
+        metrics_registry::histogram post_tick_time;
+        metrics_registry::counter packets_in;
+        metrics_registry::counter packets_out;
+        metrics_registry::gauge network_buffers;
+        metrics_registry::gauge background_tasks;
+    };
+
 public:
     using traits_t = traits;
 
 public:
     core_loop(uint16_t port, uint16_t core_threads, uint16_t network_threads, uint16_t database_threads) noexcept;
+    core_loop(uint16_t port, uint16_t core_threads, uint16_t network_threads, uint16_t database_threads, thread_layout layout) noexcept;
+
+    // Makes this loop send and release network buffers through "front", which receives on behalf
+    //  of it. Meant for loops built with port 0 and no network threads, such as shards.
+    void share_network(core_loop* front) noexcept;
 
-    template <typename database_traits>
-    void start(database<database_traits>* database, bool join_pools=true) noexcept;
+    // Records tick and phase times (in nanoseconds), packets and pools occupancy into "metrics", as
+    //  well as database latencies if started with one. Must be set before starting. Loops sharing
+    //  a registry must tell their metrics apart by "prefix".
+    void set_metrics(metrics_registry* metrics, const std::string& prefix = "") noexcept;
+
+    template <typename database_traits, typename database_backend>
+    void start(database<database_traits, database_backend>* database, bool join_pools=true) noexcept;
     void stop() noexcept;
 
     template <typename C>
@@ -107,6 +168,12 @@ public:
     template <typename F>
     inline void execute(F&& function, np::counter& counter) noexcept;
 
+    template <typename F>
+    inline void execute(F&& function, task_priority priority) noexcept;
+
+    // Hands a packet received elsewhere to this loop's plugins, as if it had been received here
+    inline void inject_network_packet(uint8_t unique_id, udp::endpoint* endpoint, typename traits::network_buffer* buffer) noexcept;
+
     inline void release_network_buffer(typename traits::network_buffer* buffer) noexcept;
     inline void release_network_endpoint(udp::endpoint* endpoint) noexcept;
 
@@ -118,9 +185,20 @@ protected:
 
     void handle_connections(uint8_t unique_id) noexcept;
 
+    // Records the time since "start" and returns the current time
+    inline typename traits::clock_t::time_point record_phase(metrics_registry::histogram id, typename traits::clock_t::time_point start) noexcept;
+
+    // Pins each worker of a pool that has not started yet to one of "cpus"
+    template <typename pool_t>
+    void pin_workers(pool_t& pool, uint16_t num_threads, const std::vector<uint16_t>& cpus) noexcept;
+
+    // Keeps handing background tasks to the core pool until "deadline", without waiting for them
+    void pump_background(typename traits::clock_t::time_point deadline) noexcept;
+
     // NOTE(gpascualg): MSVC won't compile is directly calling plugins::tick, use this as a bypass
     inline void call_network_thread_start_proxy() noexcept;
     inline void call_pre_tick_proxy() noexcept;
+    inline bool call_route_network_packet_proxy(uint8_t unique_id, udp::endpoint* endpoint, typename traits::network_buffer* buffer) noexcept;
     inline void call_tick_proxy(const typename traits::base_time& diff) noexcept;
     inline void call_post_tick_proxy() noexcept;
     inline void call_handle_network_packet_proxy(uint8_t unique_id, udp::endpoint* endpoint, typename traits::network_buffer* buffer) noexcept;
@@ -132,6 +210,9 @@ protected:
     template <typename P>
     inline void call_pre_tick_proxy_impl() noexcept;
 
+    template <typename P>
+    inline bool call_route_network_packet_proxy_impl(uint8_t unique_id, udp::endpoint* endpoint, typename traits::network_buffer* buffer) noexcept;
+
     template <typename P>
     inline void call_tick_proxy_impl(const typename traits::base_time& diff) noexcept;
 
@@ -146,6 +227,13 @@ protected:
     np::fiber_pool<typename traits::core_pool_traits> _core_pool;
     np::fiber_pool<typename traits::database_pool_traits> _database_pool;
 
+    // Background lane, tasks left when stopping are discarded
+    moodycamel::ConcurrentQueue<background_task_t> _background_tasks;
+    std::atomic<uint32_t> _background_in_flight;
+
+    // Database maintenance run once per tick, if started with one
+    fu2::unique_function<void()> _database_tick;
+
     // Memory pools
     per_thread_pool<typename traits::network_buffer> _data_mempool;
     per_thread_pool<udp::endpoint> _endpoints_mempool;
@@ -160,11 +248,17 @@ protected:
     boost::asio::io_context _context;
     boost::asio::executor_work_guard<boost::asio::io_context::executor_type> _work;
     udp::socket _socket;
+    core_loop* _front;
+
+    // Metrics
+    metrics_registry* _metrics;
+    core_metrics _core_metrics;
 
     // Other
     uint16_t _num_core_threads;
     uint16_t _num_network_threads;
     uint16_t _num_database_threads;
+    thread_layout _layout;
 
     // Stopping
     bool _must_join_during_stop;
@@ -173,9 +267,20 @@ protected:
 
 template <typename traits, typename... plugins>
 core_loop<traits, plugins...>::core_loop(uint16_t port, uint16_t num_core_threads, uint16_t num_network_threads, uint16_t num_database_threads) noexcept :
+    core_loop(port, num_core_threads, num_network_threads, num_database_threads,
+        traits::placement == thread_policy::automatic ?
+            thread_layout::automatic(traits::network_interface, num_network_threads, num_core_threads, num_database_threads) :
+            thread_layout {})
+{}
+
+template <typename traits, typename... plugins>
+core_loop<traits, plugins...>::core_loop(uint16_t port, uint16_t num_core_threads, uint16_t num_network_threads, uint16_t num_database_threads, thread_layout layout) noexcept :
     plugins()...,
     _core_pool(),
     _database_pool(),
+    _background_tasks(),
+    _background_in_flight(0),
+    _database_tick(),
     _data_mempool(),
     _endpoints_mempool(),
     _running(false),
@@ -184,35 +289,61 @@ core_loop<traits, plugins...>::core_loop(uint16_t port, uint16_t num_core_thread
     _network_threads(),
     _context(num_network_threads),
     _work(boost::asio::make_work_guard(_context)),
-    _socket(_context, udp::endpoint(udp::v4(), port)),
+    _socket(port ? udp::socket(_context, udp::endpoint(udp::v4(), port)) : udp::socket(_context)),
+    _front(this),
+    _metrics(nullptr),
+    _core_metrics(),
     _num_core_threads(num_core_threads),
     _num_network_threads(num_network_threads),
     _num_database_threads(num_database_threads),
+    _layout(std::move(layout)),
     _stop_barrier(2)
 {}
 
 template <typename traits, typename... plugins>
-template <typename database_traits>
-void core_loop<traits, plugins...>::start(database<database_traits>* database, bool join_pools) noexcept
+template <typename database_traits, typename database_backend>
+void core_loop<traits, plugins...>::start(database<database_traits, database_backend>* database, bool join_pools) noexcept
 {
     // Fire up network thread
     for (int i = 0; i < _num_network_threads; ++i)
     {
         // TODO(gpascualg): The following should work: emplace_back(&boost::asio::io_context::run, & _context)
-        _network_threads.emplace_back([this] { 
+        _network_threads.emplace_back([this, i] { 
+            if (!_layout.network_cpus.empty())
+            {
+                thread_placement::pin_current_thread(_layout.network_cpus[i % _layout.network_cpus.size()]);
+            }
+
+            // Start receiving from the thread itself, so that its first buffers are already local
             call_network_thread_start_proxy();
+            handle_connections(i);
             _context.run(); 
         }); 
-        handle_connections(i);
     }
 
     // Start database dedicated pool
     if (database != nullptr)
     {
+        pin_workers(_database_pool, _num_database_threads, _layout.database_cpus);
         _database_pool.start(_num_database_threads, false);
         database->set_fiber_pool(&_database_pool);
+
+        if (_metrics)
+        {
+            database->set_metrics(_metrics);
+        }
+
+        // Replay anything a previous run left in the journal, and keep retrying whatever could not be
+        //  applied even if nothing else is ever appended
+        database->drain_journal();
+        _database_tick = [database]() {
+            database->drain_journal();
+        };
     }
 
+    // Workers must be pinned before the main loop takes one of them
+    pin_workers(_core_pool, _num_core_threads, _layout.core_cpus);
+
     // Push main loop logic
     _running = true;
     _must_join_during_stop = !join_pools;
@@ -227,6 +358,7 @@ void core_loop<traits, plugins...>::start(database<database_traits>* database, b
             auto last_tick = _now;
             _now = traits::clock_t::now();
             call_pre_tick_proxy();
+            auto phase_start = _metrics ? record_phase(_core_metrics.pre_tick_time, _now) : _now;
 
             // Compute time diff
             auto diff = std::chrono::duration_cast<typename traits::base_time>(_now - last_tick);
@@ -235,18 +367,41 @@ void core_loop<traits, plugins...>::start(database<database_traits>* database, b
             // Execute plugins main ticks
             call_tick_proxy(diff);
 
+            if (_metrics)
+            {
+                record_phase(_core_metrics.plugins_tick_time, phase_start);
+                phase_start = record_phase(_core_metrics.tick_time, _now);
+                _metrics->set(_core_metrics.background_tasks, static_cast<int64_t>(_background_tasks.size_approx()));
+            }
+
             // Sleep
             auto diff_mean = typename traits::base_time(static_cast<uint64_t>(std::ceil(_diff_mean)));
             auto update_time = std::chrono::duration_cast<typename traits::base_time>(traits::clock_t::now() - _now) + (diff_mean - traits::heart_beat);
+            auto wake_up = traits::clock_t::now();
             if (update_time < traits::heart_beat)
             {
-                auto sleep_time = traits::heart_beat - update_time;
-                
-                // This is lost time which could be invested in other tasks
-                std::this_thread::sleep_for(sleep_time);
+                wake_up += traits::heart_beat - update_time;
+            }
+
+            // Idle time goes to the background lane, whatever is left is slept
+            pump_background(wake_up);
+            if (_metrics)
+            {
+                record_phase(_core_metrics.background_time, phase_start);
+            }
+            std::this_thread::sleep_until(wake_up);
+
+            if (_database_tick)
+            {
+                _database_tick();
             }
 
+            phase_start = _metrics ? traits::clock_t::now() : phase_start;
             call_post_tick_proxy();
+            if (_metrics)
+            {
+                record_phase(_core_metrics.post_tick_time, phase_start);
+            }
         }
 
         // Stop pools
@@ -283,6 +438,37 @@ void core_loop<traits, plugins...>::start(database<database_traits>* database, b
     }
 }
 
+template <typename traits, typename... plugins>
+void core_loop<traits, plugins...>::share_network(core_loop* front) noexcept
+{
+    _front = front;
+}
+
+template <typename traits, typename... plugins>
+void core_loop<traits, plugins...>::set_metrics(metrics_registry* metrics, const std::string& prefix) noexcept
+{
+    _metrics = metrics;
+    _core_metrics = {
+        .tick_time = metrics->add_histogram((prefix + "tick_ns").c_str()),
+        .pre_tick_time = metrics->add_histogram((prefix + "pre_tick_ns").c_str()),
+        .plugins_tick_time = metrics->add_histogram((prefix + "plugins_tick_ns").c_str()),
+        .background_time = metrics->add_histogram((prefix + "background_ns").c_str()),
+        .post_tick_time = metrics->add_histogram((prefix + "post_tick_ns").c_str()),
+        .packets_in = metrics->add_counter((prefix + "packets_in").c_str()),
+        .packets_out = metrics->add_counter((prefix + "packets_out").c_str()),
+        .network_buffers = metrics->add_gauge((prefix + "network_buffers_in_use").c_str()),
+        .background_tasks = metrics->add_gauge((prefix + "background_tasks_queued").c_str())
+    };
+}
+
+template <typename traits, typename... plugins>
+inline typename traits::clock_t::time_point core_loop<traits, plugins...>::record_phase(metrics_registry::histogram id, typename traits::clock_t::time_point start) noexcept
+{
+    auto now = traits::clock_t::now();
+    _metrics->record(id, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count()));
+    return now;
+}
+
 template <typename traits, typename... plugins>
 void core_loop<traits, plugins...>::stop() noexcept
 {
@@ -303,7 +489,12 @@ template <typename traits, typename... plugins>
 template <typename C>
 void core_loop<traits, plugins...>::send_data(const udp::endpoint& endpoint, const void* buffer, uint32_t size, C&& callback) noexcept
 {
-    _socket.async_send_to(boost::asio::const_buffer(buffer, size), endpoint,
+    if (_metrics)
+    {
+        _metrics->increment(_core_metrics.packets_out);
+    }
+
+    _front->_socket.async_send_to(boost::asio::const_buffer(buffer, size), endpoint,
         [buffer, size, callback = std::forward<C>(callback)](const boost::system::error_code& error, std::size_t bytes) noexcept
     {
         callback(buffer, size, bytes);
@@ -329,28 +520,108 @@ inline void core_loop<traits, plugins...>::execute(F&& function, np::counter& co
     _core_pool.push(std::forward<F>(function), counter);
 }
 
+template <typename traits, typename... plugins>
+template <typename F>
+inline void core_loop<traits, plugins...>::execute(F&& function, task_priority priority) noexcept
+{
+    if (priority == task_priority::background)
+    {
+        _background_tasks.enqueue(background_task_t(std::forward<F>(function)));
+        return;
+    }
+
+    _core_pool.push(std::forward<F>(function));
+}
+
+template <typename traits, typename... plugins>
+template <typename pool_t>
+void core_loop<traits, plugins...>::pin_workers(pool_t& pool, uint16_t num_threads, const std::vector<uint16_t>& cpus) noexcept
+{
+    if (cpus.empty() || num_threads == 0)
+    {
+        return;
+    }
+
+    // Pushed before the pool starts, these are the first tasks workers run. Each of them holds its
+    //  worker at the barrier until all are taken, thus every worker pins itself exactly once.
+    auto barrier = std::make_shared<np::spinbarrier>(num_threads);
+    for (uint16_t i = 0; i < num_threads; ++i)
+    {
+        pool.push([barrier, cpu = cpus[i % cpus.size()]]() noexcept {
+            thread_placement::pin_current_thread(cpu);
+            barrier->wait();
+        });
+    }
+}
+
+template <typename traits, typename... plugins>
+void core_loop<traits, plugins...>::pump_background(typename traits::clock_t::time_point deadline) noexcept
+{
+    // NOTE(gpascualg): The pool has no priorities of its own, background tasks are only pushed to it
+    //  from the main loop once tick work is done, and only as many as can run at once. Finished ones
+    //  are topped up until the deadline, whatever is still running then overlaps the next tick.
+    constexpr auto poll_interval = std::chrono::milliseconds(1);
+    std::array<background_task_t, traits::background_max_in_flight> batch;
+
+    while (traits::clock_t::now() < deadline)
+    {
+        uint32_t in_flight = _background_in_flight.load(std::memory_order_acquire);
+        if (in_flight < traits::background_max_in_flight)
+        {
+            auto count = _background_tasks.try_dequeue_bulk(batch.begin(), traits::background_max_in_flight - in_flight);
+            if (count == 0 && in_flight == 0)
+            {
+                break;
+            }
+
+            _background_in_flight.fetch_add(static_cast<uint32_t>(count), std::memory_order_relaxed);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                _core_pool.push([this, task = std::move(batch[i])]() mutable {
+                    task();
+                    _background_in_flight.fetch_sub(1, std::memory_order_release);
+                });
+            }
+        }
+
+        std::this_thread::sleep_until(std::min<typename traits::clock_t::time_point>(deadline, traits::clock_t::now() + poll_interval));
+    }
+}
+
 template <typename traits, typename... plugins>
 void core_loop<traits, plugins...>::handle_connections(uint8_t unique_id) noexcept
 {
     // Get a new buffer
     auto buffer = _data_mempool.get();
     auto endpoint = _endpoints_mempool.get();
+    if (_metrics)
+    {
+        _metrics->add(_core_metrics.network_buffers, 1);
+    }
 
     _socket.async_receive_from(boost::asio::buffer(buffer->data, traits::packet_max_size), *endpoint, 0, [this, buffer, endpoint, unique_id](const auto& error, std::size_t bytes) noexcept {
+        INSTRUMENT_ZONE("network_receive");
         // std::cout << "Incoming packet from " << *endpoint << " [" << bytes << "b, " << static_cast<bool>(error) << "]" << std::endl;
 
         if (error)
         {
-            _data_mempool.release(buffer);
-            _endpoints_mempool.release(endpoint);
+            release_network_buffer(buffer);
+            release_network_endpoint(endpoint);
         }
         else
         {
             // Set read size
             buffer->size = bytes;
+            if (_metrics)
+            {
+                _metrics->increment(_core_metrics.packets_in);
+            }
             
-            // Let plugins handle the packet
-            call_handle_network_packet_proxy(unique_id, endpoint, buffer);
+            // Let plugins handle the packet, unless one of them routes it somewhere else
+            if (!call_route_network_packet_proxy(unique_id, endpoint, buffer))
+            {
+                call_handle_network_packet_proxy(unique_id, endpoint, buffer);
+            }
         }
 
         // Handle again
@@ -358,16 +629,27 @@ void core_loop<traits, plugins...>::handle_connections(uint8_t unique_id) noexce
     });
 }
 
+template <typename traits, typename... plugins>
+inline void core_loop<traits, plugins...>::inject_network_packet(uint8_t unique_id, udp::endpoint* endpoint, typename traits::network_buffer* buffer) noexcept
+{
+    call_handle_network_packet_proxy(unique_id, endpoint, buffer);
+}
+
 template <typename traits, typename... plugins>
 inline void core_loop<traits, plugins...>::release_network_buffer(typename traits::network_buffer* buffer) noexcept
 {
-    _data_mempool.release(buffer);
+    // Buffers go back to whoever received them, so that pools don't drift between loops
+    _front->_data_mempool.release(buffer);
+    if (_front->_metrics)
+    {
+        _front->_metrics->add(_front->_core_metrics.network_buffers, -1);
+    }
 }
 
 template <typename traits, typename... plugins>
 inline void core_loop<traits, plugins...>::release_network_endpoint(udp::endpoint* endpoint) noexcept
 {
-    _endpoints_mempool.release(endpoint);
+    _front->_endpoints_mempool.release(endpoint);
 }
 
 template <typename traits, typename... plugins>
@@ -382,6 +664,12 @@ inline void core_loop<traits, plugins...>::call_pre_tick_proxy() noexcept
     (..., call_pre_tick_proxy_impl<plugins>());
 }
 
+template <typename traits, typename... plugins>
+inline bool core_loop<traits, plugins...>::call_route_network_packet_proxy(uint8_t unique_id, udp::endpoint* endpoint, typename traits::network_buffer* buffer) noexcept
+{
+    return (false || ... || call_route_network_packet_proxy_impl<plugins>(unique_id, endpoint, buffer));
+}
+
 template <typename traits, typename... plugins>
 inline void core_loop<traits, plugins...>::call_tick_proxy(const typename traits::base_time& diff) noexcept
 {
@@ -406,6 +694,7 @@ inline void core_loop<traits, plugins...>::call_network_thread_start_proxy_impl(
 {
     if constexpr (plugin_has_network_thread_start<P, core_loop<traits, plugins...>>)
     {
+        INSTRUMENT_ZONE(instrumentation::zone_name<P, "network_thread_start">());
         this->P::network_thread_start(this);
     }
 }
@@ -416,16 +705,33 @@ inline void core_loop<traits, plugins...>::call_pre_tick_proxy_impl() noexcept
 {
     if constexpr (plugin_has_pre_tick<P, core_loop<traits, plugins...>>)
     {
+        INSTRUMENT_ZONE(instrumentation::zone_name<P, "pre_tick">());
         this->P::pre_tick(this);
     }
 }
 
+template <typename traits, typename... plugins>
+template <typename P>
+inline bool core_loop<traits, plugins...>::call_route_network_packet_proxy_impl(uint8_t unique_id, udp::endpoint* endpoint, typename traits::network_buffer* buffer) noexcept
+{
+    if constexpr (plugin_has_route_network_packet<P, core_loop<traits, plugins...>, typename traits::network_buffer>)
+    {
+        INSTRUMENT_ZONE(instrumentation::zone_name<P, "route_network_packet">());
+        return this->P::route_network_packet(this, unique_id, endpoint, buffer);
+    }
+    else
+    {
+        return false;
+    }
+}
+
 template <typename traits, typename... plugins>
 template <typename P>
 inline void core_loop<traits, plugins...>::call_tick_proxy_impl(const typename traits::base_time& diff) noexcept
 {
     if constexpr (plugin_has_tick<P, core_loop<traits, plugins...>, typename traits::base_time>)
     {
+        INSTRUMENT_ZONE(instrumentation::zone_name<P, "tick">());
         this->P::tick(this, diff);
     }
 }
@@ -436,6 +742,7 @@ inline void core_loop<traits, plugins...>::call_post_tick_proxy_impl() noexcept
 {
     if constexpr (plugin_has_post_tick<P, core_loop<traits, plugins...>>)
     {
+        INSTRUMENT_ZONE(instrumentation::zone_name<P, "post_tick">());
         this->P::post_tick(this);
     }
 }
@@ -446,6 +753,7 @@ inline void core_loop<traits, plugins...>::call_handle_network_packet_proxy_impl
 {
     if constexpr (plugin_has_handle_network_packet<P, core_loop<traits, plugins...>, typename traits::network_buffer>)
     {
+        INSTRUMENT_ZONE(instrumentation::zone_name<P, "handle_network_packet">());
         this->P::handle_network_packet(this, unique_id, endpoint, buffer);
     }
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "core/coreloop.hpp"
+#include "core/instrumentation.hpp"
 
 #include <synchronization/mutex.hpp>
 
@@ -139,12 +140,18 @@ void coreloop_network_plugin<derived, network_buffer, max_concurrent_threads>::t
     for (auto& [endpoint, buffers] : _endpoint_data)
     {
         core_loop->execute([this, &endpoint = endpoint, &buffers = buffers] {
+            INSTRUMENT_ZONE("client_inputs");
+
             // Clear pending buffers after processing client
             reinterpret_cast<derived*>(this)->client_inputs(endpoint, buffers);
             buffers.clear();
         }, _inputs_counter);
     }
-    _inputs_counter.wait();
+
+    {
+        INSTRUMENT_SUSPEND();
+        _inputs_counter.wait();
+    }
 
     // Now yield to user implementation
     reinterpret_cast<derived*>(this)->post_network_tick(diff);
@@ -0,0 +1,231 @@
+#pragma once
+
+#include "core/coreloop.hpp"
+#include "core/coreloop_network_plugin.hpp"
+
+#include <function2/function2.hpp>
+
+#include <concurrentqueue.h>
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <string>
+#include <vector>
+
+
+template <typename derived>
+class coreloop_shard_plugin;
+
+// Independent core loops (shards) in a single process. The first shard added is the front: it owns
+//  the socket, the network threads and the database pool. All others must be built with port 0 and
+//  no network nor database threads, they get their clients' packets from the front and run their
+//  queries on its database pool. Shards are plain core loops using coreloop_shard_plugin.
+template <typename shard_t>
+class shard_group
+{
+public:
+    shard_group() noexcept;
+
+    void add(shard_t* shard) noexcept;
+
+    // Registers the metrics of every shard added so far, prefixed by "shard<index>."
+    void set_metrics(metrics_registry* metrics) noexcept;
+
+    // Starts all shards, joining only the front if requested
+    template <typename database_traits, typename database_backend>
+    void start(database<database_traits, database_backend>* database, bool join_pools=true) noexcept;
+    void stop() noexcept;
+
+    // Shard owning the session, which does not change as long as the group does not
+    inline uint16_t route(const udp::endpoint& endpoint) const noexcept;
+
+    inline shard_t* shard(uint16_t index) const noexcept;
+    inline uint16_t size() const noexcept;
+
+private:
+    std::vector<shard_t*> _shards;
+};
+
+// Gives a core loop a mailbox other shards can post to, drained at the start of every tick, and
+//  routes packets received by the front to the shard that owns their session
+template <typename derived>
+class coreloop_shard_plugin
+{
+    friend class shard_group<derived>;
+
+    using message_t = fu2::unique_function<void(derived*)>;
+
+public:
+    coreloop_shard_plugin() noexcept;
+
+    // Runs function(derived* shard) on this shard's next pre tick, can be called from any thread
+    template <typename F>
+    inline void post(F&& function) noexcept;
+
+    template <typename T>
+    void pre_tick(T* core_loop) noexcept;
+
+    template <typename T>
+    bool route_network_packet(T* core_loop, uint8_t unique_id, udp::endpoint* endpoint, typename T::traits_t::network_buffer* buffer) noexcept;
+
+    inline shard_group<derived>* group() const noexcept;
+    inline uint16_t shard_index() const noexcept;
+
+protected:
+    // Do not destroy this class through base pointers
+    ~coreloop_shard_plugin() noexcept = default;
+
+private:
+    shard_group<derived>* _group;
+    uint16_t _shard_index;
+    moodycamel::ConcurrentQueue<message_t> _mailbox;
+};
+
+
+template <typename shard_t>
+shard_group<shard_t>::shard_group() noexcept :
+    _shards()
+{}
+
+template <typename shard_t>
+void shard_group<shard_t>::add(shard_t* shard) noexcept
+{
+    shard->_group = this;
+    shard->_shard_index = static_cast<uint16_t>(_shards.size());
+
+    if (!_shards.empty())
+    {
+        shard->share_network(_shards.front());
+    }
+
+    _shards.push_back(shard);
+}
+
+template <typename shard_t>
+void shard_group<shard_t>::set_metrics(metrics_registry* metrics) noexcept
+{
+    for (std::size_t i = 0; i < _shards.size(); ++i)
+    {
+        _shards[i]->set_metrics(metrics, "shard" + std::to_string(i) + ".");
+    }
+}
+
+template <typename shard_t>
+template <typename database_traits, typename database_backend>
+void shard_group<shard_t>::start(database<database_traits, database_backend>* database, bool join_pools) noexcept
+{
+    assert(!_shards.empty() && "Shard groups need at least one shard");
+
+    // Everything but the front runs in the background, their database is the front's pool
+    for (std::size_t i = 1; i < _shards.size(); ++i)
+    {
+        _shards[i]->template start<database_traits, database_backend>(nullptr, false);
+    }
+
+    _shards.front()->start(database, join_pools);
+}
+
+template <typename shard_t>
+void shard_group<shard_t>::stop() noexcept
+{
+    // The front goes last, others might still be sending through it
+    for (std::size_t i = _shards.size(); i > 1; --i)
+    {
+        _shards[i - 1]->stop();
+    }
+
+    _shards.front()->stop();
+}
+
+template <typename shard_t>
+inline uint16_t shard_group<shard_t>::route(const udp::endpoint& endpoint) const noexcept
+{
+    return static_cast<uint16_t>(std::hash<udp::endpoint>{}(endpoint) % _shards.size());
+}
+
+template <typename shard_t>
+inline shard_t* shard_group<shard_t>::shard(uint16_t index) const noexcept
+{
+    return _shards[index];
+}
+
+template <typename shard_t>
+inline uint16_t shard_group<shard_t>::size() const noexcept
+{
+    return static_cast<uint16_t>(_shards.size());
+}
+
+
+template <typename derived>
+coreloop_shard_plugin<derived>::coreloop_shard_plugin() noexcept :
+    _group(nullptr),
+    _shard_index(0),
+    _mailbox()
+{}
+
+template <typename derived>
+template <typename F>
+inline void coreloop_shard_plugin<derived>::post(F&& function) noexcept
+{
+    _mailbox.enqueue(message_t(std::forward<F>(function)));
+}
+
+template <typename derived>
+template <typename T>
+void coreloop_shard_plugin<derived>::pre_tick(T* core_loop) noexcept
+{
+    // Only what was there when the tick started, messages posted meanwhile wait for the next one
+    std::array<message_t, 32> messages;
+    std::size_t pending = _mailbox.size_approx();
+
+    while (pending > 0)
+    {
+        auto count = _mailbox.try_dequeue_bulk(messages.begin(), std::min(pending, messages.size()));
+        if (count == 0)
+        {
+            break;
+        }
+
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            messages[i](static_cast<derived*>(core_loop));
+        }
+
+        pending -= count;
+    }
+}
+
+template <typename derived>
+template <typename T>
+bool coreloop_shard_plugin<derived>::route_network_packet(T* core_loop, uint8_t unique_id, udp::endpoint* endpoint, typename T::traits_t::network_buffer* buffer) noexcept
+{
+    if (!_group)
+    {
+        return false;
+    }
+
+    auto target = _group->route(*endpoint);
+    if (target == _shard_index)
+    {
+        return false;
+    }
+
+    // Buffers and endpoints are released by the target, back into the front's pools
+    _group->shard(target)->post([unique_id, endpoint, buffer](derived* shard) {
+        shard->inject_network_packet(unique_id, endpoint, buffer);
+    });
+    return true;
+}
+
+template <typename derived>
+inline shard_group<derived>* coreloop_shard_plugin<derived>::group() const noexcept
+{
+    return _group;
+}
+
+template <typename derived>
+inline uint16_t coreloop_shard_plugin<derived>::shard_index() const noexcept
+{
+    return _shard_index;
+}
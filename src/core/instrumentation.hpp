@@ -0,0 +1,130 @@
+#pragma once
+
+#include "core/fixed_string.hpp"
+
+#ifdef ENABLE_INSTRUMENTATION
+    #include <palanteer.h>
+#endif // ENABLE_INSTRUMENTATION
+
+#include <string>
+#include <string_view>
+
+
+// Palanteer zones around plugin hooks, network receives, client inputs and database tasks. Only
+//  compiled with ENABLE_INSTRUMENTATION, otherwise zones and their names vanish altogether.
+//  Palanteer zones must end in the thread they began in, yet fibers waiting on a counter can be
+//  resumed by any worker. Waits inside zones go in an INSTRUMENT_SUSPEND scope, which ends every
+//  zone open in the thread and begins them again in whichever thread resumes the fiber.
+#ifdef ENABLE_INSTRUMENTATION
+    #define INSTRUMENT_ZONE(...) instrumentation::zone _instrumentation_zone(__VA_ARGS__)
+    #define INSTRUMENT_SUSPEND() instrumentation::suspend _instrumentation_suspend
+#else
+    #define INSTRUMENT_ZONE(...)
+    #define INSTRUMENT_SUSPEND()
+#endif // ENABLE_INSTRUMENTATION
+
+
+namespace instrumentation
+{
+    // Name of T as spelled by the compiler
+    template <typename T>
+    constexpr std::string_view type_name() noexcept
+    {
+#ifdef _MSC_VER
+        std::string_view name = __FUNCSIG__;
+        auto start = name.find("type_name<") + 10;
+        auto end = name.rfind(">(void)");
+#else
+        std::string_view name = __PRETTY_FUNCTION__;
+        auto start = name.find("T = ") + 4;
+        auto end = name.find_first_of(";]", start);
+#endif // _MSC_VER
+        return name.substr(start, end - start);
+    }
+
+    // "plugin::hook", built once per plugin and hook as Palanteer needs null terminated names
+    template <typename P, fixed_string hook>
+    inline const char* zone_name() noexcept
+    {
+        static const std::string name = std::string(type_name<P>()) + "::" + static_cast<const char*>(hook);
+        return name.c_str();
+    }
+
+#ifdef ENABLE_INSTRUMENTATION
+    class zone
+    {
+        friend class suspend;
+
+    public:
+        inline explicit zone(const char* name) noexcept :
+            _name(name),
+            _parent(innermost())
+        {
+            plBeginDyn(_name);
+            innermost() = this;
+        }
+
+        inline ~zone() noexcept
+        {
+            plEndDyn(_name);
+            innermost() = _parent;
+        }
+
+    private:
+        // Zones open in this thread are chained from the innermost one
+        static inline zone*& innermost() noexcept
+        {
+            thread_local zone* current = nullptr;
+            return current;
+        }
+
+    private:
+        const char* _name;
+        zone* _parent;
+    };
+
+    // Zones live in the fiber's stack, thus the chain is still valid once resumed elsewhere
+    class suspend
+    {
+    public:
+        inline suspend() noexcept :
+            _innermost(zone::innermost())
+        {
+            for (auto current = _innermost; current; current = current->_parent)
+            {
+                plEndDyn(current->_name);
+            }
+
+            zone::innermost() = nullptr;
+        }
+
+        inline ~suspend() noexcept
+        {
+            if (_innermost)
+            {
+                resume(_innermost, zone::innermost());
+                zone::innermost() = _innermost;
+            }
+        }
+
+    private:
+        // Outermost first, which is now nested in whatever the new thread has open
+        static inline void resume(zone* current, zone* base) noexcept
+        {
+            if (current->_parent)
+            {
+                resume(current->_parent, base);
+            }
+            else
+            {
+                current->_parent = base;
+            }
+
+            plBeginDyn(current->_name);
+        }
+
+    private:
+        zone* _innermost;
+    };
+#endif // ENABLE_INSTRUMENTATION
+}
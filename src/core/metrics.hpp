@@ -0,0 +1,380 @@
+#pragma once
+
+#include <synchronization/mutex.hpp>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <atomic>
+#include <bit>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+
+// Counters, gauges and log-linear (HDR) histograms, recorded with a single relaxed atomic op on
+//  memory local to the recording thread. All values live in one plain layout, which can be a
+//  memory-mapped file that external tools read without touching the process:
+//   - The header describes the layout sizes. Descriptors hold names and are published under a
+//     seqlock: readers retry while "sequence" is odd or changed during their read.
+//   - Counters and histograms have one row per thread slot, readers sum all of them. Threads
+//     beyond max_threads share slots, which is still correct as recording is atomic.
+//   - Histogram bucket b covers values up to "bucket_value(b)", see below.
+// Registering beyond the limits returns invalid handles, which are silently ignored when recording.
+class metrics_registry
+{
+public:
+    static constexpr uint32_t metrics_magic = 0x5254454D; // "METR"
+    static constexpr uint32_t metrics_version = 1;
+
+    static constexpr uint32_t max_threads = 32;
+    static constexpr uint32_t max_counters = 64;
+    static constexpr uint32_t max_gauges = 64;
+    static constexpr uint32_t max_histograms = 32;
+    static constexpr uint32_t max_name_length = 56;
+
+    // 2^sub_bucket_bits buckets per power of two (12.5% error), values up to 2^max_value_bits
+    //  (about 18 minutes in nanoseconds), larger ones are clamped
+    static constexpr uint32_t sub_bucket_bits = 3;
+    static constexpr uint32_t max_value_bits = 40;
+    static constexpr uint32_t buckets_count = (max_value_bits - sub_bucket_bits + 1) << sub_bucket_bits;
+
+    static constexpr uint16_t invalid_index = UINT16_MAX;
+
+    struct counter { uint16_t index = invalid_index; };
+    struct gauge { uint16_t index = invalid_index; };
+    struct histogram { uint16_t index = invalid_index; };
+
+    struct header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t max_threads;
+        uint32_t max_counters;
+        uint32_t max_gauges;
+        uint32_t max_histograms;
+        uint32_t sub_bucket_bits;
+        uint32_t max_value_bits;
+        uint32_t sequence;
+        uint32_t counters_count;
+        uint32_t gauges_count;
+        uint32_t histograms_count;
+    };
+
+    struct descriptor
+    {
+        char name[max_name_length];
+        uint64_t reserved;
+    };
+
+    struct layout
+    {
+        struct header header;
+        descriptor counters_names[max_counters];
+        descriptor gauges_names[max_gauges];
+        descriptor histograms_names[max_histograms];
+        alignas(64) uint64_t counters[max_threads][max_counters];
+        alignas(64) int64_t gauges[max_gauges];
+        alignas(64) uint64_t histograms[max_histograms][max_threads][buckets_count];
+    };
+
+public:
+    metrics_registry() noexcept;
+
+    // Moves all values to a memory-mapped file, must be called before anything is recorded
+    bool open(const std::string& path) noexcept;
+
+    // Registration is not meant for hot paths, it takes a lock
+    counter add_counter(const char* name) noexcept;
+    gauge add_gauge(const char* name) noexcept;
+    histogram add_histogram(const char* name) noexcept;
+
+    inline void increment(counter id, uint64_t value = 1) noexcept;
+    inline void set(gauge id, int64_t value) noexcept;
+    inline void add(gauge id, int64_t value) noexcept;
+    inline void record(histogram id, uint64_t value) noexcept;
+
+    // Aggregated reads, only consistent per value
+    uint64_t value(counter id) const noexcept;
+    int64_t value(gauge id) const noexcept;
+    uint64_t count(histogram id) const noexcept;
+    uint64_t percentile(histogram id, double percentile) const noexcept;
+
+    static constexpr uint32_t bucket_of(uint64_t value) noexcept;
+    static constexpr uint64_t bucket_value(uint32_t bucket) noexcept;
+
+private:
+    static inline uint32_t thread_slot() noexcept;
+
+    uint16_t add_metric(descriptor* names, uint32_t& count, uint32_t max_count, const char* name) noexcept;
+
+private:
+    std::unique_ptr<layout> _local;
+    boost::interprocess::file_mapping _file;
+    boost::interprocess::mapped_region _region;
+    layout* _layout;
+    np::mutex _mutex;
+};
+
+
+inline metrics_registry::metrics_registry() noexcept :
+    _local(std::make_unique<layout>()),
+    _file(),
+    _region(),
+    _layout(_local.get()),
+    _mutex()
+{
+    _layout->header = {
+        .magic = metrics_magic,
+        .version = metrics_version,
+        .max_threads = max_threads,
+        .max_counters = max_counters,
+        .max_gauges = max_gauges,
+        .max_histograms = max_histograms,
+        .sub_bucket_bits = sub_bucket_bits,
+        .max_value_bits = max_value_bits,
+        .sequence = 0,
+        .counters_count = 0,
+        .gauges_count = 0,
+        .histograms_count = 0
+    };
+}
+
+inline bool metrics_registry::open(const std::string& path) noexcept
+{
+    using namespace boost::interprocess;
+
+    // Values are live, always start from a fresh file
+    std::error_code error;
+    std::ofstream(path, std::ios::binary | std::ios::trunc);
+    std::filesystem::resize_file(path, sizeof(layout), error);
+    if (error)
+    {
+        return false;
+    }
+
+    try
+    {
+        _file = file_mapping(path.c_str(), read_write);
+        _region = mapped_region(_file, read_write);
+    }
+    catch (const interprocess_exception&)
+    {
+        return false;
+    }
+
+    _mutex.lock();
+    auto mapped = static_cast<layout*>(_region.get_address());
+    memcpy(mapped, _layout, sizeof(layout));
+    _layout = mapped;
+    _local.reset();
+    _mutex.unlock();
+
+    return true;
+}
+
+inline metrics_registry::counter metrics_registry::add_counter(const char* name) noexcept
+{
+    return { add_metric(_layout->counters_names, _layout->header.counters_count, max_counters, name) };
+}
+
+inline metrics_registry::gauge metrics_registry::add_gauge(const char* name) noexcept
+{
+    return { add_metric(_layout->gauges_names, _layout->header.gauges_count, max_gauges, name) };
+}
+
+inline metrics_registry::histogram metrics_registry::add_histogram(const char* name) noexcept
+{
+    return { add_metric(_layout->histograms_names, _layout->header.histograms_count, max_histograms, name) };
+}
+
+inline void metrics_registry::increment(counter id, uint64_t value) noexcept
+{
+    if (id.index == invalid_index)
+    {
+        return;
+    }
+
+    std::atomic_ref<uint64_t>(_layout->counters[thread_slot()][id.index]).fetch_add(value, std::memory_order_relaxed);
+}
+
+inline void metrics_registry::set(gauge id, int64_t value) noexcept
+{
+    if (id.index == invalid_index)
+    {
+        return;
+    }
+
+    std::atomic_ref<int64_t>(_layout->gauges[id.index]).store(value, std::memory_order_relaxed);
+}
+
+inline void metrics_registry::add(gauge id, int64_t value) noexcept
+{
+    if (id.index == invalid_index)
+    {
+        return;
+    }
+
+    std::atomic_ref<int64_t>(_layout->gauges[id.index]).fetch_add(value, std::memory_order_relaxed);
+}
+
+inline void metrics_registry::record(histogram id, uint64_t value) noexcept
+{
+    if (id.index == invalid_index)
+    {
+        return;
+    }
+
+    std::atomic_ref<uint64_t>(_layout->histograms[id.index][thread_slot()][bucket_of(value)]).fetch_add(1, std::memory_order_relaxed);
+}
+
+inline uint64_t metrics_registry::value(counter id) const noexcept
+{
+    if (id.index == invalid_index)
+    {
+        return 0;
+    }
+
+    uint64_t total = 0;
+    for (uint32_t slot = 0; slot < max_threads; ++slot)
+    {
+        total += std::atomic_ref<uint64_t>(_layout->counters[slot][id.index]).load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+inline int64_t metrics_registry::value(gauge id) const noexcept
+{
+    if (id.index == invalid_index)
+    {
+        return 0;
+    }
+
+    return std::atomic_ref<int64_t>(_layout->gauges[id.index]).load(std::memory_order_relaxed);
+}
+
+inline uint64_t metrics_registry::count(histogram id) const noexcept
+{
+    if (id.index == invalid_index)
+    {
+        return 0;
+    }
+
+    uint64_t total = 0;
+    for (uint32_t slot = 0; slot < max_threads; ++slot)
+    {
+        for (uint32_t bucket = 0; bucket < buckets_count; ++bucket)
+        {
+            total += std::atomic_ref<uint64_t>(_layout->histograms[id.index][slot][bucket]).load(std::memory_order_relaxed);
+        }
+    }
+    return total;
+}
+
+inline uint64_t metrics_registry::percentile(histogram id, double percentile) const noexcept
+{
+    if (id.index == invalid_index)
+    {
+        return 0;
+    }
+
+    uint64_t buckets[buckets_count] = {};
+    uint64_t total = 0;
+    for (uint32_t slot = 0; slot < max_threads; ++slot)
+    {
+        for (uint32_t bucket = 0; bucket < buckets_count; ++bucket)
+        {
+            auto count = std::atomic_ref<uint64_t>(_layout->histograms[id.index][slot][bucket]).load(std::memory_order_relaxed);
+            buckets[bucket] += count;
+            total += count;
+        }
+    }
+
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    // Smallest value at or above the requested fraction of samples
+    uint64_t target = static_cast<uint64_t>(percentile / 100.0 * total + 0.5);
+    target = target == 0 ? 1 : target;
+
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket < buckets_count; ++bucket)
+    {
+        seen += buckets[bucket];
+        if (seen >= target)
+        {
+            return bucket_value(bucket);
+        }
+    }
+
+    return bucket_value(buckets_count - 1);
+}
+
+constexpr uint32_t metrics_registry::bucket_of(uint64_t value) noexcept
+{
+    // Values below 2^sub_bucket_bits map to themselves, then each power of two is split linearly
+    if (value < (uint64_t(1) << sub_bucket_bits))
+    {
+        return static_cast<uint32_t>(value);
+    }
+
+    uint32_t exponent = static_cast<uint32_t>(std::bit_width(value)) - 1;
+    if (exponent >= max_value_bits)
+    {
+        return buckets_count - 1;
+    }
+
+    uint32_t group = exponent - sub_bucket_bits + 1;
+    uint32_t sub_bucket = static_cast<uint32_t>(value >> (exponent - sub_bucket_bits)) & ((1u << sub_bucket_bits) - 1);
+    return (group << sub_bucket_bits) + sub_bucket;
+}
+
+constexpr uint64_t metrics_registry::bucket_value(uint32_t bucket) noexcept
+{
+    // Highest value that falls into the bucket
+    uint32_t group = bucket >> sub_bucket_bits;
+    uint64_t sub_bucket = bucket & ((1u << sub_bucket_bits) - 1);
+    if (group == 0)
+    {
+        return sub_bucket;
+    }
+
+    uint64_t lowest = ((uint64_t(1) << sub_bucket_bits) + sub_bucket) << (group - 1);
+    return lowest + (uint64_t(1) << (group - 1)) - 1;
+}
+
+inline uint32_t metrics_registry::thread_slot() noexcept
+{
+    static std::atomic<uint32_t> next_slot = 0;
+    thread_local uint32_t slot = next_slot.fetch_add(1, std::memory_order_relaxed) % max_threads;
+    return slot;
+}
+
+inline uint16_t metrics_registry::add_metric(descriptor* names, uint32_t& count, uint32_t max_count, const char* name) noexcept
+{
+    _mutex.lock();
+    if (count >= max_count)
+    {
+        _mutex.unlock();
+        return invalid_index;
+    }
+
+    // Odd while descriptors are being written
+    std::atomic_ref<uint32_t> sequence(_layout->header.sequence);
+    sequence.fetch_add(1, std::memory_order_acq_rel);
+
+    uint16_t index = static_cast<uint16_t>(count);
+    strncpy(names[index].name, name, max_name_length - 1);
+    names[index].name[max_name_length - 1] = '\0';
+    std::atomic_ref<uint32_t>(count).store(count + 1, std::memory_order_relaxed);
+
+    sequence.fetch_add(1, std::memory_order_release);
+    _mutex.unlock();
+
+    return index;
+}
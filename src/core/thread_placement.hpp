@@ -0,0 +1,217 @@
+#pragma once
+
+#include <cctype>
+#include <charconv>
+#include <fstream>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _MSC_VER
+    #include <windows.h>
+#else
+    #include <pthread.h>
+    #include <sched.h>
+#endif // _MSC_VER
+
+
+enum class thread_policy
+{
+    // Threads are left to the OS scheduler
+    none,
+    // Threads are pinned as per thread_layout::automatic
+    automatic
+};
+
+// CPUs each kind of core loop thread is pinned to, threads are assigned round robin and empty
+//  sets leave them unpinned. Memory pools are per thread and first touched by their owner, thus
+//  pinned threads also keep their buffers on their own NUMA node.
+struct thread_layout
+{
+    std::vector<uint16_t> network_cpus;
+    std::vector<uint16_t> core_cpus;
+    std::vector<uint16_t> database_cpus;
+
+    // Network threads go first on the NIC's node, core workers right after them and database
+    //  workers from the other end, which is another node on multi-socket hosts
+    static thread_layout automatic(const char* interface, uint16_t network_threads, uint16_t core_threads, uint16_t database_threads) noexcept;
+};
+
+namespace thread_placement
+{
+    inline bool pin_current_thread(uint16_t cpu) noexcept
+    {
+#ifdef _MSC_VER
+        if (cpu >= 64)
+        {
+            // Processor groups are not supported
+            return false;
+        }
+
+        return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#else
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif // _MSC_VER
+    }
+
+    inline int nodes_count() noexcept
+    {
+#ifdef _MSC_VER
+        ULONG highest;
+        return GetNumaHighestNodeNumber(&highest) ? static_cast<int>(highest) + 1 : 1;
+#else
+        int count = 0;
+        while (std::ifstream("/sys/devices/system/node/node" + std::to_string(count) + "/cpulist"))
+        {
+            ++count;
+        }
+        return count > 0 ? count : 1;
+#endif // _MSC_VER
+    }
+
+    // CPUs of a NUMA node, empty if unknown
+    inline std::vector<uint16_t> node_cpus(int node) noexcept
+    {
+        std::vector<uint16_t> cpus;
+
+#ifdef _MSC_VER
+        ULONGLONG mask;
+        if (GetNumaNodeProcessorMask(static_cast<UCHAR>(node), &mask))
+        {
+            for (uint16_t cpu = 0; cpu < 64; ++cpu)
+            {
+                if (mask & (ULONGLONG(1) << cpu))
+                {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+#else
+        // Formatted as "0-7,16-23", possibly empty or followed by a newline
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string range;
+        while (std::getline(file, range, ','))
+        {
+            auto begin = range.data();
+            auto end = begin + range.size();
+            while (begin < end && std::isspace(static_cast<unsigned char>(*begin)))
+            {
+                ++begin;
+            }
+
+            while (end > begin && std::isspace(static_cast<unsigned char>(*(end - 1))))
+            {
+                --end;
+            }
+
+            if (begin == end)
+            {
+                continue;
+            }
+
+            uint16_t first;
+            auto [separator, error] = std::from_chars(begin, end, first);
+            if (error != std::errc())
+            {
+                continue;
+            }
+
+            uint16_t last = first;
+            if (separator != end)
+            {
+                if (*separator != '-')
+                {
+                    continue;
+                }
+
+                auto [tail, range_error] = std::from_chars(separator + 1, end, last);
+                if (range_error != std::errc() || tail != end || last < first)
+                {
+                    continue;
+                }
+            }
+
+            for (uint32_t cpu = first; cpu <= last; ++cpu)
+            {
+                cpus.push_back(static_cast<uint16_t>(cpu));
+            }
+        }
+#endif // _MSC_VER
+
+        return cpus;
+    }
+
+    // NUMA node the network interface is attached to, -1 if unknown
+    inline int interface_node(const char* interface) noexcept
+    {
+        int node = -1;
+
+#ifndef _MSC_VER
+        if (interface)
+        {
+            std::ifstream file(std::string("/sys/class/net/") + interface + "/device/numa_node");
+            file >> node;
+        }
+#endif // _MSC_VER
+
+        return node;
+    }
+}
+
+
+inline thread_layout thread_layout::automatic(const char* interface, uint16_t network_threads, uint16_t core_threads, uint16_t database_threads) noexcept
+{
+    // Order all CPUs starting by the NIC's node
+    int local = thread_placement::interface_node(interface);
+    if (local < 0)
+    {
+        local = 0;
+    }
+
+    std::vector<uint16_t> cpus = thread_placement::node_cpus(local);
+    int nodes = thread_placement::nodes_count();
+    for (int node = 0; node < nodes; ++node)
+    {
+        if (node != local)
+        {
+            auto remote = thread_placement::node_cpus(node);
+            cpus.insert(cpus.end(), remote.begin(), remote.end());
+        }
+    }
+
+    if (cpus.empty())
+    {
+        for (uint16_t cpu = 0; cpu < std::thread::hardware_concurrency(); ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+
+    thread_layout layout;
+    if (cpus.empty())
+    {
+        return layout;
+    }
+
+    // Hosts with fewer CPUs than threads share some of them
+    for (uint16_t i = 0; i < network_threads; ++i)
+    {
+        layout.network_cpus.push_back(cpus[i % cpus.size()]);
+    }
+
+    for (uint16_t i = 0; i < core_threads; ++i)
+    {
+        layout.core_cpus.push_back(cpus[(network_threads + i) % cpus.size()]);
+    }
+
+    for (uint16_t i = 0; i < database_threads; ++i)
+    {
+        layout.database_cpus.push_back(cpus[cpus.size() - 1 - (i % cpus.size())]);
+    }
+
+    return layout;
+}
@@ -0,0 +1,647 @@
+#pragma once
+
+#include "database/bson_value.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <inttypes.h>
+#include <new>
+#include <string.h>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+
+// Compact binary form of reflection structs for network payloads, driven by the same declaration as
+//  their BSON form. Members are written back to back in declaration order as a bit stream, with
+//  no names nor type tags: bools take a bit, numbers their natural width, strings and vectors a
+//  varint length and then their contents, optionals a presence bit. Encodings can be changed per
+//  member by specializing wire_member, for example:
+//
+//      template <> struct wire_member<player, 1> { using codec = wire_varint; };
+//      template <> struct wire_member<player, 2> { using codec = wire_quantized<-512.0, 512.0, 20>; };
+//
+// Both ends must agree on the declaration, nothing in the format allows evolving it.
+
+class wire_writer
+{
+public:
+    inline wire_writer(uint8_t* data, std::size_t capacity) noexcept;
+
+    inline void write_bits(uint64_t value, uint32_t bits) noexcept;
+    inline void write_varint(uint64_t value) noexcept;
+    inline void write_bytes(const void* data, std::size_t size) noexcept;
+
+    // Flushes any partial byte, returns the number of bytes written
+    inline std::size_t finish() noexcept;
+    inline bool overflowed() const noexcept;
+
+private:
+    inline void write_small(uint64_t value, uint32_t bits) noexcept;
+
+private:
+    uint8_t* _data;
+    std::size_t _capacity;
+    std::size_t _size;
+    uint64_t _scratch;
+    uint32_t _scratch_bits;
+    bool _overflow;
+};
+
+class wire_reader
+{
+public:
+    inline wire_reader(const uint8_t* data, std::size_t size) noexcept;
+
+    inline uint64_t read_bits(uint32_t bits) noexcept;
+    inline uint64_t read_varint() noexcept;
+    inline void read_bytes(void* data, std::size_t size) noexcept;
+
+    // Whole bytes that have not been consumed yet
+    inline std::size_t remaining() const noexcept;
+    inline void fail() noexcept;
+    inline bool failed() const noexcept;
+
+private:
+    inline uint64_t read_small(uint32_t bits) noexcept;
+
+private:
+    const uint8_t* _data;
+    std::size_t _size;
+    std::size_t _offset;
+    uint64_t _scratch;
+    uint32_t _scratch_bits;
+    bool _failed;
+};
+
+// Default encoding of every supported type
+template <typename V>
+struct wire_default
+{
+    static inline void write(wire_writer& writer, const V& value) noexcept;
+    static inline void read(wire_reader& reader, V& value) noexcept;
+
+private:
+    // Allocation failures are reported as corrupt input, reads must not throw
+    template <typename C>
+    static inline bool resize(C& container, uint64_t count) noexcept;
+};
+
+// LEB128 integers, signed ones zigzagged first so that small magnitudes stay small
+struct wire_varint
+{
+    template <typename V>
+    static inline void write(wire_writer& writer, const V& value) noexcept;
+
+    template <typename V>
+    static inline void read(wire_reader& reader, V& value) noexcept;
+};
+
+// Integers (or enums) known to fit in "bits" bits, signed ones are sign extended back
+template <uint32_t bits>
+struct wire_bits
+{
+    static_assert(bits > 0 && bits <= 64, "Invalid bit count");
+
+    template <typename V>
+    static inline void write(wire_writer& writer, const V& value) noexcept;
+
+    template <typename V>
+    static inline void read(wire_reader& reader, V& value) noexcept;
+};
+
+// Floating point values in [min, max], uniformly quantized to "bits" bits
+template <double min, double max, uint32_t bits>
+struct wire_quantized
+{
+    static_assert(min < max, "Empty quantization range");
+    static_assert(bits > 0 && bits <= 32, "Invalid bit count");
+
+    static constexpr double steps = double((uint64_t(1) << bits) - 1);
+    static constexpr double scale = steps / (max - min);
+
+    template <typename V>
+    static inline void write(wire_writer& writer, const V& value) noexcept;
+
+    template <typename V>
+    static inline void read(wire_reader& reader, V& value) noexcept;
+};
+
+// Per member encoding, specialize to opt into a different codec
+template <typename T, std::size_t I>
+struct wire_member
+{
+    using codec = wire_default<typename T::template member_t<I>>;
+};
+
+template <typename T>
+inline void wire_write(wire_writer& writer, const T& object) noexcept;
+
+template <typename T>
+inline void wire_read(wire_reader& reader, T& object) noexcept;
+
+// Encodes into a network buffer, returns false if it didn't fit
+template <typename T, typename B>
+inline bool wire_encode(const T& object, B* buffer) noexcept;
+
+// Returns false if the buffer is truncated or has trailing bytes
+template <typename T, typename B>
+inline bool wire_decode(T& object, const B* buffer) noexcept;
+
+
+inline wire_writer::wire_writer(uint8_t* data, std::size_t capacity) noexcept :
+    _data(data),
+    _capacity(capacity),
+    _size(0),
+    _scratch(0),
+    _scratch_bits(0),
+    _overflow(false)
+{}
+
+inline void wire_writer::write_small(uint64_t value, uint32_t bits) noexcept
+{
+    // At most 32 bits, which always fit with the (less than 8) pending ones
+    _scratch |= (value & ((uint64_t(1) << bits) - 1)) << _scratch_bits;
+    _scratch_bits += bits;
+
+    while (_scratch_bits >= 8)
+    {
+        if (_size < _capacity)
+        {
+            _data[_size] = static_cast<uint8_t>(_scratch);
+        }
+        else
+        {
+            _overflow = true;
+        }
+
+        ++_size;
+        _scratch >>= 8;
+        _scratch_bits -= 8;
+    }
+}
+
+inline void wire_writer::write_bits(uint64_t value, uint32_t bits) noexcept
+{
+    if (bits > 32)
+    {
+        write_small(value, 32);
+        value >>= 32;
+        bits -= 32;
+    }
+
+    write_small(value, bits);
+}
+
+inline void wire_writer::write_varint(uint64_t value) noexcept
+{
+    while (value >= 0x80)
+    {
+        write_small((value & 0x7F) | 0x80, 8);
+        value >>= 7;
+    }
+
+    write_small(value, 8);
+}
+
+inline void wire_writer::write_bytes(const void* data, std::size_t size) noexcept
+{
+    auto bytes = static_cast<const uint8_t*>(data);
+
+    // Aligned streams can copy all at once
+    if (_scratch_bits == 0)
+    {
+        if (_size + size <= _capacity)
+        {
+            memcpy(_data + _size, bytes, size);
+        }
+        else
+        {
+            _overflow = true;
+        }
+
+        _size += size;
+        return;
+    }
+
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        write_small(bytes[i], 8);
+    }
+}
+
+inline std::size_t wire_writer::finish() noexcept
+{
+    if (_scratch_bits > 0)
+    {
+        write_small(0, 8 - _scratch_bits);
+    }
+
+    return std::min(_size, _capacity);
+}
+
+inline bool wire_writer::overflowed() const noexcept
+{
+    return _overflow;
+}
+
+inline wire_reader::wire_reader(const uint8_t* data, std::size_t size) noexcept :
+    _data(data),
+    _size(size),
+    _offset(0),
+    _scratch(0),
+    _scratch_bits(0),
+    _failed(false)
+{}
+
+inline uint64_t wire_reader::read_small(uint32_t bits) noexcept
+{
+    while (_scratch_bits < bits)
+    {
+        if (_offset == _size)
+        {
+            _failed = true;
+            return 0;
+        }
+
+        _scratch |= uint64_t(_data[_offset++]) << _scratch_bits;
+        _scratch_bits += 8;
+    }
+
+    uint64_t value = _scratch & ((uint64_t(1) << bits) - 1);
+    _scratch >>= bits;
+    _scratch_bits -= bits;
+    return value;
+}
+
+inline uint64_t wire_reader::read_bits(uint32_t bits) noexcept
+{
+    if (bits > 32)
+    {
+        uint64_t low = read_small(32);
+        return low | (read_small(bits - 32) << 32);
+    }
+
+    return read_small(bits);
+}
+
+inline uint64_t wire_reader::read_varint() noexcept
+{
+    uint64_t value = 0;
+    for (uint32_t shift = 0; shift < 64; shift += 7)
+    {
+        uint64_t byte = read_small(8);
+        value |= (byte & 0x7F) << shift;
+
+        if (!(byte & 0x80))
+        {
+            return value;
+        }
+    }
+
+    // Too many continuation bytes
+    _failed = true;
+    return 0;
+}
+
+inline void wire_reader::read_bytes(void* data, std::size_t size) noexcept
+{
+    auto bytes = static_cast<uint8_t*>(data);
+
+    if (_scratch_bits == 0)
+    {
+        if (size > _size - _offset)
+        {
+            _failed = true;
+            return;
+        }
+
+        memcpy(bytes, _data + _offset, size);
+        _offset += size;
+        return;
+    }
+
+    for (std::size_t i = 0; i < size; ++i)
+    {
+        bytes[i] = static_cast<uint8_t>(read_small(8));
+    }
+}
+
+inline std::size_t wire_reader::remaining() const noexcept
+{
+    return _size - _offset;
+}
+
+inline void wire_reader::fail() noexcept
+{
+    _failed = true;
+}
+
+inline bool wire_reader::failed() const noexcept
+{
+    return _failed;
+}
+
+template <typename V>
+inline void wire_default<V>::write(wire_writer& writer, const V& value) noexcept
+{
+    if constexpr (bson_value::is_optional<V>::value)
+    {
+        writer.write_bits(value.has_value(), 1);
+        if (value)
+        {
+            wire_default<typename V::value_type>::write(writer, *value);
+        }
+    }
+    else if constexpr (std::is_enum_v<V>)
+    {
+        wire_default<std::underlying_type_t<V>>::write(writer, static_cast<std::underlying_type_t<V>>(value));
+    }
+    else if constexpr (std::is_same_v<V, bool>)
+    {
+        writer.write_bits(value, 1);
+    }
+    else if constexpr (std::is_same_v<V, float>)
+    {
+        writer.write_bits(std::bit_cast<uint32_t>(value), 32);
+    }
+    else if constexpr (std::is_same_v<V, double>)
+    {
+        writer.write_bits(std::bit_cast<uint64_t>(value), 64);
+    }
+    else if constexpr (std::is_integral_v<V>)
+    {
+        writer.write_bits(static_cast<uint64_t>(value), sizeof(V) * 8);
+    }
+    else if constexpr (std::is_same_v<V, std::string> || bson_value::is_packed<V>::value || bson_value::is_blob<V>)
+    {
+        // Contiguous trivially copyable contents go as raw bytes
+        writer.write_varint(value.size());
+        writer.write_bytes(value.data(), value.size() * sizeof(typename V::value_type));
+    }
+    else if constexpr (bson_value::is_vector<V>::value)
+    {
+        writer.write_varint(value.size());
+        for (const auto& item : value)
+        {
+            wire_default<typename V::value_type>::write(writer, item);
+        }
+    }
+    else if constexpr (bson_value::is_array<V>::value)
+    {
+        for (const auto& item : value)
+        {
+            wire_default<typename V::value_type>::write(writer, item);
+        }
+    }
+    else if constexpr (is_bson_reflection_impl<V>)
+    {
+        wire_write(writer, value);
+    }
+    else
+    {
+        static_assert(bson_value::dependent_false<V>, "Type has no wire encoding");
+    }
+}
+
+template <typename V>
+template <typename C>
+inline bool wire_default<V>::resize(C& container, uint64_t count) noexcept
+{
+    try
+    {
+        container.resize(count);
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+template <typename V>
+inline void wire_default<V>::read(wire_reader& reader, V& value) noexcept
+{
+    if constexpr (bson_value::is_optional<V>::value)
+    {
+        if (!reader.read_bits(1))
+        {
+            value.reset();
+            return;
+        }
+
+        if (!value)
+        {
+            value.emplace();
+        }
+        wire_default<typename V::value_type>::read(reader, *value);
+    }
+    else if constexpr (std::is_enum_v<V>)
+    {
+        std::underlying_type_t<V> underlying;
+        wire_default<std::underlying_type_t<V>>::read(reader, underlying);
+        value = static_cast<V>(underlying);
+    }
+    else if constexpr (std::is_same_v<V, bool>)
+    {
+        value = reader.read_bits(1) != 0;
+    }
+    else if constexpr (std::is_same_v<V, float>)
+    {
+        value = std::bit_cast<float>(static_cast<uint32_t>(reader.read_bits(32)));
+    }
+    else if constexpr (std::is_same_v<V, double>)
+    {
+        value = std::bit_cast<double>(reader.read_bits(64));
+    }
+    else if constexpr (std::is_integral_v<V>)
+    {
+        value = static_cast<V>(reader.read_bits(sizeof(V) * 8));
+    }
+    else if constexpr (std::is_same_v<V, std::string> || bson_value::is_packed<V>::value || bson_value::is_blob<V>)
+    {
+        // Bound by what is left, a corrupt length must not allocate arbitrarily nor overflow
+        uint64_t count = reader.read_varint();
+        if (count > reader.remaining() / sizeof(typename V::value_type))
+        {
+            reader.fail();
+            return;
+        }
+
+        if (!resize(value, count))
+        {
+            reader.fail();
+            return;
+        }
+        reader.read_bytes(value.data(), count * sizeof(typename V::value_type));
+    }
+    else if constexpr (bson_value::is_vector<V>::value)
+    {
+        // Reallocations would move structs away from what their references point to
+        static_assert(!is_bson_reflection_impl<typename V::value_type>, "Use std::array for reflected structs");
+
+        // Every item takes at least a bit
+        uint64_t count = reader.read_varint();
+        if (count / 8 > reader.remaining())
+        {
+            reader.fail();
+            return;
+        }
+
+        if (!resize(value, count))
+        {
+            reader.fail();
+            return;
+        }
+
+        for (auto& item : value)
+        {
+            wire_default<typename V::value_type>::read(reader, item);
+        }
+    }
+    else if constexpr (bson_value::is_array<V>::value)
+    {
+        for (auto& item : value)
+        {
+            wire_default<typename V::value_type>::read(reader, item);
+        }
+    }
+    else if constexpr (is_bson_reflection_impl<V>)
+    {
+        wire_read(reader, value);
+    }
+    else
+    {
+        static_assert(bson_value::dependent_false<V>, "Type has no wire encoding");
+    }
+}
+
+template <typename V>
+inline void wire_varint::write(wire_writer& writer, const V& value) noexcept
+{
+    if constexpr (std::is_enum_v<V>)
+    {
+        write(writer, static_cast<std::underlying_type_t<V>>(value));
+    }
+    else if constexpr (std::is_signed_v<V>)
+    {
+        int64_t signed_value = value;
+        writer.write_varint((static_cast<uint64_t>(signed_value) << 1) ^ static_cast<uint64_t>(signed_value >> 63));
+    }
+    else
+    {
+        static_assert(std::is_unsigned_v<V>, "Varints only encode integers");
+        writer.write_varint(value);
+    }
+}
+
+template <typename V>
+inline void wire_varint::read(wire_reader& reader, V& value) noexcept
+{
+    if constexpr (std::is_enum_v<V>)
+    {
+        std::underlying_type_t<V> underlying;
+        read(reader, underlying);
+        value = static_cast<V>(underlying);
+    }
+    else if constexpr (std::is_signed_v<V>)
+    {
+        uint64_t encoded = reader.read_varint();
+        value = static_cast<V>(static_cast<int64_t>(encoded >> 1) ^ -static_cast<int64_t>(encoded & 1));
+    }
+    else
+    {
+        value = static_cast<V>(reader.read_varint());
+    }
+}
+
+template <uint32_t bits>
+template <typename V>
+inline void wire_bits<bits>::write(wire_writer& writer, const V& value) noexcept
+{
+    if constexpr (std::is_enum_v<V>)
+    {
+        write(writer, static_cast<std::underlying_type_t<V>>(value));
+    }
+    else
+    {
+        static_assert(std::is_integral_v<V> && bits <= sizeof(V) * 8, "Value does not fit the bit count");
+        writer.write_bits(static_cast<uint64_t>(value), bits);
+    }
+}
+
+template <uint32_t bits>
+template <typename V>
+inline void wire_bits<bits>::read(wire_reader& reader, V& value) noexcept
+{
+    if constexpr (std::is_enum_v<V>)
+    {
+        std::underlying_type_t<V> underlying;
+        read(reader, underlying);
+        value = static_cast<V>(underlying);
+    }
+    else
+    {
+        uint64_t raw = reader.read_bits(bits);
+        if constexpr (std::is_signed_v<V> && bits < 64)
+        {
+            // Sign extend from the top stored bit
+            uint64_t sign = uint64_t(1) << (bits - 1);
+            raw = (raw ^ sign) - sign;
+        }
+        value = static_cast<V>(raw);
+    }
+}
+
+template <double min, double max, uint32_t bits>
+template <typename V>
+inline void wire_quantized<min, max, bits>::write(wire_writer& writer, const V& value) noexcept
+{
+    static_assert(std::is_floating_point_v<V>, "Only floating point values can be quantized");
+
+    double clamped = std::clamp(static_cast<double>(value), min, max);
+    writer.write_bits(static_cast<uint64_t>((clamped - min) * scale + 0.5), bits);
+}
+
+template <double min, double max, uint32_t bits>
+template <typename V>
+inline void wire_quantized<min, max, bits>::read(wire_reader& reader, V& value) noexcept
+{
+    value = static_cast<V>(min + static_cast<double>(reader.read_bits(bits)) / scale);
+}
+
+template <typename T>
+inline void wire_write(wire_writer& writer, const T& object) noexcept
+{
+    [&writer, &object]<std::size_t... I>(std::index_sequence<I...>) {
+        (wire_member<T, I>::codec::write(writer, std::get<I>(object._refs)), ...);
+    }(std::make_index_sequence<T::members_count>{});
+}
+
+template <typename T>
+inline void wire_read(wire_reader& reader, T& object) noexcept
+{
+    [&reader, &object]<std::size_t... I>(std::index_sequence<I...>) {
+        (wire_member<T, I>::codec::read(reader, std::get<I>(object._refs)), ...);
+    }(std::make_index_sequence<T::members_count>{});
+}
+
+template <typename T, typename B>
+inline bool wire_encode(const T& object, B* buffer) noexcept
+{
+    wire_writer writer(buffer->data, sizeof(buffer->data));
+    wire_write(writer, object);
+
+    buffer->size = static_cast<decltype(buffer->size)>(writer.finish());
+    return !writer.overflowed();
+}
+
+template <typename T, typename B>
+inline bool wire_decode(T& object, const B* buffer) noexcept
+{
+    wire_reader reader(buffer->data, buffer->size);
+    wire_read(reader, object);
+    return !reader.failed() && reader.remaining() == 0;
+}
@@ -0,0 +1,247 @@
+#pragma once
+
+#include "database/bson_reflection_struct.hpp"
+
+#include <mongoc/mongoc.h>
+
+#include <bitset>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+
+// Tracks which members of a reflected struct changed since they were last persisted, and builds
+//  updates that only $set/$unset those. Changes are either marked explicitly, or found by "diff"
+//  against a shadow copy of the persisted values, taken by "snapshot" and refreshed by "commit".
+//  Shadows keep plain copies of values, and the encoded bytes of anything holding nested structs.
+template <typename T>
+class bson_dirty_tracker
+{
+    template <typename M>
+    static constexpr bool copyable_shadow = !bson_value::holds_reflection<M>::value;
+
+    template <typename M>
+    using shadow_t = std::conditional_t<copyable_shadow<M>, M, std::string>;
+
+    template <typename S>
+    struct shadow_of;
+
+    template <std::size_t... I>
+    struct shadow_of<std::index_sequence<I...>>
+    {
+        using type = std::tuple<shadow_t<typename T::template member_t<I>>...>;
+    };
+
+    using shadow_tuple = typename shadow_of<std::make_index_sequence<T::members_count>>::type;
+
+public:
+    bson_dirty_tracker() noexcept;
+
+    template <std::size_t I>
+    inline void mark_dirty() noexcept;
+    inline void mark_dirty(std::size_t index) noexcept;
+
+    // Removes the field from the persisted document on the next update
+    template <std::size_t I>
+    inline void mark_unset() noexcept;
+    inline void mark_unset(std::size_t index) noexcept;
+
+    inline bool is_dirty() const noexcept;
+    inline bool is_dirty(std::size_t index) const noexcept;
+
+    // Takes the current values as persisted, enabling "diff"
+    void snapshot(T& object) noexcept;
+
+    // Marks dirty all members that differ from the shadow copy, returns whether anything is dirty
+    bool diff(T& object) noexcept;
+
+    // Writes {$set: {...}, $unset: {...}} into "update" (which must be initialized) for all
+    //  dirty members, returns false if there was nothing to write
+    bool build_update(T& object, bson_t* update) noexcept;
+
+    // Changes were persisted, clears them and refreshes their shadow copies
+    void commit(T& object) noexcept;
+
+private:
+    template <std::size_t I>
+    inline void store_shadow(T& object) noexcept;
+
+    template <std::size_t I>
+    inline bool differs(T& object) noexcept;
+
+    static inline void encode(T& object, std::size_t index, std::string& out) noexcept;
+
+private:
+    std::bitset<T::members_count> _dirty;
+    std::bitset<T::members_count> _unset;
+    bool _has_shadow;
+    shadow_tuple _shadow;
+};
+
+
+template <typename T>
+bson_dirty_tracker<T>::bson_dirty_tracker() noexcept :
+    _dirty(),
+    _unset(),
+    _has_shadow(false),
+    _shadow()
+{}
+
+template <typename T>
+template <std::size_t I>
+inline void bson_dirty_tracker<T>::mark_dirty() noexcept
+{
+    static_assert(I < T::members_count, "Member index out of range");
+    mark_dirty(I);
+}
+
+template <typename T>
+inline void bson_dirty_tracker<T>::mark_dirty(std::size_t index) noexcept
+{
+    _dirty.set(index);
+    _unset.reset(index);
+}
+
+template <typename T>
+template <std::size_t I>
+inline void bson_dirty_tracker<T>::mark_unset() noexcept
+{
+    static_assert(I < T::members_count, "Member index out of range");
+    mark_unset(I);
+}
+
+template <typename T>
+inline void bson_dirty_tracker<T>::mark_unset(std::size_t index) noexcept
+{
+    _dirty.set(index);
+    _unset.set(index);
+}
+
+template <typename T>
+inline bool bson_dirty_tracker<T>::is_dirty() const noexcept
+{
+    return _dirty.any();
+}
+
+template <typename T>
+inline bool bson_dirty_tracker<T>::is_dirty(std::size_t index) const noexcept
+{
+    return _dirty.test(index);
+}
+
+template <typename T>
+void bson_dirty_tracker<T>::snapshot(T& object) noexcept
+{
+    _has_shadow = true;
+
+    [this, &object]<std::size_t... I>(std::index_sequence<I...>) {
+        (store_shadow<I>(object), ...);
+    }(std::make_index_sequence<T::members_count>{});
+}
+
+template <typename T>
+bool bson_dirty_tracker<T>::diff(T& object) noexcept
+{
+    assert(_has_shadow && "Diffing requires a snapshot");
+
+    [this, &object]<std::size_t... I>(std::index_sequence<I...>) {
+        ((!_dirty.test(I) && differs<I>(object) && (mark_dirty(I), true)), ...);
+    }(std::make_index_sequence<T::members_count>{});
+
+    return _dirty.any();
+}
+
+template <typename T>
+bool bson_dirty_tracker<T>::build_update(T& object, bson_t* update) noexcept
+{
+    if (_dirty.none())
+    {
+        return false;
+    }
+
+    auto changed = _dirty & ~_unset;
+    if (changed.any())
+    {
+        bson_t set;
+        BSON_APPEND_DOCUMENT_BEGIN(update, "$set", &set);
+        for (std::size_t i = 0; i < T::members_count; ++i)
+        {
+            if (changed.test(i))
+            {
+                object.serialize_member(i, &set);
+            }
+        }
+        bson_append_document_end(update, &set);
+    }
+
+    if (_unset.any())
+    {
+        bson_t unset;
+        BSON_APPEND_DOCUMENT_BEGIN(update, "$unset", &unset);
+        for (std::size_t i = 0; i < T::members_count; ++i)
+        {
+            if (_unset.test(i))
+            {
+                auto key = T::key_of(i);
+                bson_append_utf8(&unset, key.data(), static_cast<int>(key.size()), "", 0);
+            }
+        }
+        bson_append_document_end(update, &unset);
+    }
+
+    return true;
+}
+
+template <typename T>
+void bson_dirty_tracker<T>::commit(T& object) noexcept
+{
+    if (_has_shadow)
+    {
+        [this, &object]<std::size_t... I>(std::index_sequence<I...>) {
+            ((_dirty.test(I) && (store_shadow<I>(object), true)), ...);
+        }(std::make_index_sequence<T::members_count>{});
+    }
+
+    _dirty.reset();
+    _unset.reset();
+}
+
+template <typename T>
+template <std::size_t I>
+inline void bson_dirty_tracker<T>::store_shadow(T& object) noexcept
+{
+    if constexpr (!copyable_shadow<typename T::template member_t<I>>)
+    {
+        encode(object, I, std::get<I>(_shadow));
+    }
+    else
+    {
+        std::get<I>(_shadow) = std::get<I>(object._refs);
+    }
+}
+
+template <typename T>
+template <std::size_t I>
+inline bool bson_dirty_tracker<T>::differs(T& object) noexcept
+{
+    if constexpr (!copyable_shadow<typename T::template member_t<I>>)
+    {
+        std::string current;
+        encode(object, I, current);
+        return current != std::get<I>(_shadow);
+    }
+    else
+    {
+        return std::get<I>(object._refs) != std::get<I>(_shadow);
+    }
+}
+
+template <typename T>
+inline void bson_dirty_tracker<T>::encode(T& object, std::size_t index, std::string& out) noexcept
+{
+    bson_t doc = BSON_INITIALIZER;
+    object.serialize_member(index, &doc);
+    out.assign(reinterpret_cast<const char*>(bson_get_data(&doc)), doc.len);
+    bson_destroy(&doc);
+}
@@ -0,0 +1,261 @@
+#pragma once
+
+#include "database/bson_utils.hpp"
+#include "traits/string_literal.hpp"
+
+#include <mongoc/mongoc.h>
+
+#include <array>
+#include <cstddef>
+#include <inttypes.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+// Index declarations for reflection structs, checked against their members at compile time and
+//  created by database::add_collection<T> when missing. Types declare them (and the fields their
+//  hot queries filter by, which must be covered by some index) as:
+//
+//      static constexpr auto indexes = std::make_tuple(
+//          bson_index<"guild", "-level">{},
+//          bson_index<"name">{ .unique = true },
+//          bson_index<"created_at">{ .expire_after_seconds = 3600 });
+//
+//      static constexpr auto queries = std::make_tuple(bson_query<"guild">{});
+//
+// Keys starting with '-' are descending, and dotted keys index members of nested structs.
+template <StringLiteral... Keys>
+struct bson_index
+{
+    static_assert(sizeof...(Keys) > 0, "Indexes need at least one key");
+
+    static constexpr std::array<std::string_view, sizeof...(Keys)> keys {
+        std::string_view(Keys.value, sizeof(Keys.value) - 1)...
+    };
+
+    bool unique = false;
+    bool sparse = false;
+    int64_t expire_after_seconds = -1;
+
+    static constexpr std::string_view field(std::string_view key)
+    {
+        return key.starts_with('-') ? key.substr(1) : key;
+    }
+
+    // Same as the server's default, "field_1_other_-1"
+    static inline std::string name()
+    {
+        std::string name;
+        for (auto key : keys)
+        {
+            if (!name.empty())
+            {
+                name += '_';
+            }
+
+            name += field(key);
+            name += key.starts_with('-') ? "_-1" : "_1";
+        }
+        return name;
+    }
+
+    // Writes the createIndexes specification of this index into "spec"
+    inline void append_spec(bson_t* spec) const
+    {
+        assert((expire_after_seconds < 0 || keys.size() == 1) && "TTL indexes must have a single key");
+
+        bson_t key;
+        BSON_APPEND_DOCUMENT_BEGIN(spec, "key", &key);
+        for (auto k : keys)
+        {
+            auto name = field(k);
+            bson_append_int32(&key, name.data(), static_cast<int>(name.size()), k.starts_with('-') ? -1 : 1);
+        }
+        bson_append_document_end(spec, &key);
+
+        BSON_APPEND_UTF8(spec, "name", name().c_str());
+
+        if (unique)
+        {
+            BSON_APPEND_BOOL(spec, "unique", true);
+        }
+
+        if (sparse)
+        {
+            BSON_APPEND_BOOL(spec, "sparse", true);
+        }
+
+        if (expire_after_seconds >= 0)
+        {
+            BSON_APPEND_INT64(spec, "expireAfterSeconds", expire_after_seconds);
+        }
+    }
+};
+
+// Fields a hot query filters by
+template <StringLiteral... Fields>
+struct bson_query
+{
+    static constexpr std::array<std::string_view, sizeof...(Fields)> fields {
+        std::string_view(Fields.value, sizeof(Fields.value) - 1)...
+    };
+};
+
+namespace bson_schema
+{
+    template <typename T>
+    constexpr bool has_indexes = requires { T::indexes; };
+
+    template <typename T>
+    constexpr bool has_queries = requires { T::queries; };
+
+    template <typename T, typename F>
+    constexpr bool all_indexes(F&& predicate)
+    {
+        if constexpr (has_indexes<T>)
+        {
+            using tuple_t = std::remove_cvref_t<decltype(T::indexes)>;
+            return []<std::size_t... I>(F& predicate, std::index_sequence<I...>) {
+                return (predicate(std::tuple_element_t<I, tuple_t>{}) && ...);
+            }(predicate, std::make_index_sequence<std::tuple_size_v<tuple_t>>{});
+        }
+        else
+        {
+            return true;
+        }
+    }
+
+    // Only the first path component can be checked, nested structs don't expose their types
+    template <typename T>
+    constexpr bool is_member(std::string_view key)
+    {
+        auto path = key.substr(0, key.find('.'));
+        return path == "_id" || T::has_member(path);
+    }
+
+    template <typename T>
+    constexpr bool indexes_are_members()
+    {
+        return all_indexes<T>([](auto index) {
+            for (auto key : index.keys)
+            {
+                if (!is_member<T>(index.field(key)))
+                {
+                    return false;
+                }
+            }
+            return true;
+        });
+    }
+
+    // Queries can use an index as long as they filter by its first key
+    template <typename T, typename Q>
+    constexpr bool is_covered(const Q& query)
+    {
+        for (auto field : query.fields)
+        {
+            if (field == "_id")
+            {
+                return true;
+            }
+        }
+
+        return !all_indexes<T>([&query](auto index) {
+            for (auto field : query.fields)
+            {
+                if (field == index.field(index.keys[0]))
+                {
+                    return false;
+                }
+            }
+            return true;
+        });
+    }
+
+    template <typename T>
+    constexpr bool queries_are_covered()
+    {
+        if constexpr (has_queries<T>)
+        {
+            using tuple_t = std::remove_cvref_t<decltype(T::queries)>;
+            return []<std::size_t... I>(std::index_sequence<I...>) {
+                return (is_covered<T>(std::tuple_element_t<I, tuple_t>{}) && ...);
+            }(std::make_index_sequence<std::tuple_size_v<tuple_t>>{});
+        }
+        else
+        {
+            return true;
+        }
+    }
+
+    // Heap specifications of all declared indexes, to be sent in a createIndexes command
+    template <typename T>
+    std::vector<bson_t*> index_specs()
+    {
+        std::vector<bson_t*> specs;
+
+        if constexpr (has_indexes<T>)
+        {
+            std::apply([&specs](const auto&... index) {
+                ((specs.push_back(bson_new()), index.append_spec(specs.back())), ...);
+            }, T::indexes);
+        }
+
+        return specs;
+    }
+
+    // Name of a declared or listed index, empty if it has none
+    inline std::string index_name(const bson_t* index)
+    {
+        bson_iter_t iter;
+        if (bson_iter_init_find(&iter, index, "name") && BSON_ITER_HOLDS_UTF8(&iter))
+        {
+            return bson_iter_utf8(&iter, NULL);
+        }
+        return {};
+    }
+
+    // Same fields in the same order and directions, the server might list them as other numeric types
+    inline bool same_keys(const bson_t* a, const bson_t* b)
+    {
+        bson_iter_t iter_a, iter_b, key_a, key_b;
+        if (!bson_iter_init_find(&iter_a, a, "key") || !BSON_ITER_HOLDS_DOCUMENT(&iter_a) || !bson_iter_recurse(&iter_a, &key_a) ||
+            !bson_iter_init_find(&iter_b, b, "key") || !BSON_ITER_HOLDS_DOCUMENT(&iter_b) || !bson_iter_recurse(&iter_b, &key_b))
+        {
+            return false;
+        }
+
+        while (true)
+        {
+            bool next_a = bson_iter_next(&key_a);
+            bool next_b = bson_iter_next(&key_b);
+            if (!next_a || !next_b)
+            {
+                return next_a == next_b;
+            }
+
+            if (strcmp(bson_iter_key(&key_a), bson_iter_key(&key_b)) != 0 || !bson_utils::values_equal(&key_a, &key_b))
+            {
+                return false;
+            }
+        }
+    }
+
+    // Options bson_index can declare, missing ones take the server's defaults
+    inline bool same_options(const bson_t* a, const bson_t* b)
+    {
+        auto option = [](const bson_t* index, const char* name, int64_t missing) {
+            bson_iter_t iter;
+            return bson_iter_init_find(&iter, index, name) ? bson_iter_as_int64(&iter) : missing;
+        };
+
+        return option(a, "unique", 0) == option(b, "unique", 0) &&
+            option(a, "sparse", 0) == option(b, "sparse", 0) &&
+            option(a, "expireAfterSeconds", -1) == option(b, "expireAfterSeconds", -1);
+    }
+}
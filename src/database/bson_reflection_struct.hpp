@@ -1,33 +1,22 @@
 #pragma once
 
+#include "database/bson_value.hpp"
+#include "database/perfect_hash.hpp"
 #include "traits/string_literal.hpp"
 #include "traits/is_specialization.hpp"
 
 #include <mongoc/mongoc.h>
 
+#include <array>
 #include <inttypes.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <tuple>
 #include <type_traits>
+#include <utility>
 
 
-constexpr uint32_t hash_of_c_string(const char* str)
-{
-    uint32_t hash = 2166136261;
-
-    while (char c = *str++)
-    {
-        hash = hash ^ c;
-        hash = hash * 16777619;
-    }
-
-    return hash;
-}
-
-template <typename T>
-concept is_bson_reflection_impl = requires (T v, bson_iter_t* i)
-{
-    { v.visit_all(i) };
-};
-
 template <typename T, StringLiteral... MemberNames>
 struct bson_reflection_struct
 {
@@ -35,157 +24,94 @@ struct bson_reflection_struct
     struct impl
     {
         constexpr impl(std::add_lvalue_reference_t<MemberTypes>... refs) :
-            _refs(refs...),
-            _visitor {
-                .visit_double = [](const bson_iter_t* iter, const char* key, double v_double, void* data)
-                    {
-                        return reinterpret_cast<T*>(data)->visit_double(iter, key, v_double, data);
-                    },
-                .visit_utf8 = [](const bson_iter_t* iter, const char* key, size_t v_utf8_len, const char* v_utf8, void* data)
-                    {
-                        return reinterpret_cast<T*>(data)->visit_utf8(iter, key, v_utf8_len, v_utf8, data);
-                    },
-                 .visit_document = [](const bson_iter_t* iter, const char* key, const bson_t* v_document, void* data)
-                    {
-                        return reinterpret_cast<T*>(data)->visit_document(iter, key, v_document, data);
-                    },
-                .visit_bool = [](const bson_iter_t* iter, const char* key, bool v_bool, void* data)
-                    {
-                        return reinterpret_cast<T*>(data)->visit_bool(iter, key, v_bool, data);
-                    },
-                .visit_int32 = [](const bson_iter_t* iter, const char* key, int32_t v_int32, void* data)
-                    {
-                        return reinterpret_cast<T*>(data)->visit_int32(iter, key, v_int32, data);
-                    },
-                .visit_int64 = [](const bson_iter_t* iter, const char* key, int64_t v_int64, void* data)
-                    {
-                        return reinterpret_cast<T*>(data)->visit_int64(iter, key, v_int64, data);
-                    }
-            }
+            _refs(refs...)
         {}
 
-        template <std::size_t I, typename V>
-        constexpr inline bool check_and_store(uint32_t hash, void* data)
-        {
-            using type = std::decay_t<std::tuple_element_t<I, std::tuple<MemberTypes...>>>;
-            if constexpr (std::is_convertible_v<type, V> || std::is_same_v<type, V>)
-            {
-                if (std::get<I>(hashes) == hash)
-                {
-                    std::get<I>(_refs) = *reinterpret_cast<V*>(data);
-                    return true;
-                }
-            }
-            else
-            {
-                assert(std::get<I>(hashes) != hash && "Matching key is not the same type");
-            }
-
-            if constexpr (I + 1 < sizeof...(MemberTypes))
-            {
-                return check_and_store<I + 1, V>(hash, data);
-            }
-            else
-            {
-                // Element not in struct, continue
-                return true;
-            }
-        }
-
         template <std::size_t I>
-        constexpr inline bool check_and_store_string(uint32_t hash, size_t len, const char* data)
-        {
-            using type = std::decay_t<std::tuple_element_t<I, std::tuple<MemberTypes...>>>;
-            if constexpr (std::is_same_v<type, std::string>)
-            {
-                if (std::get<I>(hashes) == hash)
-                {
-                    std::get<I>(_refs) = std::string(data, len);
-                    return true;
-                }
-            }
-            else
-            {
-                assert(std::get<I>(hashes) != hash && "Matching key is not a string");
-            }
+        using member_t = std::decay_t<std::tuple_element_t<I, std::tuple<MemberTypes...>>>;
 
-            if constexpr (I + 1 < sizeof...(MemberTypes))
-            {
-                return check_and_store_string<I + 1>(hash, len, data);
-            }
-            else
+        // Shared by the visitor and the raw decoder. The fold compares the index against every member
+        //  at compile time, thus compilers turn it into a switch with each store inlined.
+        inline void read_member(int index, const bson_value::element& element)
+        {
+            if (index < 0)
             {
                 // Element not in struct, continue
-                return true;
+                return;
             }
+
+            bool stored = [this, index, &element]<std::size_t... I>(std::index_sequence<I...>) {
+                bool stored = false;
+                ((static_cast<std::size_t>(index) == I && (stored = bson_value::read(element, std::get<I>(_refs)), true)) || ...);
+                return stored;
+            }(std::make_index_sequence<sizeof...(MemberTypes)>{});
+            assert(stored && "Matching key is not the same type");
         }
 
-        template <std::size_t I>
-        constexpr inline bool check_and_recurse(uint32_t hash, const bson_t* doc)
+        inline void store(const char* key, const bson_value::element& element)
         {
-            using type = std::decay_t<std::tuple_element_t<I, std::tuple<MemberTypes...>>>;
-            if constexpr (is_bson_reflection_impl<type>)
-            {
-                bson_iter_t iter;
-                if (bson_iter_init(&iter, doc))
-                {
-                    std::get<I>(_refs).visit_all(&iter);
-                }
-                return true;
-            }
-            else
-            {
-                assert(std::get<I>(hashes) != hash && "Matching key is not a document");
-            }
-
-            if constexpr (I + 1 < sizeof...(MemberTypes))
-            {
-                return check_and_recurse<I + 1>(hash, doc);
-            }
-            else
-            {
-                // Element not in struct, continue
-                return true;
-            }
+            read_member(lookup.find(key, strlen(key)), element);
         }
 
         bool visit_double(const bson_iter_t* iter, const char* key, double v_double, void* data)
         {
-            auto hash = hash_of_c_string(key);
-            return !check_and_store<0, double>(hash, reinterpret_cast<void*>(&v_double));
+            double value = BSON_DOUBLE_TO_LE(v_double);
+            store(key, { BSON_TYPE_DOUBLE, BSON_SUBTYPE_BINARY, reinterpret_cast<const uint8_t*>(&value), sizeof(value) });
+            return false;
         }
 
         bool visit_utf8(const bson_iter_t* iter, const char* key, size_t v_utf8_len, const char* v_utf8, void* data)
         {
-            auto hash = hash_of_c_string(key);
-            return !check_and_store_string<0>(hash, v_utf8_len, v_utf8);
+            store(key, { BSON_TYPE_UTF8, BSON_SUBTYPE_BINARY, reinterpret_cast<const uint8_t*>(v_utf8), static_cast<uint32_t>(v_utf8_len) });
+            return false;
         }
 
         bool visit_document(const bson_iter_t* iter, const char* key, const bson_t* v_document, void* data)
         {
-            auto hash = hash_of_c_string(key);
-            return !check_and_recurse<0>(hash, v_document);
+            store(key, { BSON_TYPE_DOCUMENT, BSON_SUBTYPE_BINARY, bson_get_data(v_document), v_document->len });
+            return false;
+        }
+
+        bool visit_array(const bson_iter_t* iter, const char* key, const bson_t* v_array, void* data)
+        {
+            store(key, { BSON_TYPE_ARRAY, BSON_SUBTYPE_BINARY, bson_get_data(v_array), v_array->len });
+            return false;
+        }
+
+        bool visit_binary(const bson_iter_t* iter, const char* key, bson_subtype_t v_subtype, size_t v_binary_len, const uint8_t* v_binary, void* data)
+        {
+            store(key, { BSON_TYPE_BINARY, v_subtype, v_binary, static_cast<uint32_t>(v_binary_len) });
+            return false;
         }
 
         bool visit_bool(const bson_iter_t* iter, const char* key, bool v_bool, void* data)
         {
-            auto hash = hash_of_c_string(key);
-            return !check_and_store<0, bool>(hash, reinterpret_cast<void*>(&v_bool));
+            uint8_t value = v_bool;
+            store(key, { BSON_TYPE_BOOL, BSON_SUBTYPE_BINARY, &value, sizeof(value) });
+            return false;
+        }
+
+        bool visit_null(const bson_iter_t* iter, const char* key, void* data)
+        {
+            store(key, { BSON_TYPE_NULL, BSON_SUBTYPE_BINARY, nullptr, 0 });
+            return false;
         }
 
         bool visit_int32(const bson_iter_t* iter, const char* key, int32_t v_int32, void* data)
         {
-            auto hash = hash_of_c_string(key);
-            return !check_and_store<0, int32_t>(hash, reinterpret_cast<void*>(&v_int32));
+            uint32_t value = BSON_UINT32_TO_LE(static_cast<uint32_t>(v_int32));
+            store(key, { BSON_TYPE_INT32, BSON_SUBTYPE_BINARY, reinterpret_cast<const uint8_t*>(&value), sizeof(value) });
+            return false;
         }
 
         bool visit_int64(const bson_iter_t* iter, const char* key, int64_t v_int64, void* data)
         {
-            auto hash = hash_of_c_string(key);
-            return !check_and_store<0, int64_t>(hash, reinterpret_cast<void*>(&v_int64));
+            uint64_t value = BSON_UINT64_TO_LE(static_cast<uint64_t>(v_int64));
+            store(key, { BSON_TYPE_INT64, BSON_SUBTYPE_BINARY, reinterpret_cast<const uint8_t*>(&value), sizeof(value) });
+            return false;
         }
 
-        inline bson_visitor_t* visitor()
+        static inline const bson_visitor_t* visitor()
         {
             return &_visitor;
         }
@@ -206,8 +132,23 @@ struct bson_reflection_struct
             return false;
         }
 
+        // Walks the raw BSON bytes and switches on the type tag, so that the whole walk can be
+        //  inlined instead of going through one indirect call per element
+        inline bool decode(const uint8_t* data, uint32_t length)
+        {
+            return bson_value::for_each_element(data, length, [this](const char* key, std::size_t key_length, const bson_value::element& element) {
+                read_member(lookup.find(key, key_length), element);
+                return true;
+            });
+        }
+
+        inline bool decode(const bson_t* doc)
+        {
+            return decode(bson_get_data(doc), doc->len);
+        }
+
         template <std::size_t I>
-        inline void fields_impl(bson_t* doc)
+        static inline void fields_impl(bson_t* doc)
         {
             BSON_APPEND_INT32(doc, std::get<I>(names).value, 1);
 
@@ -217,67 +158,160 @@ struct bson_reflection_struct
             }
         }
 
-        inline bson_t* fields()
+        static inline bson_t* fields()
         {
-            if (!_fields_init)
-            {
-                _fields_init = true;
-                fields_impl<0>(&_fields);
-            }
-            return &_fields;
+            // Queries might be built concurrently from many database fibers, initialize only once
+            static bson_t* fields = []() {
+                bson_t* doc = bson_new();
+                fields_impl<0>(doc);
+                return doc;
+            }();
+            return fields;
         }
 
         template <std::size_t I>
-        inline void serialize_impl(bson_t* doc)
+        inline void serialize_member(bson_t* doc) const
         {
-            using type = std::decay_t<std::tuple_element<I, std::tuple<MemberTypes...>>>;
-            if constexpr (std::is_same_v<type, double>)
-            {
-                BSON_APPEND_DOUBLE(doc, std::get<I>(names).value, std::get<I>(_refs));
-            }
-            else if constexpr (std::is_same_v<type, std::string>)
-            {
-                BSON_APPEND_UTF8(doc, std::get<I>(names).value, std::get<I>(_refs).c_str());
-            }
-            else if constexpr (std::is_same_v<type, bool>)
-            {
-                BSON_APPEND_BOOL(doc, std::get<I>(names).value, std::get<I>(_refs));
-            }
-            else if constexpr (std::is_same_v<type, int32_t>)
-            {
-                BSON_APPEND_INT32(doc, std::get<I>(names).value, std::get<I>(_refs));
-            }
-            else if constexpr (std::is_same_v<type, int64_t>)
+            // Keys and strings carry their lengths, libbson doesn't have to look for terminators
+            constexpr std::string_view key = lookup.keys[I];
+            bson_value::append(doc, key.data(), static_cast<int>(key.size()), std::get<I>(_refs));
+        }
+
+        // Encoded size of a member: type tag, key and its terminator, then the value
+        template <std::size_t I>
+        inline uint32_t member_size() const
+        {
+            return bson_value::size(static_cast<uint32_t>(lookup.keys[I].size()), std::get<I>(_refs));
+        }
+
+        inline void serialize_member(std::size_t index, bson_t* doc) const
+        {
+            [this, index, doc]<std::size_t... I>(std::index_sequence<I...>) {
+                (void)((index == I && (serialize_member<I>(doc), true)) || ...);
+            }(std::make_index_sequence<sizeof...(MemberTypes)>{});
+        }
+
+        template <std::size_t I>
+        inline void serialize_impl(bson_t* doc) const
+        {
+            serialize_member<I>(doc);
+
+            if constexpr (I + 1 < sizeof...(MemberTypes))
             {
-                BSON_APPEND_INT64(doc, std::get<I>(names).value, std::get<I>(_refs));
+                serialize_impl<I + 1>(doc);
             }
-            else
+        }
+
+        // Appends all members to "doc", which can be reused between calls through bson_reinit
+        inline void serialize(bson_t* doc) const
+        {
+            if constexpr (sizeof...(MemberTypes) > 0)
             {
-                bson_t child;
-                BSON_APPEND_DOCUMENT_BEGIN(doc, std::get<I>(names).value, &child);
-                std::get<I>(_refs).template serialize_impl<0>(&child);
-                bson_append_document_end(doc, &child);
+                serialize_impl<0>(doc);
             }
+        }
 
-            if constexpr (I + 1 < sizeof...(MemberTypes))
+        // Writes a whole document into the writer's buffer, many structs can share the same one
+        inline bool serialize(bson_writer_t* writer) const
+        {
+            bson_t* doc;
+            if (!bson_writer_begin(writer, &doc))
             {
-                serialize_impl<I + 1>(doc);
+                return false;
             }
+
+            serialize(doc);
+            bson_writer_end(writer);
+            return true;
         }
 
-        inline bson_t serialize()
+        inline bson_t serialize() const
         {
             bson_t doc = BSON_INITIALIZER;
-            serialize_impl<0>(&doc);
+            serialize(&doc);
             return doc;
         }
 
+        // Exact number of bytes "serialize" writes, so that buffers can be sized up front
+        inline uint32_t serialized_size() const
+        {
+            return [this]<std::size_t... I>(std::index_sequence<I...>) {
+                return (uint32_t(5) + ... + member_size<I>());
+            }(std::make_index_sequence<sizeof...(MemberTypes)>{});
+        }
+
+        static inline int index_of(const char* key)
+        {
+            return lookup.find(key, strlen(key));
+        }
+
+        static constexpr std::string_view key_of(std::size_t index)
+        {
+            return lookup.keys[index];
+        }
+
+        // Compile time counterpart of "index_of", for schema checks
+        static constexpr bool has_member(std::string_view key)
+        {
+            for (auto name : lookup.keys)
+            {
+                if (name == key)
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static constexpr std::size_t members_count = sizeof...(MemberTypes);
+
         std::tuple<std::add_lvalue_reference_t<MemberTypes>...> _refs;
-        bson_visitor_t _visitor;
+
+        // Handlers don't capture anything, a single table serves all instances
+        static constexpr bson_visitor_t _visitor {
+            .visit_double = [](const bson_iter_t* iter, const char* key, double v_double, void* data)
+                {
+                    return reinterpret_cast<T*>(data)->visit_double(iter, key, v_double, data);
+                },
+            .visit_utf8 = [](const bson_iter_t* iter, const char* key, size_t v_utf8_len, const char* v_utf8, void* data)
+                {
+                    return reinterpret_cast<T*>(data)->visit_utf8(iter, key, v_utf8_len, v_utf8, data);
+                },
+            .visit_document = [](const bson_iter_t* iter, const char* key, const bson_t* v_document, void* data)
+                {
+                    return reinterpret_cast<T*>(data)->visit_document(iter, key, v_document, data);
+                },
+            .visit_array = [](const bson_iter_t* iter, const char* key, const bson_t* v_array, void* data)
+                {
+                    return reinterpret_cast<T*>(data)->visit_array(iter, key, v_array, data);
+                },
+            .visit_binary = [](const bson_iter_t* iter, const char* key, bson_subtype_t v_subtype, size_t v_binary_len, const uint8_t* v_binary, void* data)
+                {
+                    return reinterpret_cast<T*>(data)->visit_binary(iter, key, v_subtype, v_binary_len, v_binary, data);
+                },
+            .visit_bool = [](const bson_iter_t* iter, const char* key, bool v_bool, void* data)
+                {
+                    return reinterpret_cast<T*>(data)->visit_bool(iter, key, v_bool, data);
+                },
+            .visit_null = [](const bson_iter_t* iter, const char* key, void* data)
+                {
+                    return reinterpret_cast<T*>(data)->visit_null(iter, key, data);
+                },
+            .visit_int32 = [](const bson_iter_t* iter, const char* key, int32_t v_int32, void* data)
+                {
+                    return reinterpret_cast<T*>(data)->visit_int32(iter, key, v_int32, data);
+                },
+            .visit_int64 = [](const bson_iter_t* iter, const char* key, int64_t v_int64, void* data)
+                {
+                    return reinterpret_cast<T*>(data)->visit_int64(iter, key, v_int64, data);
+                }
+        };
     };
 
     static inline auto names = std::tuple(MemberNames...);
-    static inline auto hashes = std::tuple(MemberNames.hash()...);
-    static inline bson_t _fields = BSON_INITIALIZER;
-    static inline bool _fields_init = false;
+
+    // Resolves keys to member indices
+    static constexpr perfect_hash<sizeof...(MemberNames)> lookup {
+        std::array<std::string_view, sizeof...(MemberNames)> { std::string_view(MemberNames.value, sizeof(MemberNames.value) - 1)... }
+    };
 };
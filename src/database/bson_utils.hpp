@@ -0,0 +1,451 @@
+#pragma once
+
+#include <mongoc/mongoc.h>
+
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+
+// Minimal subset of MongoDB query semantics, enough to emulate a server in-process
+//  * Filters only support (possibly dotted) equality matches
+//  * Updates support top-level $set, $unset and $inc, or full document replacement
+//  * Projections only support top-level inclusion
+namespace bson_utils
+{
+    inline bool is_numeric(bson_type_t type)
+    {
+        return type == BSON_TYPE_INT32 || type == BSON_TYPE_INT64 || type == BSON_TYPE_DOUBLE;
+    }
+
+    inline bool values_equal(const bson_iter_t* a, const bson_iter_t* b)
+    {
+        auto type_a = bson_iter_type(a);
+        auto type_b = bson_iter_type(b);
+
+        // Numbers compare by value, regardless of their representation
+        if (is_numeric(type_a) && is_numeric(type_b))
+        {
+            if (type_a == BSON_TYPE_DOUBLE || type_b == BSON_TYPE_DOUBLE)
+            {
+                return bson_iter_as_double(a) == bson_iter_as_double(b);
+            }
+
+            return bson_iter_as_int64(a) == bson_iter_as_int64(b);
+        }
+
+        if (type_a != type_b)
+        {
+            return false;
+        }
+
+        switch (type_a)
+        {
+            case BSON_TYPE_UTF8:
+            {
+                uint32_t len_a, len_b;
+                const char* str_a = bson_iter_utf8(a, &len_a);
+                const char* str_b = bson_iter_utf8(b, &len_b);
+                return len_a == len_b && memcmp(str_a, str_b, len_a) == 0;
+            }
+
+            case BSON_TYPE_DOCUMENT:
+            case BSON_TYPE_ARRAY:
+            {
+                uint32_t len_a, len_b;
+                const uint8_t* data_a;
+                const uint8_t* data_b;
+                if (type_a == BSON_TYPE_DOCUMENT)
+                {
+                    bson_iter_document(a, &len_a, &data_a);
+                    bson_iter_document(b, &len_b, &data_b);
+                }
+                else
+                {
+                    bson_iter_array(a, &len_a, &data_a);
+                    bson_iter_array(b, &len_b, &data_b);
+                }
+                return len_a == len_b && memcmp(data_a, data_b, len_a) == 0;
+            }
+
+            case BSON_TYPE_BINARY:
+            {
+                bson_subtype_t subtype_a, subtype_b;
+                uint32_t len_a, len_b;
+                const uint8_t* data_a;
+                const uint8_t* data_b;
+                bson_iter_binary(a, &subtype_a, &len_a, &data_a);
+                bson_iter_binary(b, &subtype_b, &len_b, &data_b);
+                return subtype_a == subtype_b && len_a == len_b && memcmp(data_a, data_b, len_a) == 0;
+            }
+
+            case BSON_TYPE_BOOL:
+                return bson_iter_bool(a) == bson_iter_bool(b);
+
+            case BSON_TYPE_OID:
+                return bson_oid_equal(bson_iter_oid(a), bson_iter_oid(b));
+
+            case BSON_TYPE_DATE_TIME:
+                return bson_iter_date_time(a) == bson_iter_date_time(b);
+
+            case BSON_TYPE_NULL:
+            case BSON_TYPE_UNDEFINED:
+            case BSON_TYPE_MINKEY:
+            case BSON_TYPE_MAXKEY:
+                return true;
+
+            default:
+                // Not supported
+                return false;
+        }
+    }
+
+    // Returns a key that uniquely identifies the value pointed by the iterator
+    inline std::string value_key(const bson_iter_t* iter)
+    {
+        auto type = bson_iter_type(iter);
+        if (type == BSON_TYPE_INT32 || type == BSON_TYPE_INT64)
+        {
+            int64_t value = bson_iter_as_int64(iter);
+            std::string key(1, 'i');
+            key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+            return key;
+        }
+
+        if (type == BSON_TYPE_UTF8)
+        {
+            uint32_t len;
+            const char* str = bson_iter_utf8(iter, &len);
+            std::string key(1, 's');
+            key.append(str, len);
+            return key;
+        }
+
+        // Anything else, use its raw representation
+        bson_t doc = BSON_INITIALIZER;
+        bson_append_iter(&doc, "", 0, iter);
+        std::string key(reinterpret_cast<const char*>(bson_get_data(&doc)), doc.len);
+        bson_destroy(&doc);
+        return key;
+    }
+
+    inline bool matches(const bson_t* document, const bson_t* filter)
+    {
+        bson_iter_t filter_iter;
+        if (!bson_iter_init(&filter_iter, filter))
+        {
+            return false;
+        }
+
+        while (bson_iter_next(&filter_iter))
+        {
+            bson_iter_t document_iter;
+            bson_iter_t value_iter;
+            if (!bson_iter_init(&document_iter, document) ||
+                !bson_iter_find_descendant(&document_iter, bson_iter_key(&filter_iter), &value_iter))
+            {
+                return false;
+            }
+
+            if (!values_equal(&value_iter, &filter_iter))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    inline bool is_operator_update(const bson_t* update)
+    {
+        bson_iter_t iter;
+        return bson_iter_init(&iter, update) && bson_iter_next(&iter) && bson_iter_key(&iter)[0] == '$';
+    }
+
+    inline void append_sum(bson_t* out, std::string_view key, const bson_iter_t* current, const bson_iter_t* increment)
+    {
+        auto type_a = current ? bson_iter_type(current) : BSON_TYPE_INT32;
+        auto type_b = bson_iter_type(increment);
+
+        if (type_a == BSON_TYPE_DOUBLE || type_b == BSON_TYPE_DOUBLE)
+        {
+            double value = (current ? bson_iter_as_double(current) : 0.0) + bson_iter_as_double(increment);
+            bson_append_double(out, key.data(), static_cast<int>(key.size()), value);
+        }
+        else if (type_a == BSON_TYPE_INT64 || type_b == BSON_TYPE_INT64)
+        {
+            int64_t value = (current ? bson_iter_as_int64(current) : 0) + bson_iter_as_int64(increment);
+            bson_append_int64(out, key.data(), static_cast<int>(key.size()), value);
+        }
+        else
+        {
+            int32_t value = (current ? bson_iter_int32(current) : 0) + bson_iter_int32(increment);
+            bson_append_int32(out, key.data(), static_cast<int>(key.size()), value);
+        }
+    }
+
+    // Writes into "out" (which must be initialized) the result of applying "update" to "document"
+    inline void apply_update(const bson_t* document, const bson_t* update, bson_t* out)
+    {
+        bson_iter_t iter;
+
+        if (!is_operator_update(update))
+        {
+            // Replacement, keep only the original _id
+            if (bson_iter_init_find(&iter, document, "_id"))
+            {
+                bson_append_iter(out, "_id", 3, &iter);
+            }
+
+            bson_iter_init(&iter, update);
+            while (bson_iter_next(&iter))
+            {
+                if (strcmp(bson_iter_key(&iter), "_id") != 0)
+                {
+                    bson_append_iter(out, nullptr, 0, &iter);
+                }
+            }
+
+            return;
+        }
+
+        enum class change_type { set, unset, inc };
+        struct change
+        {
+            change_type type;
+            bson_iter_t value;
+            bool applied;
+        };
+
+        // Collect all top-level changes, keys point into the update document
+        std::unordered_map<std::string_view, change> changes;
+        bson_iter_init(&iter, update);
+        while (bson_iter_next(&iter))
+        {
+            std::string_view op = bson_iter_key(&iter);
+            change_type type;
+            if (op == "$set") type = change_type::set;
+            else if (op == "$unset") type = change_type::unset;
+            else if (op == "$inc") type = change_type::inc;
+            else continue;
+
+            bson_iter_t fields;
+            if (bson_iter_recurse(&iter, &fields))
+            {
+                while (bson_iter_next(&fields))
+                {
+                    changes.insert_or_assign(std::string_view(bson_iter_key(&fields)), change { type, fields, false });
+                }
+            }
+        }
+
+        // Rebuild document keeping field order
+        bson_iter_init(&iter, document);
+        while (bson_iter_next(&iter))
+        {
+            std::string_view key = bson_iter_key(&iter);
+            auto it = changes.find(key);
+            if (it == changes.end())
+            {
+                bson_append_iter(out, nullptr, 0, &iter);
+                continue;
+            }
+
+            auto& change = it->second;
+            change.applied = true;
+            switch (change.type)
+            {
+                case change_type::set:
+                    bson_append_iter(out, key.data(), static_cast<int>(key.size()), &change.value);
+                    break;
+
+                case change_type::inc:
+                    append_sum(out, key, &iter, &change.value);
+                    break;
+
+                case change_type::unset:
+                    break;
+            }
+        }
+
+        // New fields go last
+        for (auto& [key, change] : changes)
+        {
+            if (change.applied)
+            {
+                continue;
+            }
+
+            if (change.type == change_type::set)
+            {
+                bson_append_iter(out, key.data(), static_cast<int>(key.size()), &change.value);
+            }
+            else if (change.type == change_type::inc)
+            {
+                append_sum(out, key, nullptr, &change.value);
+            }
+        }
+    }
+
+    // Writes into "out" (which must be initialized) the equality fields of a filter, used as base for upserts
+    inline void filter_to_document(const bson_t* filter, bson_t* out)
+    {
+        bson_iter_t iter;
+        bson_iter_init(&iter, filter);
+        while (bson_iter_next(&iter))
+        {
+            const char* key = bson_iter_key(&iter);
+            if (key[0] != '$' && strchr(key, '.') == nullptr)
+            {
+                bson_append_iter(out, nullptr, 0, &iter);
+            }
+        }
+    }
+
+    // Writes into "out" (which must be initialized) the projected document, a null or empty projection keeps everything
+    inline void project(const bson_t* document, const bson_t* projection, bson_t* out)
+    {
+        if (projection == nullptr || bson_count_keys(projection) == 0)
+        {
+            bson_concat(out, document);
+            return;
+        }
+
+        bson_iter_t iter;
+        bool include_id = true;
+        if (bson_iter_init_find(&iter, projection, "_id"))
+        {
+            include_id = bson_iter_as_bool(&iter);
+        }
+
+        bson_iter_init(&iter, document);
+        while (bson_iter_next(&iter))
+        {
+            const char* key = bson_iter_key(&iter);
+            bool is_id = strcmp(key, "_id") == 0;
+
+            bson_iter_t projected;
+            if ((is_id && include_id) || (!is_id && bson_iter_init_find(&projected, projection, key) && bson_iter_as_bool(&projected)))
+            {
+                bson_append_iter(out, nullptr, 0, &iter);
+            }
+        }
+    }
+
+    // Bulk replies report per operation failures in "writeErrors", anything else failed as a whole
+    inline bool has_write_errors(const bson_t* reply)
+    {
+        bson_iter_t iter;
+        bson_iter_t errors;
+        return bson_iter_init_find(&iter, reply, "writeErrors") && BSON_ITER_HOLDS_ARRAY(&iter) &&
+            bson_iter_recurse(&iter, &errors) && bson_iter_next(&errors);
+    }
+
+    // Writes were applied but could not be acknowledged with the requested write concern
+    inline bool has_write_concern_errors(const bson_t* reply)
+    {
+        bson_iter_t iter;
+        bson_iter_t errors;
+        return bson_iter_init_find(&iter, reply, "writeConcernErrors") && BSON_ITER_HOLDS_ARRAY(&iter) &&
+            bson_iter_recurse(&iter, &errors) && bson_iter_next(&errors);
+    }
+
+    // Documents a bulk reply reports as written, matched updates count even if nothing changed
+    inline int64_t written_count(const bson_t* reply)
+    {
+        int64_t count = 0;
+        bool has_matched = false;
+        bson_iter_t iter;
+        if (!bson_iter_init(&iter, reply))
+        {
+            return 0;
+        }
+
+        while (bson_iter_next(&iter))
+        {
+            const char* key = bson_iter_key(&iter);
+            if (strcmp(key, "nInserted") == 0 || strcmp(key, "nUpserted") == 0 || strcmp(key, "nRemoved") == 0)
+            {
+                count += bson_iter_as_int64(&iter);
+            }
+            else if (strcmp(key, "nMatched") == 0)
+            {
+                count += bson_iter_as_int64(&iter);
+                has_matched = true;
+            }
+        }
+
+        // Some backends only report modified documents
+        bson_iter_t modified;
+        if (!has_matched && bson_iter_init_find(&modified, reply, "nModified"))
+        {
+            count += bson_iter_as_int64(&modified);
+        }
+
+        return count;
+    }
+
+    // Calls callback(uint32_t index, int32_t code) for each entry in the "writeErrors" of a bulk reply
+    template <typename C>
+    inline void for_each_write_error(const bson_t* reply, C&& callback)
+    {
+        bson_iter_t iter;
+        bson_iter_t errors;
+        if (!bson_iter_init_find(&iter, reply, "writeErrors") || !BSON_ITER_HOLDS_ARRAY(&iter) || !bson_iter_recurse(&iter, &errors))
+        {
+            return;
+        }
+
+        while (bson_iter_next(&errors))
+        {
+            bson_iter_t error;
+            if (!BSON_ITER_HOLDS_DOCUMENT(&errors) || !bson_iter_recurse(&errors, &error))
+            {
+                continue;
+            }
+
+            uint32_t index = 0;
+            int32_t code = 0;
+            while (bson_iter_next(&error))
+            {
+                if (strcmp(bson_iter_key(&error), "index") == 0)
+                {
+                    index = static_cast<uint32_t>(bson_iter_as_int64(&error));
+                }
+                else if (strcmp(bson_iter_key(&error), "code") == 0)
+                {
+                    code = static_cast<int32_t>(bson_iter_as_int64(&error));
+                }
+            }
+
+            callback(index, code);
+        }
+    }
+
+    // Server errors that might succeed if the operation is sent again later
+    inline bool is_transient_error(int32_t code)
+    {
+        switch (code)
+        {
+            case 6:     // HostUnreachable
+            case 7:     // HostNotFound
+            case 50:    // MaxTimeMSExpired
+            case 89:    // NetworkTimeout
+            case 91:    // ShutdownInProgress
+            case 112:   // WriteConflict
+            case 189:   // PrimarySteppedDown
+            case 262:   // ExceededTimeLimit
+            case 9001:  // SocketException
+            case 10107: // NotWritablePrimary
+            case 11600: // InterruptedAtShutdown
+            case 11602: // InterruptedDueToReplStateChange
+            case 13435: // NotPrimaryNoSecondaryOk
+            case 13436: // NotPrimaryOrSecondary
+                return true;
+
+            default:
+                return false;
+        }
+    }
+}
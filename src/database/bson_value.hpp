@@ -0,0 +1,519 @@
+#pragma once
+
+#include <mongoc/mongoc.h>
+
+#include <array>
+#include <cstddef>
+#include <inttypes.h>
+#include <optional>
+#include <string.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+
+template <typename T>
+concept is_bson_reflection_impl = requires (T v, bson_iter_t* i)
+{
+    { v.visit_all(i) };
+    { v.decode(static_cast<const uint8_t*>(nullptr), uint32_t(0)) };
+};
+
+// Numeric arrays stored as a single binary blob of user subtype, encoded and decoded with a bulk
+//  copy instead of one BSON element per value. Values are stored in host byte order.
+template <typename V>
+    requires std::is_arithmetic_v<V> && (!std::is_same_v<V, bool>)
+struct packed_vector : public std::vector<V>
+{
+    using std::vector<V>::vector;
+};
+
+// Encoding, sizing and decoding of member values, shared by all reflection paths:
+//  * bool, floating point and integral types, as bool, double, int32 or int64
+//  * enums, as their underlying type
+//  * std::string, as utf8
+//  * std::vector<uint8_t> and std::vector<std::byte>, as generic binary
+//  * packed_vector, as user binary
+//  * std::vector and std::array, as arrays of any of these
+//  * std::optional of any of these, empty ones as null
+//  * nested reflection structs, as documents
+namespace bson_value
+{
+    constexpr bson_subtype_t packed_subtype = BSON_SUBTYPE_USER;
+
+    // Decoded view of an element: strings exclude their length and terminator, binaries their
+    //  length and subtype, and documents and arrays are the whole encoded document
+    struct element
+    {
+        bson_type_t type;
+        bson_subtype_t subtype;
+        const uint8_t* data;
+        uint32_t size;
+    };
+
+    template <typename V> struct is_optional : std::false_type {};
+    template <typename V> struct is_optional<std::optional<V>> : std::true_type {};
+
+    template <typename V> struct is_vector : std::false_type {};
+    template <typename V, typename A> struct is_vector<std::vector<V, A>> : std::true_type {};
+
+    template <typename V> struct is_array : std::false_type {};
+    template <typename V, std::size_t N> struct is_array<std::array<V, N>> : std::true_type {};
+
+    template <typename V> struct is_packed : std::false_type {};
+    template <typename V> struct is_packed<packed_vector<V>> : std::true_type {};
+
+    template <typename V>
+    constexpr bool is_blob = std::is_same_v<V, std::vector<uint8_t>> || std::is_same_v<V, std::vector<std::byte>>;
+
+    // Reflected structs can't be copied nor compared, neither can anything holding them
+    template <typename V> struct holds_reflection : std::bool_constant<is_bson_reflection_impl<V>> {};
+    template <typename V> struct holds_reflection<std::optional<V>> : holds_reflection<V> {};
+    template <typename V, typename A> struct holds_reflection<std::vector<V, A>> : holds_reflection<V> {};
+    template <typename V, std::size_t N> struct holds_reflection<std::array<V, N>> : holds_reflection<V> {};
+
+    // Integers that fit an int32 without changing their value
+    template <typename V>
+    constexpr bool is_int32 = std::is_integral_v<V> && (sizeof(V) < 4 || (sizeof(V) == 4 && std::is_signed_v<V>));
+
+    template <typename V>
+    constexpr bool dependent_false = false;
+
+    inline uint32_t read_uint32(const uint8_t* data)
+    {
+        uint32_t value;
+        memcpy(&value, data, sizeof(value));
+        return BSON_UINT32_FROM_LE(value);
+    }
+
+    inline uint64_t read_uint64(const uint8_t* data)
+    {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        return BSON_UINT64_FROM_LE(value);
+    }
+
+    inline double read_double(const uint8_t* data)
+    {
+        double value;
+        memcpy(&value, data, sizeof(value));
+        return BSON_DOUBLE_FROM_LE(value);
+    }
+
+    // Array keys are the decimal indices
+    inline uint32_t index_length(uint32_t index)
+    {
+        uint32_t length = 1;
+        for (; index >= 10; index /= 10)
+        {
+            ++length;
+        }
+        return length;
+    }
+
+    // Length prefixed and NUL terminated, "size" includes both
+    inline bool string_size(const uint8_t* data, std::size_t available, std::size_t& size)
+    {
+        if (available < 5)
+        {
+            return false;
+        }
+
+        uint32_t length = read_uint32(data);
+        size = std::size_t(length) + 4;
+        return length > 0 && size <= available && data[size - 1] == 0;
+    }
+
+    inline bool element_size(uint8_t type, const uint8_t* data, std::size_t available, std::size_t& size)
+    {
+        switch (type)
+        {
+            case BSON_TYPE_UNDEFINED:
+            case BSON_TYPE_NULL:
+            case BSON_TYPE_MAXKEY:
+            case BSON_TYPE_MINKEY:
+                size = 0;
+                return true;
+
+            case BSON_TYPE_DOUBLE:
+            case BSON_TYPE_DATE_TIME:
+            case BSON_TYPE_TIMESTAMP:
+            case BSON_TYPE_INT64:
+                size = 8;
+                return true;
+
+            case BSON_TYPE_BOOL:
+                size = 1;
+                return true;
+
+            case BSON_TYPE_INT32:
+                size = 4;
+                return true;
+
+            case BSON_TYPE_OID:
+                size = 12;
+                return true;
+
+            case BSON_TYPE_DECIMAL128:
+                size = 16;
+                return true;
+
+            case BSON_TYPE_UTF8:
+            case BSON_TYPE_CODE:
+            case BSON_TYPE_SYMBOL:
+                return string_size(data, available, size);
+
+            case BSON_TYPE_DBPOINTER:
+                if (!string_size(data, available, size)) return false;
+                size += 12;
+                return true;
+
+            case BSON_TYPE_DOCUMENT:
+            case BSON_TYPE_ARRAY:
+            case BSON_TYPE_CODEWSCOPE:
+                if (available < 4) return false;
+                size = read_uint32(data);
+                return size >= 5;
+
+            case BSON_TYPE_BINARY:
+                if (available < 5) return false;
+                size = std::size_t(read_uint32(data)) + 5;
+                return true;
+
+            case BSON_TYPE_REGEX:
+            {
+                // Pattern and options, both plain C strings
+                auto pattern = static_cast<const uint8_t*>(memchr(data, 0, available));
+                if (!pattern) return false;
+                auto options = static_cast<const uint8_t*>(memchr(pattern + 1, 0, data + available - pattern - 1));
+                if (!options) return false;
+                size = options + 1 - data;
+                return true;
+            }
+
+            default:
+                return false;
+        }
+    }
+
+    // Walks the raw bytes of a document or array, switching on the type tag of each element, and
+    //  calls callback(const char* key, std::size_t key_length, const element&) until it returns false
+    template <typename F>
+    inline bool for_each_element(const uint8_t* data, uint32_t length, F&& callback)
+    {
+        if (length < 5)
+        {
+            return false;
+        }
+
+        uint32_t size = read_uint32(data);
+        if (size < 5 || size > length || data[size - 1] != 0)
+        {
+            return false;
+        }
+
+        const uint8_t* it = data + 4;
+        const uint8_t* end = data + size - 1;
+        while (it < end)
+        {
+            uint8_t type = *it++;
+
+            auto key_end = static_cast<const uint8_t*>(memchr(it, 0, end - it));
+            if (!key_end)
+            {
+                return false;
+            }
+
+            const char* key = reinterpret_cast<const char*>(it);
+            std::size_t key_length = key_end - it;
+            it = key_end + 1;
+
+            std::size_t available = end - it;
+            std::size_t skip = 0;
+            if (!element_size(type, it, available, skip) || skip > available)
+            {
+                return false;
+            }
+
+            element value { static_cast<bson_type_t>(type), BSON_SUBTYPE_BINARY, it, static_cast<uint32_t>(skip) };
+            switch (type)
+            {
+                case BSON_TYPE_UTF8:
+                    value.data = it + 4;
+                    value.size = static_cast<uint32_t>(skip - 5);
+                    break;
+
+                case BSON_TYPE_BINARY:
+                    value.subtype = static_cast<bson_subtype_t>(it[4]);
+                    value.data = it + 5;
+                    value.size = static_cast<uint32_t>(skip - 5);
+                    break;
+
+                default:
+                    break;
+            }
+
+            if (!callback(key, key_length, value))
+            {
+                return false;
+            }
+
+            it += skip;
+        }
+
+        return it == end;
+    }
+
+    // Encoded size of a whole element, its type tag and key included
+    template <typename V>
+    inline uint32_t size(uint32_t key_length, const V& value)
+    {
+        const uint32_t header = 2 + key_length;
+
+        if constexpr (is_optional<V>::value)
+        {
+            return value ? size(key_length, *value) : header;
+        }
+        else if constexpr (std::is_enum_v<V>)
+        {
+            return size(key_length, static_cast<std::underlying_type_t<V>>(value));
+        }
+        else if constexpr (std::is_same_v<V, bool>)
+        {
+            return header + 1;
+        }
+        else if constexpr (std::is_floating_point_v<V>)
+        {
+            return header + 8;
+        }
+        else if constexpr (std::is_integral_v<V>)
+        {
+            return header + (is_int32<V> ? 4 : 8);
+        }
+        else if constexpr (std::is_same_v<V, std::string>)
+        {
+            return header + 4 + static_cast<uint32_t>(value.size()) + 1;
+        }
+        else if constexpr (is_packed<V>::value || is_blob<V>)
+        {
+            return header + 5 + static_cast<uint32_t>(value.size() * sizeof(typename V::value_type));
+        }
+        else if constexpr (is_vector<V>::value || is_array<V>::value)
+        {
+            uint32_t total = header + 5;
+            for (uint32_t i = 0; i < value.size(); ++i)
+            {
+                total += size(index_length(i), value[i]);
+            }
+            return total;
+        }
+        else if constexpr (is_bson_reflection_impl<V>)
+        {
+            return header + value.serialized_size();
+        }
+        else
+        {
+            static_assert(dependent_false<V>, "Type can't be stored in BSON");
+        }
+    }
+
+    template <typename V>
+    inline void append(bson_t* doc, const char* key, int key_length, const V& value)
+    {
+        if constexpr (is_optional<V>::value)
+        {
+            if (value)
+            {
+                append(doc, key, key_length, *value);
+            }
+            else
+            {
+                bson_append_null(doc, key, key_length);
+            }
+        }
+        else if constexpr (std::is_enum_v<V>)
+        {
+            append(doc, key, key_length, static_cast<std::underlying_type_t<V>>(value));
+        }
+        else if constexpr (std::is_same_v<V, bool>)
+        {
+            bson_append_bool(doc, key, key_length, value);
+        }
+        else if constexpr (std::is_floating_point_v<V>)
+        {
+            bson_append_double(doc, key, key_length, static_cast<double>(value));
+        }
+        else if constexpr (is_int32<V>)
+        {
+            bson_append_int32(doc, key, key_length, static_cast<int32_t>(value));
+        }
+        else if constexpr (std::is_integral_v<V>)
+        {
+            bson_append_int64(doc, key, key_length, static_cast<int64_t>(value));
+        }
+        else if constexpr (std::is_same_v<V, std::string>)
+        {
+            bson_append_utf8(doc, key, key_length, value.data(), static_cast<int>(value.size()));
+        }
+        else if constexpr (is_packed<V>::value || is_blob<V>)
+        {
+            auto subtype = is_packed<V>::value ? packed_subtype : BSON_SUBTYPE_BINARY;
+            auto bytes = static_cast<uint32_t>(value.size() * sizeof(typename V::value_type));
+            bson_append_binary(doc, key, key_length, subtype, reinterpret_cast<const uint8_t*>(value.data()), bytes);
+        }
+        else if constexpr (is_vector<V>::value || is_array<V>::value)
+        {
+            bson_t child;
+            bson_append_array_begin(doc, key, key_length, &child);
+            for (uint32_t i = 0; i < value.size(); ++i)
+            {
+                const char* index;
+                char buffer[16];
+                auto length = bson_uint32_to_string(i, &index, buffer, sizeof(buffer));
+                append(&child, index, static_cast<int>(length), value[i]);
+            }
+            bson_append_array_end(doc, &child);
+        }
+        else if constexpr (is_bson_reflection_impl<V>)
+        {
+            // Children are written in place, in the parent's buffer
+            bson_t child;
+            bson_append_document_begin(doc, key, key_length, &child);
+            value.serialize(&child);
+            bson_append_document_end(doc, &child);
+        }
+        else
+        {
+            static_assert(dependent_false<V>, "Type can't be stored in BSON");
+        }
+    }
+
+    // Returns false if the element can't be stored in "value"
+    template <typename V>
+    inline bool read(const element& element, V& value)
+    {
+        if constexpr (is_optional<V>::value)
+        {
+            if (element.type == BSON_TYPE_NULL)
+            {
+                value.reset();
+                return true;
+            }
+
+            if (!value)
+            {
+                value.emplace();
+            }
+            return read(element, *value);
+        }
+        else if constexpr (std::is_enum_v<V>)
+        {
+            std::underlying_type_t<V> underlying;
+            if (!read(element, underlying))
+            {
+                return false;
+            }
+
+            value = static_cast<V>(underlying);
+            return true;
+        }
+        else if constexpr (std::is_arithmetic_v<V>)
+        {
+            switch (element.type)
+            {
+                case BSON_TYPE_DOUBLE:
+                    value = static_cast<V>(read_double(element.data));
+                    return true;
+
+                case BSON_TYPE_INT32:
+                    value = static_cast<V>(static_cast<int32_t>(read_uint32(element.data)));
+                    return true;
+
+                case BSON_TYPE_INT64:
+                    value = static_cast<V>(static_cast<int64_t>(read_uint64(element.data)));
+                    return true;
+
+                case BSON_TYPE_BOOL:
+                    value = static_cast<V>(element.data[0] != 0);
+                    return true;
+
+                default:
+                    return false;
+            }
+        }
+        else if constexpr (std::is_same_v<V, std::string>)
+        {
+            if (element.type != BSON_TYPE_UTF8)
+            {
+                return false;
+            }
+
+            value.assign(reinterpret_cast<const char*>(element.data), element.size);
+            return true;
+        }
+        else if constexpr (is_packed<V>::value)
+        {
+            using type = typename V::value_type;
+            if (element.type != BSON_TYPE_BINARY || element.subtype != packed_subtype || element.size % sizeof(type) != 0)
+            {
+                return false;
+            }
+
+            value.resize(element.size / sizeof(type));
+            memcpy(value.data(), element.data, element.size);
+            return true;
+        }
+        else if constexpr (is_blob<V>)
+        {
+            if (element.type != BSON_TYPE_BINARY)
+            {
+                return false;
+            }
+
+            auto data = reinterpret_cast<const typename V::value_type*>(element.data);
+            value.assign(data, data + element.size);
+            return true;
+        }
+        else if constexpr (is_vector<V>::value)
+        {
+            // Reallocations would move structs away from what their references point to
+            static_assert(!is_bson_reflection_impl<typename V::value_type>, "Use std::array for reflected structs");
+
+            if (element.type != BSON_TYPE_ARRAY)
+            {
+                return false;
+            }
+
+            value.clear();
+            return for_each_element(element.data, element.size, [&value](const char*, std::size_t, const bson_value::element& item) {
+                return read(item, value.emplace_back());
+            });
+        }
+        else if constexpr (is_array<V>::value)
+        {
+            if (element.type != BSON_TYPE_ARRAY)
+            {
+                return false;
+            }
+
+            // Extra elements are ignored, missing ones are left untouched
+            std::size_t index = 0;
+            return for_each_element(element.data, element.size, [&value, &index](const char*, std::size_t, const bson_value::element& item) {
+                return index >= value.size() || read(item, value[index++]);
+            });
+        }
+        else if constexpr (is_bson_reflection_impl<V>)
+        {
+            if (element.type != BSON_TYPE_DOCUMENT)
+            {
+                return false;
+            }
+
+            return value.decode(element.data, element.size);
+        }
+        else
+        {
+            static_assert(dependent_false<V>, "Type can't be stored in BSON");
+        }
+    }
+}
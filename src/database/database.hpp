@@ -1,7 +1,17 @@
 #pragma once
 
 #include "core/fixed_string.hpp"
+#include "core/instrumentation.hpp"
+#include "core/metrics.hpp"
+#include "database/bson_index.hpp"
+#include "database/mongo_backend.hpp"
+#include "database/bson_utils.hpp"
+#include "database/op_type.hpp"
+#include "database/storage_backend.hpp"
+#include "database/write_journal.hpp"
+#include "database/write_outcome.hpp"
 
+#include <function2/function2.hpp>
 #include <pool/fiber_pool.hpp>
 #include <synchronization/mutex.hpp>
 
@@ -12,18 +22,71 @@
 #include <argnames.h>
 #include <osrng.h>
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <memory>
 #include <optional>
 #include <set>
+#include <span>
+#include <string.h>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 
 
-template <typename pool_traits>
+template <typename pool_traits, typename backend_t = mongo_backend>
 class database
 {
+    static_assert(storage_backend<backend_t>, "Database backend does not implement all required operations");
+
+public:
+    using backend_type = backend_t;
+    using database_t = typename backend_t::database_t;
+    using collection_t = typename backend_t::collection_t;
+
+    struct index_mismatch
+    {
+        enum class kind
+        {
+            // Same keys and options, only the name differs
+            name,
+            // Same name or keys, but different keys or options
+            definition
+        };
+
+        uint8_t collection;
+        kind mismatch;
+        std::string declared;
+        std::string existing;
+    };
+
+private:
+    using task_t = fu2::unique_function<void(database_t*)>;
+    using cached_document_t = std::shared_ptr<bson_t>;
+    using cache_waiter_t = fu2::unique_function<void(const bson_t*)>;
+
+    struct cache_entry
+    {
+        cached_document_t document;
+        std::chrono::steady_clock::time_point expires_at;
+        std::list<std::string>::iterator lru;
+    };
+
+    struct inflight_read
+    {
+        std::vector<cache_waiter_t> waiters;
+
+        // Bumped by invalidations while the read is in flight, its result is then not cached
+        uint64_t generation;
+    };
+
 public:
-    database() noexcept = default;
+    database() noexcept;
     database(np::fiber_pool<pool_traits>* fiber_pool) noexcept;
     ~database() noexcept;
 
@@ -31,9 +94,34 @@ public:
     void init(const char* uri, const std::string& database) noexcept;
     void add_collection(uint8_t key, const std::string& collection) noexcept;
 
+    // Registers the collection along with the indexes T declares (see bson_index), which are checked
+    //  against its members and hot queries at compile time. Missing indexes are created by "init",
+    //  or right away for collections added once connected.
+    template <typename T>
+    void add_collection(uint8_t key, const std::string& collection) noexcept;
+
+    // Whether all declared indexes existed or could be created, an index declared under another
+    //  name is also ready as long as its keys and options match
+    inline bool indexes_ready() const noexcept;
+
+    // Declared indexes that clash with an existing one, which are never created nor modified
+    inline const std::vector<index_mismatch>& index_mismatches() const noexcept;
+
     template <typename F>
     void execute(F&& function) noexcept;
 
+    // Limits how many tasks "execute" runs at once, queueing the rest. The limit starts at "minimum"
+    //  and grows by one per round of completions while tasks are queued and round-trips stay below
+    //  "latency_target", and it is cut by a quarter when they don't. The backend's connection pool
+    //  is sized to the maximum, round-trips outside of "execute" (index creation) also take
+    //  connections and must never block a database thread waiting for one. A maximum of 0 disables
+    //  the limit, which should stay below the pool's fibers.
+    void set_adaptive_concurrency(uint32_t minimum, uint32_t maximum, std::chrono::microseconds latency_target) noexcept;
+    inline uint32_t concurrency_limit() const noexcept;
+
+    // Records task latencies (in nanoseconds) and queued tasks into "metrics", set before executing
+    void set_metrics(metrics_registry* metrics) noexcept;
+
     template <fixed_string collection>
     inline void ensure_creation(bson_t* document) noexcept;
 
@@ -52,62 +140,199 @@ public:
     template <typename C>
     inline void ensure_creation(uint8_t collection, bson_t& document, C&& callback) noexcept;
 
-    inline int64_t ensure_creation_unsafe(mongoc_collection_t* collection, bson_t* document) noexcept;
+    inline int64_t ensure_creation_unsafe(collection_t* collection, bson_t* document) noexcept;
 
-    mongoc_collection_t* get_collection(mongoc_database_t* database, uint8_t collection) noexcept;
+    // Inserts reflection structs as a single unordered bulk. They are serialized right away, back to
+    //  back into one buffer, and callback(bool succeeded) is called from a database fiber.
+    template <typename T>
+    void insert_many(uint8_t collection, std::span<T> objects) noexcept;
+
+    template <typename T, typename C>
+    void insert_many(uint8_t collection, std::span<T> objects, C&& callback) noexcept;
+
+    // Typed queries, documents are decoded into reflection structs and delivered in chunks of
+    //  at most chunk_size objects as callback(std::span<T> objects, bool done, bool succeeded).
+    //  Objects are reused between chunks, copy anything that has to outlive the callback. Only the
+    //  last call can report a failure, in which case the query stopped early.
+    template <typename T, typename C>
+    void find(uint8_t collection, bson_t& filter, C&& callback, uint32_t chunk_size = 256) noexcept;
+
+    template <fixed_string collection, typename T, typename C>
+    void find(bson_t& filter, C&& callback, uint32_t chunk_size = 256) noexcept;
+
+    template <typename T, typename C>
+    inline void find_unsafe(collection_t* collection, const bson_t* filter, C&& callback, uint32_t chunk_size = 256) noexcept;
+
+    // Read-through cache, concurrent reads of the same filter share a single query and all of them
+    //  are completed from its result as callback(const bson_t* document), which is nullptr if nothing
+    //  matched. Misses are called back from a database fiber, hits from the calling thread.
+    void set_read_cache(std::size_t max_entries, std::chrono::milliseconds ttl) noexcept;
+
+    template <typename C>
+    void find_one_cached(uint8_t collection, bson_t& filter, C&& callback) noexcept;
+
+    void invalidate_cached(uint8_t collection, const bson_t& filter) noexcept;
+
+    // Optional write journal, transactions append their bulk writes to it and the database drains
+    //  it in the background. Enable it before starting the core loop, which replays any leftover.
+    //  Appends are flushed to disk before returning when "durable", thus they survive host crashes,
+    //  and only process crashes otherwise.
+    //  Replays failing as a whole or transiently back off, draining is a no-op until it expires.
+    bool enable_journal(const std::string& path, uint64_t capacity, bool durable = true) noexcept;
+    inline write_journal* journal() noexcept;
+    void drain_journal() noexcept;
+
+    // Journaled operations dropped by the drainer, or applied without the requested write concern,
+    //  are reported here. Set it before starting the core loop.
+    inline void set_journal_failure_callback(const write_failure_callback_t& callback) noexcept;
+
+    // Bounds the number of batches each collection has queued or running in the database, a bound
+    //  of 0 means unbounded. Transactions defer their dispatch while a collection is saturated.
+    inline void set_max_in_flight(uint32_t max_in_flight) noexcept;
+    inline bool is_saturated(uint8_t collection) const noexcept;
+    inline void acquire_in_flight(uint8_t collection) noexcept;
+    inline void release_in_flight(uint8_t collection) noexcept;
+
+    collection_t* get_collection(database_t* database, uint8_t collection) noexcept;
     inline const std::unordered_map<uint8_t, std::string>& get_all_collections() const noexcept;
 
+    inline backend_t& backend() noexcept;
+
 protected:
     template <typename C>
-    void ensure_creation_impl(mongoc_collection_t* collection, bson_t* document, C&& callback) noexcept;
+    void ensure_creation_impl(collection_t* collection, bson_t* document, C&& callback) noexcept;
+
+    int64_t ensure_creation_impl(collection_t* collection, bson_t* document) noexcept;
+
+    template <typename T, typename C>
+    void find_impl(collection_t* collection, const bson_t* filter, C&& callback, uint32_t chunk_size) noexcept;
 
-    int64_t ensure_creation_impl(mongoc_collection_t* collection, bson_t* document) noexcept;
+    cached_document_t find_one_impl(collection_t* collection, const bson_t* filter) noexcept;
+    void store_cached(const std::string& key, const cached_document_t& document) noexcept;
+    inline std::string get_cache_key(uint8_t collection, const bson_t* filter) const noexcept;
 
     int64_t get_potentially_unique_id() noexcept;
 
+    void dispatch(task_t&& task) noexcept;
+    void complete(std::chrono::steady_clock::duration latency) noexcept;
+
+    bool ensure_indexes(database_t* database, uint8_t collection) noexcept;
+
 private:
     // Execution pool
     np::fiber_pool<pool_traits>* _fiber_pool;
     
     // Database parameters
-    mongoc_uri_t* _uri;
-    mongoc_client_pool_t* _pool;
-    std::string _database;
+    backend_t _backend;
     bool _is_connected;
     std::unordered_map<uint8_t, std::string> _collections_map;
 
+    // Declared indexes, as createIndexes specifications
+    std::unordered_map<uint8_t, std::vector<bson_t*>> _indexes;
+    bool _indexes_ready;
+    std::vector<index_mismatch> _index_mismatches;
+
     // Unique ID generator
     np::mutex _mutex;
     CryptoPP::SecByteBlock _key;
     CryptoPP::SecByteBlock _iv;
     CryptoPP::ChaCha::Encryption _enc;
     std::atomic<uint64_t> _counter;
+
+    // Read cache
+    np::mutex _read_cache_mutex;
+    std::size_t _read_cache_max_entries;
+    std::chrono::milliseconds _read_cache_ttl;
+    std::unordered_map<std::string, cache_entry> _read_cache;
+    std::list<std::string> _read_cache_lru;
+    std::unordered_map<std::string, inflight_read> _inflight_reads;
+
+    // Write journal
+    std::unique_ptr<write_journal> _journal;
+    std::atomic<bool> _journal_draining;
+    uint32_t _journal_retry_attempts;
+    std::chrono::steady_clock::time_point _journal_retry_at;
+    write_failure_callback_t _journal_on_failure;
+
+    // Backpressure
+    uint32_t _max_in_flight;
+    std::array<std::atomic<uint32_t>, 256> _in_flight;
+
+    // Adaptive concurrency
+    np::mutex _concurrency_mutex;
+    std::deque<task_t> _pending_tasks;
+    uint32_t _active_tasks;
+    double _concurrency_limit;
+    uint32_t _min_concurrency;
+    uint32_t _max_concurrency;
+    std::chrono::microseconds _latency_target;
+    std::chrono::steady_clock::time_point _last_decrease;
+
+    // Metrics
+    metrics_registry* _metrics;
+    metrics_registry::histogram _task_latency;
+    metrics_registry::gauge _queued_tasks;
 };
 
 
-template <typename pool_traits>
-database<pool_traits>::database(np::fiber_pool<pool_traits>* fiber_pool) noexcept :
+template <typename pool_traits, typename backend_t>
+database<pool_traits, backend_t>::database() noexcept :
+    database(nullptr)
+{}
+
+template <typename pool_traits, typename backend_t>
+database<pool_traits, backend_t>::database(np::fiber_pool<pool_traits>* fiber_pool) noexcept :
     _fiber_pool(fiber_pool),
-    _uri(nullptr),
-    _pool(nullptr),
-    _database(),
+    _backend(),
     _is_connected(false),
     _collections_map(),
+    _indexes(),
+    _indexes_ready(true),
+    _index_mismatches(),
     _mutex(),
     _key(32),
     _iv(8),
     _enc(),
-    _counter()
-{}
+    _counter(),
+    _read_cache_mutex(),
+    _read_cache_max_entries(0),
+    _read_cache_ttl(0),
+    _read_cache(),
+    _read_cache_lru(),
+    _inflight_reads(),
+    _journal(),
+    _journal_draining(false),
+    _journal_retry_attempts(0),
+    _journal_retry_at(),
+    _journal_on_failure(),
+    _max_in_flight(0),
+    _in_flight(),
+    _concurrency_mutex(),
+    _pending_tasks(),
+    _active_tasks(0),
+    _concurrency_limit(0),
+    _min_concurrency(0),
+    _max_concurrency(0),
+    _latency_target(0),
+    _last_decrease(),
+    _metrics(nullptr),
+    _task_latency(),
+    _queued_tasks()
+{
+    for (auto& in_flight : _in_flight)
+    {
+        in_flight = 0;
+    }
+}
 
-template <typename pool_traits>
-void database<pool_traits>::set_fiber_pool(np::fiber_pool<pool_traits>* fiber_pool) noexcept
+template <typename pool_traits, typename backend_t>
+void database<pool_traits, backend_t>::set_fiber_pool(np::fiber_pool<pool_traits>* fiber_pool) noexcept
 {
     _fiber_pool = fiber_pool;
 }
 
-template <typename pool_traits>
-void database<pool_traits>::init(const char* uri, const std::string& database) noexcept
+template <typename pool_traits, typename backend_t>
+void database<pool_traits, backend_t>::init(const char* uri, const std::string& database) noexcept
 {
     // Initialize unique id generator
     CryptoPP::AutoSeededRandomPool prng;
@@ -119,52 +344,85 @@ void database<pool_traits>::init(const char* uri, const std::string& database) n
 
     _enc.SetKey(_key, _key.size(), params);
 
-    // Init db
-    mongoc_init();
+    // Connect
+    _is_connected = _backend.init(uri, database);
 
-    // Check uri
-    bson_error_t error;
-    _uri = mongoc_uri_new_with_error(uri, &error);
-    if (!_uri) 
+    if (_max_concurrency > 0)
     {
-        _is_connected = false;
-        return;
+        _backend.set_max_connections(_max_concurrency);
     }
 
-    // Setup pool
-    _pool = mongoc_client_pool_new(_uri);
-    mongoc_client_pool_set_error_api(_pool, 2);
+    // Create all missing indexes in a single pass, before anything can query the collections
+    if (_is_connected && !_indexes.empty())
+    {
+        _backend.run([this](auto database) {
+            for (auto& [key, specs] : _indexes)
+            {
+                _indexes_ready = ensure_indexes(database, key) && _indexes_ready;
+            }
+        });
+    }
+}
 
-    // Check connection
-    auto client = mongoc_client_pool_pop(_pool);
+template <typename pool_traits, typename backend_t>
+database<pool_traits, backend_t>::~database() noexcept
+{
+    for (auto& [key, specs] : _indexes)
+    {
+        for (auto spec : specs)
+        {
+            bson_destroy(spec);
+        }
+    }
+}
+
+template <typename pool_traits, typename backend_t>
+void database<pool_traits, backend_t>::add_collection(uint8_t key, const std::string& collection) noexcept
+{
+    _collections_map.emplace(key, collection);
+}
 
-    bson_t command = BSON_INITIALIZER;
-    BSON_APPEND_INT32(&command, "ping", 1);
+template <typename pool_traits, typename backend_t>
+template <typename T>
+void database<pool_traits, backend_t>::add_collection(uint8_t key, const std::string& collection) noexcept
+{
+    static_assert(bson_schema::indexes_are_members<T>(), "Index keys must be reflected members");
+    static_assert(bson_schema::queries_are_covered<T>(), "Hot queries must filter by the first key of some index");
 
-    bson_t reply;
-    _is_connected = mongoc_client_command_simple(client, "admin", &command, NULL, &reply, &error);
-    bson_destroy(&reply);
-    mongoc_client_pool_push(_pool, client);
+    add_collection(key, collection);
 
-    // Done
-    _database = database;
+    auto specs = bson_schema::index_specs<T>();
+    if (specs.empty())
+    {
+        return;
+    }
+
+    auto& indexes = _indexes[key];
+    indexes.insert(indexes.end(), specs.begin(), specs.end());
+
+    if (_is_connected)
+    {
+        _backend.run([this, key](auto database) {
+            _indexes_ready = ensure_indexes(database, key) && _indexes_ready;
+        });
+    }
 }
 
-template <typename pool_traits>
-database<pool_traits>::~database() noexcept
+template <typename pool_traits, typename backend_t>
+inline bool database<pool_traits, backend_t>::indexes_ready() const noexcept
 {
-    mongoc_cleanup();
+    return _indexes_ready;
 }
 
-template <typename pool_traits>
-void database<pool_traits>::add_collection(uint8_t key, const std::string& collection) noexcept
+template <typename pool_traits, typename backend_t>
+inline const std::vector<typename database<pool_traits, backend_t>::index_mismatch>& database<pool_traits, backend_t>::index_mismatches() const noexcept
 {
-    _collections_map.emplace(key, collection);
+    return _index_mismatches;
 }
 
-template <typename pool_traits>
+template <typename pool_traits, typename backend_t>
 template <typename F>
-void database<pool_traits>::execute(F&& function) noexcept
+void database<pool_traits, backend_t>::execute(F&& function) noexcept
 {
 // TODO(gpascualg): Only enable db connection check in test
 #ifndef NDEBUG
@@ -176,87 +434,205 @@ void database<pool_traits>::execute(F&& function) noexcept
 #endif
 
     assert(_is_connected && "Can't query a database that has no connection");
-    _fiber_pool->push([this, function = std::forward<F>(function)]() mutable {
-        auto client = mongoc_client_pool_pop(_pool);
-        auto database = mongoc_client_get_database(client, _database.c_str());
-        function(database);
-        mongoc_client_pool_push(_pool, client);
+
+    if (_max_concurrency == 0)
+    {
+        _fiber_pool->push([this, function = std::forward<F>(function)]() mutable {
+            INSTRUMENT_ZONE("database_task");
+            auto start = _metrics ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+            _backend.run(function);
+            if (_metrics)
+            {
+                _metrics->record(_task_latency, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+            }
+        });
+        return;
+    }
+
+    _concurrency_mutex.lock();
+    if (_active_tasks < static_cast<uint32_t>(_concurrency_limit))
+    {
+        ++_active_tasks;
+        _concurrency_mutex.unlock();
+        dispatch(task_t(std::forward<F>(function)));
+    }
+    else
+    {
+        _pending_tasks.emplace_back(std::forward<F>(function));
+        if (_metrics)
+        {
+            _metrics->set(_queued_tasks, static_cast<int64_t>(_pending_tasks.size()));
+        }
+        _concurrency_mutex.unlock();
+    }
+}
+
+template <typename pool_traits, typename backend_t>
+void database<pool_traits, backend_t>::set_adaptive_concurrency(uint32_t minimum, uint32_t maximum, std::chrono::microseconds latency_target) noexcept
+{
+    assert(minimum > 0 && minimum <= maximum && "Concurrency bounds must be 0 < minimum <= maximum");
+
+    _concurrency_mutex.lock();
+    _min_concurrency = minimum;
+    _max_concurrency = maximum;
+    _concurrency_limit = minimum;
+    _latency_target = latency_target;
+    _concurrency_mutex.unlock();
+
+    _backend.set_max_connections(maximum);
+}
+
+template <typename pool_traits, typename backend_t>
+inline uint32_t database<pool_traits, backend_t>::concurrency_limit() const noexcept
+{
+    return static_cast<uint32_t>(_concurrency_limit);
+}
+
+template <typename pool_traits, typename backend_t>
+void database<pool_traits, backend_t>::set_metrics(metrics_registry* metrics) noexcept
+{
+    _metrics = metrics;
+    _task_latency = metrics->add_histogram("database_task_ns");
+    _queued_tasks = metrics->add_gauge("database_tasks_queued");
+}
+
+template <typename pool_traits, typename backend_t>
+void database<pool_traits, backend_t>::dispatch(task_t&& task) noexcept
+{
+    _fiber_pool->push([this, task = std::move(task)]() mutable {
+        INSTRUMENT_ZONE("database_task");
+        auto start = std::chrono::steady_clock::now();
+        _backend.run(task);
+        complete(std::chrono::steady_clock::now() - start);
     });
 }
 
-template <typename pool_traits>
+template <typename pool_traits, typename backend_t>
+void database<pool_traits, backend_t>::complete(std::chrono::steady_clock::duration latency) noexcept
+{
+    auto now = std::chrono::steady_clock::now();
+    std::vector<task_t> ready;
+
+    if (_metrics)
+    {
+        _metrics->record(_task_latency, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count()));
+    }
+
+    _concurrency_mutex.lock();
+
+    if (latency > _latency_target)
+    {
+        // Tasks in flight all see the same congestion, back off once per round-trip
+        if (now - _last_decrease > _latency_target)
+        {
+            _concurrency_limit = std::max<double>(_min_concurrency, _concurrency_limit * 0.75);
+            _last_decrease = now;
+        }
+    }
+    else if (!_pending_tasks.empty())
+    {
+        // Only grow when there is demand, +1 once every task of the current limit completes
+        _concurrency_limit = std::min<double>(_max_concurrency, _concurrency_limit + 1.0 / _concurrency_limit);
+    }
+
+    --_active_tasks;
+    while (!_pending_tasks.empty() && _active_tasks < static_cast<uint32_t>(_concurrency_limit))
+    {
+        ready.push_back(std::move(_pending_tasks.front()));
+        _pending_tasks.pop_front();
+        ++_active_tasks;
+    }
+
+    if (_metrics)
+    {
+        _metrics->set(_queued_tasks, static_cast<int64_t>(_pending_tasks.size()));
+    }
+
+    _concurrency_mutex.unlock();
+
+    for (auto& task : ready)
+    {
+        dispatch(std::move(task));
+    }
+}
+
+template <typename pool_traits, typename backend_t>
 template <fixed_string collection>
-inline void database<pool_traits>::ensure_creation(bson_t* document) noexcept
+inline void database<pool_traits, backend_t>::ensure_creation(bson_t* document) noexcept
 {
     ensure_creation<collection>(document, [](int64_t id) {});
 }
 
-template <typename pool_traits>
+template <typename pool_traits, typename backend_t>
 template <fixed_string collection>
-inline void database<pool_traits>::ensure_creation(bson_t& document) noexcept
+inline void database<pool_traits, backend_t>::ensure_creation(bson_t& document) noexcept
 {
     ensure_creation<collection>(document, [](int64_t id) {});
 }
 
-template <typename pool_traits>
+template <typename pool_traits, typename backend_t>
 template <fixed_string collection, typename C>
-inline void database<pool_traits>::ensure_creation(bson_t* document, C&& callback) noexcept
+inline void database<pool_traits, backend_t>::ensure_creation(bson_t* document, C&& callback) noexcept
 {
-    execute([this, document, callback = std::forward<C>(callback)](auto database) {
-        auto col = mongoc_database_get_collection(database, collection);
+    execute([this, document, callback = std::forward<C>(callback)](auto database) mutable {
+        auto col = _backend.get_collection(database, collection);
         ensure_creation_impl(col, document, std::forward<C>(callback));
+        _backend.release_collection(col);
     });
 }
 
-template <typename pool_traits>
+template <typename pool_traits, typename backend_t>
 template <fixed_string collection, typename C>
-inline void database<pool_traits>::ensure_creation(bson_t& document, C&& callback) noexcept
+inline void database<pool_traits, backend_t>::ensure_creation(bson_t& document, C&& callback) noexcept
 {
-    execute([this, document = bson_copy(&document), callback = std::forward<C>(callback)](auto database) {
-        auto col = mongoc_database_get_collection(database, collection);
+    execute([this, document = bson_copy(&document), callback = std::forward<C>(callback)](auto database) mutable {
+        auto col = _backend.get_collection(database, collection);
         ensure_creation_impl(col, document, std::forward<C>(callback));
+        _backend.release_collection(col);
     });
 
     bson_destroy(&document);
 }
 
-template <typename pool_traits>
+template <typename pool_traits, typename backend_t>
 template <typename C>
-inline void database<pool_traits>::ensure_creation(uint8_t collection, bson_t* document, C&& callback) noexcept
+inline void database<pool_traits, backend_t>::ensure_creation(uint8_t collection, bson_t* document, C&& callback) noexcept
 {
-    execute([this, collection, document, callback = std::forward<C>(callback)](auto database) {
+    execute([this, collection, document, callback = std::forward<C>(callback)](auto database) mutable {
         auto col = get_collection(database, collection);
         ensure_creation_impl(col, document, std::forward<C>(callback));
+        _backend.release_collection(col);
     });
 }
 
-template <typename pool_traits>
+template <typename pool_traits, typename backend_t>
 template <typename C>
-inline void database<pool_traits>::ensure_creation(uint8_t collection, bson_t& document, C&& callback) noexcept
+inline void database<pool_traits, backend_t>::ensure_creation(uint8_t collection, bson_t& document, C&& callback) noexcept
 {
-    execute([this, collection, document = bson_copy(&document), callback = std::forward<C>(callback)](auto database) {
+    execute([this, collection, document = bson_copy(&document), callback = std::forward<C>(callback)](auto database) mutable {
         auto col = get_collection(database, collection);
         ensure_creation_impl(col, document, std::forward<C>(callback));
+        _backend.release_collection(col);
     });
 
     bson_destroy(&document);
 }
 
-template <typename pool_traits>
-inline int64_t database<pool_traits>::ensure_creation_unsafe(mongoc_collection_t* collection, bson_t* document) noexcept
+template <typename pool_traits, typename backend_t>
+inline int64_t database<pool_traits, backend_t>::ensure_creation_unsafe(collection_t* collection, bson_t* document) noexcept
 {
     return ensure_creation_impl(collection, document);
 }
 
-template <typename pool_traits>
+template <typename pool_traits, typename backend_t>
 template <typename C>
-void database<pool_traits>::ensure_creation_impl(mongoc_collection_t* collection, bson_t* document, C&& callback) noexcept
+void database<pool_traits, backend_t>::ensure_creation_impl(collection_t* collection, bson_t* document, C&& callback) noexcept
 {
     callback(ensure_creation_impl(collection, document));
 }
 
-template <typename pool_traits>
-int64_t database<pool_traits>::ensure_creation_impl(mongoc_collection_t* collection, bson_t* document) noexcept
+template <typename pool_traits, typename backend_t>
+int64_t database<pool_traits, backend_t>::ensure_creation_impl(collection_t* collection, bson_t* document) noexcept
 {
     bson_error_t error;
 
@@ -269,7 +645,7 @@ int64_t database<pool_traits>::ensure_creation_impl(mongoc_collection_t* collect
         BSON_APPEND_INT64(&with_id, "_id", id);
         bson_concat(&with_id, document);
 
-        if (mongoc_collection_insert_one(collection, &with_id, NULL, NULL, &error))
+        if (_backend.insert_one(collection, &with_id, &error))
         {
             bson_destroy(&with_id);
             bson_destroy(document);
@@ -280,23 +656,484 @@ int64_t database<pool_traits>::ensure_creation_impl(mongoc_collection_t* collect
     }
 }
 
-template <typename pool_traits>
-mongoc_collection_t* database<pool_traits>::get_collection(mongoc_database_t* database, uint8_t collection) noexcept
+template <typename pool_traits, typename backend_t>
+template <typename T>
+void database<pool_traits, backend_t>::insert_many(uint8_t collection, std::span<T> objects) noexcept
+{
+    insert_many(collection, objects, [](bool succeeded) {});
+}
+
+template <typename pool_traits, typename backend_t>
+template <typename T, typename C>
+void database<pool_traits, backend_t>::insert_many(uint8_t collection, std::span<T> objects, C&& callback) noexcept
+{
+    if (objects.empty())
+    {
+        // Empty bulks are an error for the backend
+        callback(true);
+        return;
+    }
+
+    // Sizes are exact, the writer never has to grow the buffer
+    std::size_t capacity = 0;
+    for (auto& object : objects)
+    {
+        capacity += object.serialized_size();
+    }
+
+    uint8_t* buffer = static_cast<uint8_t*>(bson_malloc(capacity));
+    bson_writer_t* writer = bson_writer_new(&buffer, &capacity, 0, bson_realloc_ctx, nullptr);
+    for (auto& object : objects)
+    {
+        object.serialize(writer);
+    }
+
+    std::size_t length = bson_writer_get_length(writer);
+    bson_writer_destroy(writer);
+
+    execute([this, collection, buffer, length, callback = std::forward<C>(callback)](auto database) mutable {
+        auto col = get_collection(database, collection);
+        auto bulk = _backend.create_bulk(col, false);
+
+        // Documents are read in place, each one starts with its own length
+        for (std::size_t offset = 0; offset < length; )
+        {
+            uint32_t size;
+            memcpy(&size, buffer + offset, sizeof(size));
+            size = BSON_UINT32_FROM_LE(size);
+
+            bson_t document;
+            bson_init_static(&document, buffer + offset, size);
+            _backend.bulk_insert(bulk, &document);
+            offset += size;
+        }
+
+        bson_error_t error;
+        bson_t reply;
+        bool succeeded = _backend.bulk_execute(bulk, &reply, &error);
+        bson_destroy(&reply);
+        _backend.bulk_destroy(bulk);
+        _backend.release_collection(col);
+        bson_free(buffer);
+
+        callback(succeeded);
+    });
+}
+
+template <typename pool_traits, typename backend_t>
+template <typename T, typename C>
+void database<pool_traits, backend_t>::find(uint8_t collection, bson_t& filter, C&& callback, uint32_t chunk_size) noexcept
+{
+    execute([this, collection, filter = bson_copy(&filter), callback = std::forward<C>(callback), chunk_size](auto database) mutable {
+        auto col = get_collection(database, collection);
+        find_impl<T>(col, filter, callback, chunk_size);
+        _backend.release_collection(col);
+        bson_destroy(filter);
+    });
+
+    bson_destroy(&filter);
+}
+
+template <typename pool_traits, typename backend_t>
+template <fixed_string collection, typename T, typename C>
+void database<pool_traits, backend_t>::find(bson_t& filter, C&& callback, uint32_t chunk_size) noexcept
+{
+    execute([this, filter = bson_copy(&filter), callback = std::forward<C>(callback), chunk_size](auto database) mutable {
+        auto col = _backend.get_collection(database, collection);
+        find_impl<T>(col, filter, callback, chunk_size);
+        _backend.release_collection(col);
+        bson_destroy(filter);
+    });
+
+    bson_destroy(&filter);
+}
+
+template <typename pool_traits, typename backend_t>
+template <typename T, typename C>
+inline void database<pool_traits, backend_t>::find_unsafe(collection_t* collection, const bson_t* filter, C&& callback, uint32_t chunk_size) noexcept
+{
+    find_impl<T>(collection, filter, std::forward<C>(callback), chunk_size);
+}
+
+template <typename pool_traits, typename backend_t>
+template <typename T, typename C>
+void database<pool_traits, backend_t>::find_impl(collection_t* collection, const bson_t* filter, C&& callback, uint32_t chunk_size) noexcept
+{
+    assert(chunk_size > 0 && "Chunks must hold at least one object");
+
+    // Only fetch reflected fields, and let the server send as many documents per batch as we can hold
+    bson_t opts = BSON_INITIALIZER;
+    BSON_APPEND_DOCUMENT(&opts, "projection", T::fields());
+    BSON_APPEND_INT32(&opts, "batchSize", static_cast<int32_t>(chunk_size));
+
+    auto cursor = _backend.find(collection, filter, &opts);
+    bson_destroy(&opts);
+
+    // Objects are allocated once and reused for all chunks
+    std::unique_ptr<T[]> objects(new T[chunk_size]);
+    uint32_t count = 0;
+
+    const bson_t* document;
+    while (_backend.cursor_next(cursor, &document))
+    {
+        objects[count].decode(document);
+
+        if (++count == chunk_size)
+        {
+            callback(std::span<T>(objects.get(), count), false, true);
+
+            // Reset objects, following documents might not contain all fields
+            std::destroy_n(objects.get(), count);
+            std::uninitialized_default_construct_n(objects.get(), count);
+            count = 0;
+        }
+    }
+
+    // Cursors stop iterating on errors too
+    bson_error_t error;
+    bool succeeded = !_backend.cursor_error(cursor, &error);
+    _backend.cursor_destroy(cursor);
+
+    // Last call always happens, even if empty, to signal the end of the query
+    callback(std::span<T>(objects.get(), count), true, succeeded);
+}
+
+template <typename pool_traits, typename backend_t>
+void database<pool_traits, backend_t>::set_read_cache(std::size_t max_entries, std::chrono::milliseconds ttl) noexcept
+{
+    _read_cache_mutex.lock();
+
+    _read_cache_max_entries = max_entries;
+    _read_cache_ttl = ttl;
+
+    // Entries are only evicted when inserting, trim now in case the cache shrank
+    while (_read_cache.size() > _read_cache_max_entries)
+    {
+        _read_cache.erase(_read_cache_lru.back());
+        _read_cache_lru.pop_back();
+    }
+
+    _read_cache_mutex.unlock();
+}
+
+template <typename pool_traits, typename backend_t>
+template <typename C>
+void database<pool_traits, backend_t>::find_one_cached(uint8_t collection, bson_t& filter, C&& callback) noexcept
+{
+    auto key = get_cache_key(collection, &filter);
+
+    _read_cache_mutex.lock();
+    if (auto it = _read_cache.find(key); it != _read_cache.end())
+    {
+        if (std::chrono::steady_clock::now() < it->second.expires_at)
+        {
+            // Hold a reference, the entry might be evicted while the callback executes
+            auto document = it->second.document;
+            _read_cache_lru.splice(_read_cache_lru.begin(), _read_cache_lru, it->second.lru);
+            _read_cache_mutex.unlock();
+
+            bson_destroy(&filter);
+            callback(document.get());
+            return;
+        }
+
+        _read_cache_lru.erase(it->second.lru);
+        _read_cache.erase(it);
+    }
+
+    // Only the first reader of a given filter queries the database, the rest wait for it
+    auto [inflight, is_first] = _inflight_reads.try_emplace(key);
+    inflight->second.waiters.emplace_back(std::forward<C>(callback));
+    uint64_t generation = inflight->second.generation;
+    _read_cache_mutex.unlock();
+
+    if (is_first)
+    {
+        execute([this, collection, generation, key = std::move(key), filter = bson_copy(&filter)](auto database) mutable {
+            auto col = get_collection(database, collection);
+            auto document = find_one_impl(col, filter);
+            _backend.release_collection(col);
+            bson_destroy(filter);
+
+            _read_cache_mutex.lock();
+            auto it = _inflight_reads.find(key);
+            auto waiters = std::move(it->second.waiters);
+            bool invalidated = it->second.generation != generation;
+            _inflight_reads.erase(it);
+
+            // A write invalidated the key meanwhile, the document might predate it
+            if (document && !invalidated)
+            {
+                store_cached(key, document);
+            }
+            _read_cache_mutex.unlock();
+
+            for (auto& waiter : waiters)
+            {
+                waiter(document.get());
+            }
+        });
+    }
+
+    bson_destroy(&filter);
+}
+
+template <typename pool_traits, typename backend_t>
+void database<pool_traits, backend_t>::invalidate_cached(uint8_t collection, const bson_t& filter) noexcept
+{
+    auto key = get_cache_key(collection, &filter);
+
+    _read_cache_mutex.lock();
+    if (auto it = _read_cache.find(key); it != _read_cache.end())
+    {
+        _read_cache_lru.erase(it->second.lru);
+        _read_cache.erase(it);
+    }
+
+    // Reads already in flight must not cache what they get
+    if (auto it = _inflight_reads.find(key); it != _inflight_reads.end())
+    {
+        ++it->second.generation;
+    }
+    _read_cache_mutex.unlock();
+}
+
+template <typename pool_traits, typename backend_t>
+typename database<pool_traits, backend_t>::cached_document_t database<pool_traits, backend_t>::find_one_impl(collection_t* collection, const bson_t* filter) noexcept
+{
+    bson_t opts = BSON_INITIALIZER;
+    BSON_APPEND_INT64(&opts, "limit", 1);
+
+    auto cursor = _backend.find(collection, filter, &opts);
+    bson_destroy(&opts);
+
+    cached_document_t result;
+    const bson_t* document;
+    if (_backend.cursor_next(cursor, &document))
+    {
+        result = cached_document_t(bson_copy(document), bson_destroy);
+    }
+
+    _backend.cursor_destroy(cursor);
+    return result;
+}
+
+template <typename pool_traits, typename backend_t>
+void database<pool_traits, backend_t>::store_cached(const std::string& key, const cached_document_t& document) noexcept
+{
+    // Must be called with the cache mutex held
+    if (_read_cache_max_entries == 0)
+    {
+        return;
+    }
+
+    if (_read_cache.size() >= _read_cache_max_entries)
+    {
+        _read_cache.erase(_read_cache_lru.back());
+        _read_cache_lru.pop_back();
+    }
+
+    _read_cache_lru.push_front(key);
+    _read_cache.emplace(key, cache_entry {
+        .document = document,
+        .expires_at = std::chrono::steady_clock::now() + _read_cache_ttl,
+        .lru = _read_cache_lru.begin()
+    });
+}
+
+template <typename pool_traits, typename backend_t>
+inline std::string database<pool_traits, backend_t>::get_cache_key(uint8_t collection, const bson_t* filter) const noexcept
+{
+    // Keys are the raw filter bytes, prefixed by the collection, so that there are no false hits
+    std::string key(1, static_cast<char>(collection));
+    key.append(reinterpret_cast<const char*>(bson_get_data(filter)), filter->len);
+    return key;
+}
+
+template <typename pool_traits, typename backend_t>
+bool database<pool_traits, backend_t>::enable_journal(const std::string& path, uint64_t capacity, bool durable) noexcept
+{
+    auto journal = std::make_unique<write_journal>();
+    if (!journal->open(path, capacity, durable))
+    {
+        return false;
+    }
+
+    _journal = std::move(journal);
+    return true;
+}
+
+template <typename pool_traits, typename backend_t>
+inline write_journal* database<pool_traits, backend_t>::journal() noexcept
+{
+    return _journal.get();
+}
+
+template <typename pool_traits, typename backend_t>
+inline void database<pool_traits, backend_t>::set_journal_failure_callback(const write_failure_callback_t& callback) noexcept
+{
+    _journal_on_failure = callback;
+}
+
+template <typename pool_traits, typename backend_t>
+void database<pool_traits, backend_t>::drain_journal() noexcept
+{
+    // Records must be applied in order, thus there is at most one drainer
+    if (!_journal || !_journal->has_pending() || _journal_draining.exchange(true))
+    {
+        return;
+    }
+
+    // Retry state is only touched by whoever holds the flag
+    if (std::chrono::steady_clock::now() < _journal_retry_at)
+    {
+        _journal_draining = false;
+        return;
+    }
+
+    execute([this](auto database) {
+        constexpr auto retry_base = std::chrono::milliseconds(50);
+        constexpr uint32_t retry_max_shift = 7;
+
+        constexpr uint32_t max_bulk_size = 1000;
+        write_journal::record record;
+        std::vector<uint64_t> offsets;
+        offsets.reserve(max_bulk_size);
+
+        while (true)
+        {
+            uint64_t offset = _journal->pending_begin();
+            uint64_t end = _journal->pending_end();
+
+            if (offset == end)
+            {
+                // Something might have been appended right before releasing the flag
+                _journal_draining = false;
+                if (!_journal->has_pending() || _journal_draining.exchange(true))
+                {
+                    return;
+                }
+
+                continue;
+            }
+
+            // Consecutive records of the same collection are sent together
+            uint64_t next = _journal->read(offset, record);
+            uint8_t collection = record.collection;
+            auto col = get_collection(database, collection);
+            auto bulk = _backend.create_bulk(col, true);
+
+            offsets.clear();
+            while (true)
+            {
+                offsets.push_back(offset);
+                bulk_append(_backend, bulk, record.type, &record.operation_1, &record.operation_2);
+                offset = next;
+
+                if (offset == end || offsets.size() == max_bulk_size)
+                {
+                    break;
+                }
+
+                next = _journal->read(offset, record);
+                if (record.collection != collection)
+                {
+                    break;
+                }
+            }
+
+            bson_error_t error;
+            bson_t reply;
+            bool succeeded = _backend.bulk_execute(bulk, &reply, &error);
+            auto outcome = bulk_outcome::of(succeeded, &reply, offsets.size());
+            bson_destroy(&reply);
+            _backend.bulk_destroy(bulk);
+            _backend.release_collection(col);
+
+            // Operations that failed on their own would fail again and are dropped, as well as bulks
+            //  that might have written something, not all operations are idempotent. Records are
+            //  still mapped until acknowledged, thus they can be reported straight from the journal.
+            std::size_t dropped = outcome.retryable ? 0 : outcome.failed;
+            std::size_t done = outcome.applied + dropped;
+            if (_journal_on_failure)
+            {
+                for (std::size_t i = 0; i < done; ++i)
+                {
+                    if (i >= outcome.applied || outcome.unacknowledged)
+                    {
+                        _journal->read(offsets[i], record);
+                        _journal_on_failure(collection, i >= outcome.applied ? outcome.failure : write_failure::unacknowledged, record.type, &record.operation_1, &record.operation_2);
+                    }
+                }
+            }
+
+            if (done > 0)
+            {
+                _journal->acknowledge(done == offsets.size() ? offset : offsets[done], done);
+            }
+
+            if (done < offsets.size())
+            {
+                // The rest failed transiently or never got to the backend, try again once the backoff
+                //  expires, the core loop keeps asking every tick
+                _journal_retry_at = std::chrono::steady_clock::now() + retry_base * (1 << std::min(_journal_retry_attempts, retry_max_shift));
+                ++_journal_retry_attempts;
+                _journal_draining = false;
+                return;
+            }
+
+            _journal_retry_attempts = 0;
+        }
+    });
+}
+
+template <typename pool_traits, typename backend_t>
+inline void database<pool_traits, backend_t>::set_max_in_flight(uint32_t max_in_flight) noexcept
+{
+    _max_in_flight = max_in_flight;
+}
+
+template <typename pool_traits, typename backend_t>
+inline bool database<pool_traits, backend_t>::is_saturated(uint8_t collection) const noexcept
+{
+    return _max_in_flight != 0 && _in_flight[collection].load(std::memory_order_relaxed) >= _max_in_flight;
+}
+
+template <typename pool_traits, typename backend_t>
+inline void database<pool_traits, backend_t>::acquire_in_flight(uint8_t collection) noexcept
+{
+    _in_flight[collection].fetch_add(1, std::memory_order_relaxed);
+}
+
+template <typename pool_traits, typename backend_t>
+inline void database<pool_traits, backend_t>::release_in_flight(uint8_t collection) noexcept
+{
+    _in_flight[collection].fetch_sub(1, std::memory_order_relaxed);
+}
+
+template <typename pool_traits, typename backend_t>
+typename database<pool_traits, backend_t>::collection_t* database<pool_traits, backend_t>::get_collection(database_t* database, uint8_t collection) noexcept
 {
     auto it = _collections_map.find(collection);
     assert(it != _collections_map.end());
 
-    return mongoc_database_get_collection(database, it->second.c_str());
+    return _backend.get_collection(database, it->second.c_str());
 }
 
-template <typename pool_traits>
-inline const std::unordered_map<uint8_t, std::string>& database<pool_traits>::get_all_collections() const noexcept
+template <typename pool_traits, typename backend_t>
+inline const std::unordered_map<uint8_t, std::string>& database<pool_traits, backend_t>::get_all_collections() const noexcept
 {
     return _collections_map;
 }
 
-template <typename pool_traits>
-int64_t database<pool_traits>::get_potentially_unique_id() noexcept
+template <typename pool_traits, typename backend_t>
+inline backend_t& database<pool_traits, backend_t>::backend() noexcept
+{
+    return _backend;
+}
+
+template <typename pool_traits, typename backend_t>
+int64_t database<pool_traits, backend_t>::get_potentially_unique_id() noexcept
 {
     CryptoPP::byte data[8];
     uint64_t counter = _counter++ + std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
@@ -309,3 +1146,64 @@ int64_t database<pool_traits>::get_potentially_unique_id() noexcept
     // Get as int64_t
     return *(int64_t*)data;
 }
+
+template <typename pool_traits, typename backend_t>
+bool database<pool_traits, backend_t>::ensure_indexes(database_t* database, uint8_t collection) noexcept
+{
+    auto col = get_collection(database, collection);
+
+    std::vector<bson_t*> existing;
+    bool succeeded = _backend.list_indexes(col, existing);
+    bool matched = true;
+
+    // Indexes are matched by name and then by keys. Clashing ones are only recorded, the server
+    //  would reject the whole command otherwise, and all missing ones are built by a single command
+    bson_t missing = BSON_INITIALIZER;
+    uint32_t count = 0;
+
+    for (auto spec : _indexes[collection])
+    {
+        auto name = bson_schema::index_name(spec);
+        auto same_name = std::find_if(existing.begin(), existing.end(), [&name](const bson_t* index) {
+            return bson_schema::index_name(index) == name;
+        });
+        auto same_keys = std::find_if(existing.begin(), existing.end(), [spec](const bson_t* index) {
+            return bson_schema::same_keys(spec, index);
+        });
+
+        auto index = same_name != existing.end() ? same_name : same_keys;
+        if (index != existing.end())
+        {
+            bool same_definition = bson_schema::same_keys(spec, *index) && bson_schema::same_options(spec, *index);
+            if (same_definition && index == same_name)
+            {
+                continue;
+            }
+
+            auto mismatch = same_definition ? index_mismatch::kind::name : index_mismatch::kind::definition;
+            _index_mismatches.push_back({ collection, mismatch, name, bson_schema::index_name(*index) });
+            matched = matched && same_definition;
+            continue;
+        }
+
+        char buffer[16];
+        const char* key;
+        size_t key_len = bson_uint32_to_string(count++, &key, buffer, sizeof(buffer));
+        bson_append_document(&missing, key, static_cast<int>(key_len), spec);
+    }
+
+    if (succeeded && count > 0)
+    {
+        bson_error_t error;
+        succeeded = _backend.create_indexes(col, &missing, &error);
+    }
+
+    for (auto index : existing)
+    {
+        bson_destroy(index);
+    }
+
+    bson_destroy(&missing);
+    _backend.release_collection(col);
+    return succeeded && matched;
+}
@@ -0,0 +1,388 @@
+#pragma once
+
+#include "database/bson_dirty_tracker.hpp"
+#include "database/transaction.hpp"
+#include "database/write_outcome.hpp"
+
+#include <synchronization/mutex.hpp>
+
+#include <mongoc/mongoc.h>
+
+#include <bitset>
+#include <unordered_map>
+#include <vector>
+
+
+// Write-behind cache of reflected entities, keyed by their "_id". Modified fields are only
+//  tracked, and every flush interval a single update_one with a $set of all dirty fields is
+//  pushed per entity to the given transaction, no matter how many times it changed.
+// Fields are either marked dirty by hand or, with "detect_changes", found by diffing each entity
+//  against a shadow copy of what was last persisted.
+// Updates the database drops are handed back through "restore", which is meant to be called from the
+//  flushing transaction's failure callback, and their fields are written again on the next flush.
+// NOTE(gpascualg): Like transactions, a cache is not thread-safe and should have a single owner,
+//  "restore" being the only exception
+template <typename T>
+class entity_cache
+{
+    struct entry
+    {
+        template <typename... Args>
+        entry(Args&&... args) :
+            object(std::forward<Args>(args)...),
+            tracker()
+        {}
+
+        T object;
+        bson_dirty_tracker<T> tracker;
+    };
+
+    struct failed_update
+    {
+        int64_t id;
+        std::bitset<T::members_count> set;
+        std::bitset<T::members_count> unset;
+    };
+
+public:
+    entity_cache() noexcept = default;
+
+    void init(uint8_t collection, uint64_t flush_every, bool detect_changes = false) noexcept;
+
+    template <typename... Args>
+    T* emplace(int64_t id, Args&&... args) noexcept;
+    T* get(int64_t id) noexcept;
+
+    template <std::size_t I>
+    void mark_dirty(int64_t id) noexcept;
+    void mark_dirty(int64_t id, const char* field) noexcept;
+
+    // Removes the member from the persisted document on the next flush
+    template <std::size_t I>
+    void mark_unset(int64_t id) noexcept;
+    void mark_unset(int64_t id, const char* field) noexcept;
+
+    template <uint32_t callable_size, typename backend_t>
+    bool update(uint64_t diff, transaction<callable_size, backend_t>* transaction) noexcept;
+
+    template <uint32_t callable_size, typename backend_t>
+    void flush(transaction<callable_size, backend_t>* transaction) noexcept;
+
+    template <uint32_t callable_size, typename backend_t>
+    void evict(int64_t id, transaction<callable_size, backend_t>* transaction) noexcept;
+
+    // Queues the fields of a dropped update of this cache to be marked dirty again, unless they have
+    //  changed since. Can be called from any thread, returns whether the operation was restored.
+    // NOTE(gpascualg): Rejected updates are sent again on every flush until they are accepted
+    bool restore(uint8_t collection, write_failure failure, op_type type, const bson_t* operation_1, const bson_t* operation_2) noexcept;
+
+private:
+    // Marks dirty again whatever "restore" queued
+    void apply_restored() noexcept;
+
+    template <uint32_t callable_size, typename backend_t>
+    void flush_entry(int64_t id, entry& entry, transaction<callable_size, backend_t>* transaction) noexcept;
+
+private:
+    uint8_t _collection;
+    uint64_t _flush_every;
+    uint64_t _since_last_flush;
+    bool _detect_changes;
+    std::unordered_map<int64_t, entry> _entities;
+    std::vector<int64_t> _dirty_ids;
+    np::mutex _restored_mutex;
+    std::vector<failed_update> _restored;
+};
+
+
+template <typename T>
+void entity_cache<T>::init(uint8_t collection, uint64_t flush_every, bool detect_changes) noexcept
+{
+    _collection = collection;
+    _flush_every = flush_every;
+    _since_last_flush = 0;
+    _detect_changes = detect_changes;
+    _entities.clear();
+    _dirty_ids.clear();
+
+    _restored_mutex.lock();
+    _restored.clear();
+    _restored_mutex.unlock();
+}
+
+template <typename T>
+template <typename... Args>
+T* entity_cache<T>::emplace(int64_t id, Args&&... args) noexcept
+{
+    // Nodes are never moved, thus references inside reflection structs are kept valid
+    auto [it, inserted] = _entities.try_emplace(id, std::forward<Args>(args)...);
+    assert(inserted && "Entity is already cached");
+
+    // Entities are assumed to be stored as they are emplaced
+    if (_detect_changes)
+    {
+        it->second.tracker.snapshot(it->second.object);
+    }
+
+    return &it->second.object;
+}
+
+template <typename T>
+T* entity_cache<T>::get(int64_t id) noexcept
+{
+    if (auto it = _entities.find(id); it != _entities.end())
+    {
+        return &it->second.object;
+    }
+
+    return nullptr;
+}
+
+template <typename T>
+template <std::size_t I>
+void entity_cache<T>::mark_dirty(int64_t id) noexcept
+{
+    static_assert(I < T::members_count, "Member index out of range");
+
+    auto it = _entities.find(id);
+    assert(it != _entities.end() && "Entity is not cached");
+
+    auto& tracker = it->second.tracker;
+    if (!tracker.is_dirty())
+    {
+        _dirty_ids.push_back(id);
+    }
+    tracker.template mark_dirty<I>();
+}
+
+template <typename T>
+void entity_cache<T>::mark_dirty(int64_t id, const char* field) noexcept
+{
+    int index = T::index_of(field);
+    assert(index >= 0 && "Field is not a member of the entity");
+
+    auto it = _entities.find(id);
+    assert(it != _entities.end() && "Entity is not cached");
+
+    auto& tracker = it->second.tracker;
+    if (!tracker.is_dirty())
+    {
+        _dirty_ids.push_back(id);
+    }
+    tracker.mark_dirty(index);
+}
+
+template <typename T>
+template <std::size_t I>
+void entity_cache<T>::mark_unset(int64_t id) noexcept
+{
+    static_assert(I < T::members_count, "Member index out of range");
+
+    auto it = _entities.find(id);
+    assert(it != _entities.end() && "Entity is not cached");
+
+    auto& tracker = it->second.tracker;
+    if (!tracker.is_dirty())
+    {
+        _dirty_ids.push_back(id);
+    }
+    tracker.template mark_unset<I>();
+}
+
+template <typename T>
+void entity_cache<T>::mark_unset(int64_t id, const char* field) noexcept
+{
+    int index = T::index_of(field);
+    assert(index >= 0 && "Field is not a member of the entity");
+
+    auto it = _entities.find(id);
+    assert(it != _entities.end() && "Entity is not cached");
+
+    auto& tracker = it->second.tracker;
+    if (!tracker.is_dirty())
+    {
+        _dirty_ids.push_back(id);
+    }
+    tracker.mark_unset(index);
+}
+
+template <typename T>
+template <uint32_t callable_size, typename backend_t>
+bool entity_cache<T>::update(uint64_t diff, transaction<callable_size, backend_t>* transaction) noexcept
+{
+    _since_last_flush += diff;
+    if (_since_last_flush < _flush_every)
+    {
+        return false;
+    }
+
+    flush(transaction);
+    return true;
+}
+
+template <typename T>
+template <uint32_t callable_size, typename backend_t>
+void entity_cache<T>::flush(transaction<callable_size, backend_t>* transaction) noexcept
+{
+    _since_last_flush = 0;
+    apply_restored();
+
+    if (_detect_changes)
+    {
+        // Anything could have changed, entities with no differences are skipped when flushing
+        for (auto& [id, entry] : _entities)
+        {
+            flush_entry(id, entry, transaction);
+        }
+
+        _dirty_ids.clear();
+        return;
+    }
+
+    for (int64_t id : _dirty_ids)
+    {
+        // Entity might have been evicted (and thus flushed) already
+        if (auto it = _entities.find(id); it != _entities.end())
+        {
+            flush_entry(id, it->second, transaction);
+        }
+    }
+
+    _dirty_ids.clear();
+}
+
+template <typename T>
+template <uint32_t callable_size, typename backend_t>
+void entity_cache<T>::evict(int64_t id, transaction<callable_size, backend_t>* transaction) noexcept
+{
+    auto it = _entities.find(id);
+    if (it == _entities.end())
+    {
+        return;
+    }
+
+    // Make sure nothing is lost, its id will be skipped during the next flush
+    apply_restored();
+    flush_entry(id, it->second, transaction);
+    _entities.erase(it);
+}
+
+template <typename T>
+bool entity_cache<T>::restore(uint8_t collection, write_failure failure, op_type type, const bson_t* operation_1, const bson_t* operation_2) noexcept
+{
+    // Unacknowledged updates were applied nonetheless
+    if (collection != _collection || type != op_type::update_one || failure == write_failure::unacknowledged || !operation_2)
+    {
+        return false;
+    }
+
+    bson_iter_t iter;
+    if (!bson_iter_init_find(&iter, operation_1, "_id"))
+    {
+        return false;
+    }
+
+    failed_update update { .id = bson_iter_as_int64(&iter), .set = {}, .unset = {} };
+
+    // Fields are top level keys of both operators
+    auto collect = [operation_2](const char* op, std::bitset<T::members_count>& fields) {
+        bson_iter_t iter;
+        bson_iter_t field;
+        if (bson_iter_init_find(&iter, operation_2, op) && BSON_ITER_HOLDS_DOCUMENT(&iter) && bson_iter_recurse(&iter, &field))
+        {
+            while (bson_iter_next(&field))
+            {
+                if (int index = T::index_of(bson_iter_key(&field)); index >= 0)
+                {
+                    fields.set(index);
+                }
+            }
+        }
+    };
+
+    collect("$set", update.set);
+    collect("$unset", update.unset);
+    if (update.set.none() && update.unset.none())
+    {
+        return false;
+    }
+
+    _restored_mutex.lock();
+    _restored.push_back(update);
+    _restored_mutex.unlock();
+
+    return true;
+}
+
+template <typename T>
+void entity_cache<T>::apply_restored() noexcept
+{
+    _restored_mutex.lock();
+    auto restored = std::move(_restored);
+    _restored.clear();
+    _restored_mutex.unlock();
+
+    for (const auto& update : restored)
+    {
+        // Evicted entities are gone along with their changes
+        auto it = _entities.find(update.id);
+        if (it == _entities.end())
+        {
+            continue;
+        }
+
+        // Fields dirty again hold newer changes, which must not be overwritten
+        auto& [object, tracker] = it->second;
+        if (_detect_changes)
+        {
+            tracker.diff(object);
+        }
+
+        if (!tracker.is_dirty())
+        {
+            _dirty_ids.push_back(update.id);
+        }
+
+        for (std::size_t i = 0; i < T::members_count; ++i)
+        {
+            if (tracker.is_dirty(i))
+            {
+                continue;
+            }
+
+            if (update.unset.test(i))
+            {
+                tracker.mark_unset(i);
+            }
+            else if (update.set.test(i))
+            {
+                tracker.mark_dirty(i);
+            }
+        }
+    }
+}
+
+template <typename T>
+template <uint32_t callable_size, typename backend_t>
+void entity_cache<T>::flush_entry(int64_t id, entry& entry, transaction<callable_size, backend_t>* transaction) noexcept
+{
+    if (_detect_changes)
+    {
+        entry.tracker.diff(entry.object);
+    }
+
+    if (!entry.tracker.is_dirty())
+    {
+        return;
+    }
+
+    bson_t filter = BSON_INITIALIZER;
+    BSON_APPEND_INT64(&filter, "_id", id);
+
+    bson_t update = BSON_INITIALIZER;
+    entry.tracker.build_update(entry.object, &update);
+
+    // Both documents are consumed by the transaction
+    transaction->push_operation(_collection, op_type::update_one, filter, update);
+    entry.tracker.commit(entry.object);
+}
@@ -0,0 +1,594 @@
+#pragma once
+
+#include "database/bson_utils.hpp"
+
+#include <synchronization/mutex.hpp>
+
+#include <mongoc/mongoc.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+// In-process storage backend, meant to benchmark and load test without a running mongod.
+//  Every round-trip (single inserts, bulk executions and cursor batches) blocks the calling
+//  thread for the configured latency, just like the mongo driver does while waiting for the server.
+//  See bson_utils for the supported subset of filters and updates.
+class memory_backend
+{
+public:
+    struct database_t
+    {
+        memory_backend* backend;
+    };
+
+    struct collection_t
+    {
+        np::mutex mutex;
+        std::map<std::string, bson_t*> documents;
+        std::vector<bson_t*> indexes;
+        int64_t next_id;
+    };
+
+    struct bulk_t
+    {
+        enum class op_kind { insert, update_one, update_many, delete_one, delete_many };
+
+        struct op
+        {
+            op_kind kind;
+            bson_t* op_1;
+            bson_t* op_2;
+            bool upsert;
+        };
+
+        collection_t* collection;
+        bool ordered;
+        std::vector<op> ops;
+    };
+
+    struct cursor_t
+    {
+        std::vector<bson_t*> documents;
+        std::size_t position;
+        uint32_t batch_size;
+    };
+
+public:
+    memory_backend() noexcept;
+    ~memory_backend() noexcept;
+
+    inline void set_latency(std::chrono::microseconds latency) noexcept;
+
+    bool init(const char* uri, const std::string& database) noexcept;
+    inline void set_max_connections(uint32_t count) noexcept;
+
+    template <typename F>
+    inline void run(F&& function) noexcept;
+
+    collection_t* get_collection(database_t* database, const char* name) noexcept;
+    inline void release_collection(collection_t* collection) noexcept;
+
+    bool list_indexes(collection_t* collection, std::vector<bson_t*>& indexes) noexcept;
+    bool create_indexes(collection_t* collection, const bson_t* indexes, bson_error_t* error) noexcept;
+
+    bool insert_one(collection_t* collection, const bson_t* document, bson_error_t* error) noexcept;
+
+    inline bulk_t* create_bulk(collection_t* collection, bool ordered) noexcept;
+    inline void bulk_insert(bulk_t* bulk, const bson_t* document) noexcept;
+    inline void bulk_update_one(bulk_t* bulk, const bson_t* selector, const bson_t* update, bool upsert) noexcept;
+    inline void bulk_update_many(bulk_t* bulk, const bson_t* selector, const bson_t* update, bool upsert) noexcept;
+    inline void bulk_delete_one(bulk_t* bulk, const bson_t* selector) noexcept;
+    inline void bulk_delete_many(bulk_t* bulk, const bson_t* selector) noexcept;
+    bool bulk_execute(bulk_t* bulk, bson_t* reply, bson_error_t* error) noexcept;
+    void bulk_destroy(bulk_t* bulk) noexcept;
+
+    cursor_t* find(collection_t* collection, const bson_t* filter, const bson_t* opts) noexcept;
+    bool cursor_next(cursor_t* cursor, const bson_t** document) noexcept;
+    bool cursor_error(cursor_t* cursor, bson_error_t* error) noexcept;
+    void cursor_destroy(cursor_t* cursor) noexcept;
+
+protected:
+    // Same counters the server reports, modified documents are those that actually changed
+    struct update_result
+    {
+        int32_t matched;
+        int32_t modified;
+        int32_t upserted;
+    };
+
+    inline void simulate_round_trip() noexcept;
+
+    // All the following must be called with the collection mutex held
+    bool insert_locked(collection_t* collection, const bson_t* document, bson_error_t* error) noexcept;
+    bool update_locked(collection_t* collection, const bson_t* selector, const bson_t* update, bool many, bool upsert, update_result& result, bson_error_t* error) noexcept;
+    uint32_t delete_locked(collection_t* collection, const bson_t* selector, bool many) noexcept;
+
+private:
+    std::atomic<int64_t> _latency_us;
+    np::mutex _collections_mutex;
+    std::unordered_map<std::string, std::unique_ptr<collection_t>> _collections;
+};
+
+
+inline memory_backend::memory_backend() noexcept :
+    _latency_us(0),
+    _collections_mutex(),
+    _collections()
+{}
+
+inline memory_backend::~memory_backend() noexcept
+{
+    for (auto& [name, collection] : _collections)
+    {
+        for (auto& [id, document] : collection->documents)
+        {
+            bson_destroy(document);
+        }
+
+        for (auto index : collection->indexes)
+        {
+            bson_destroy(index);
+        }
+    }
+}
+
+inline void memory_backend::set_latency(std::chrono::microseconds latency) noexcept
+{
+    _latency_us = latency.count();
+}
+
+inline bool memory_backend::init(const char* uri, const std::string& database) noexcept
+{
+    // Always "connected"
+    return true;
+}
+
+inline void memory_backend::set_max_connections(uint32_t count) noexcept
+{
+    // There are no connections, every task runs its round-trips on its own
+}
+
+template <typename F>
+inline void memory_backend::run(F&& function) noexcept
+{
+    database_t database { .backend = this };
+    function(&database);
+}
+
+inline memory_backend::collection_t* memory_backend::get_collection(database_t* database, const char* name) noexcept
+{
+    _collections_mutex.lock();
+    auto& collection = _collections[name];
+    if (!collection)
+    {
+        collection = std::make_unique<collection_t>();
+        collection->next_id = 0;
+
+        // Same as the server's implicit index
+        bson_t* index = bson_new();
+        bson_t key;
+        BSON_APPEND_DOCUMENT_BEGIN(index, "key", &key);
+        BSON_APPEND_INT32(&key, "_id", 1);
+        bson_append_document_end(index, &key);
+        BSON_APPEND_UTF8(index, "name", "_id_");
+        collection->indexes.push_back(index);
+    }
+    _collections_mutex.unlock();
+
+    return collection.get();
+}
+
+inline void memory_backend::release_collection(collection_t* collection) noexcept
+{
+    // Collections live as long as the backend
+}
+
+inline bool memory_backend::list_indexes(collection_t* collection, std::vector<bson_t*>& indexes) noexcept
+{
+    simulate_round_trip();
+
+    collection->mutex.lock();
+    for (auto index : collection->indexes)
+    {
+        indexes.push_back(bson_copy(index));
+    }
+    collection->mutex.unlock();
+
+    return true;
+}
+
+inline bool memory_backend::create_indexes(collection_t* collection, const bson_t* indexes, bson_error_t* error) noexcept
+{
+    simulate_round_trip();
+
+    // Only specifications are kept, lookups are always full scans and unique constraints are not enforced
+    bson_iter_t iter;
+    if (!bson_iter_init(&iter, indexes))
+    {
+        bson_set_error(error, 0, 67, "Invalid index specifications");
+        return false;
+    }
+
+    collection->mutex.lock();
+    while (bson_iter_next(&iter))
+    {
+        if (!BSON_ITER_HOLDS_DOCUMENT(&iter))
+        {
+            continue;
+        }
+
+        uint32_t length;
+        const uint8_t* data;
+        bson_iter_document(&iter, &length, &data);
+
+        bson_t spec;
+        bson_iter_t name;
+        if (!bson_init_static(&spec, data, length) || !bson_iter_init_find(&name, &spec, "name") || !BSON_ITER_HOLDS_UTF8(&name))
+        {
+            continue;
+        }
+
+        auto exists = std::find_if(collection->indexes.begin(), collection->indexes.end(), [&name](const bson_t* index) {
+            bson_iter_t other;
+            return bson_iter_init_find(&other, index, "name") && bson_utils::values_equal(&name, &other);
+        });
+
+        if (exists == collection->indexes.end())
+        {
+            collection->indexes.push_back(bson_copy(&spec));
+        }
+    }
+    collection->mutex.unlock();
+
+    return true;
+}
+
+inline bool memory_backend::insert_one(collection_t* collection, const bson_t* document, bson_error_t* error) noexcept
+{
+    simulate_round_trip();
+
+    collection->mutex.lock();
+    bool inserted = insert_locked(collection, document, error);
+    collection->mutex.unlock();
+
+    return inserted;
+}
+
+inline memory_backend::bulk_t* memory_backend::create_bulk(collection_t* collection, bool ordered) noexcept
+{
+    return new bulk_t { .collection = collection, .ordered = ordered, .ops = {} };
+}
+
+inline void memory_backend::bulk_insert(bulk_t* bulk, const bson_t* document) noexcept
+{
+    bulk->ops.push_back({ bulk_t::op_kind::insert, bson_copy(document), nullptr, false });
+}
+
+inline void memory_backend::bulk_update_one(bulk_t* bulk, const bson_t* selector, const bson_t* update, bool upsert) noexcept
+{
+    bulk->ops.push_back({ bulk_t::op_kind::update_one, bson_copy(selector), bson_copy(update), upsert });
+}
+
+inline void memory_backend::bulk_update_many(bulk_t* bulk, const bson_t* selector, const bson_t* update, bool upsert) noexcept
+{
+    bulk->ops.push_back({ bulk_t::op_kind::update_many, bson_copy(selector), bson_copy(update), upsert });
+}
+
+inline void memory_backend::bulk_delete_one(bulk_t* bulk, const bson_t* selector) noexcept
+{
+    bulk->ops.push_back({ bulk_t::op_kind::delete_one, bson_copy(selector), nullptr, false });
+}
+
+inline void memory_backend::bulk_delete_many(bulk_t* bulk, const bson_t* selector) noexcept
+{
+    bulk->ops.push_back({ bulk_t::op_kind::delete_many, bson_copy(selector), nullptr, false });
+}
+
+inline bool memory_backend::bulk_execute(bulk_t* bulk, bson_t* reply, bson_error_t* error) noexcept
+{
+    simulate_round_trip();
+
+    int32_t inserted = 0;
+    int32_t removed = 0;
+    update_result updated { .matched = 0, .modified = 0, .upserted = 0 };
+
+    bson_init(reply);
+    bson_t write_errors;
+    BSON_APPEND_ARRAY_BEGIN(reply, "writeErrors", &write_errors);
+    uint32_t num_errors = 0;
+
+    auto collection = bulk->collection;
+    collection->mutex.lock();
+
+    for (uint32_t index = 0; index < bulk->ops.size(); ++index)
+    {
+        auto& op = bulk->ops[index];
+        bson_error_t op_error;
+        bool succeeded = true;
+
+        switch (op.kind)
+        {
+            case bulk_t::op_kind::insert:
+                succeeded = insert_locked(collection, op.op_1, &op_error);
+                inserted += succeeded;
+                break;
+
+            case bulk_t::op_kind::update_one:
+            case bulk_t::op_kind::update_many:
+                succeeded = update_locked(collection, op.op_1, op.op_2, op.kind == bulk_t::op_kind::update_many, op.upsert, updated, &op_error);
+                break;
+
+            case bulk_t::op_kind::delete_one:
+            case bulk_t::op_kind::delete_many:
+                removed += delete_locked(collection, op.op_1, op.kind == bulk_t::op_kind::delete_many);
+                break;
+        }
+
+        if (!succeeded)
+        {
+            // Same layout as the server reply
+            char buffer[16];
+            const char* key;
+            size_t key_len = bson_uint32_to_string(num_errors++, &key, buffer, sizeof(buffer));
+
+            bson_t write_error;
+            bson_append_document_begin(&write_errors, key, static_cast<int>(key_len), &write_error);
+            BSON_APPEND_INT32(&write_error, "index", index);
+            BSON_APPEND_INT32(&write_error, "code", op_error.code);
+            BSON_APPEND_UTF8(&write_error, "errmsg", op_error.message);
+            bson_append_document_end(&write_errors, &write_error);
+
+            if (bulk->ordered)
+            {
+                break;
+            }
+        }
+    }
+
+    collection->mutex.unlock();
+
+    bson_append_array_end(reply, &write_errors);
+    BSON_APPEND_INT32(reply, "nInserted", inserted);
+    BSON_APPEND_INT32(reply, "nMatched", updated.matched);
+    BSON_APPEND_INT32(reply, "nModified", updated.modified);
+    BSON_APPEND_INT32(reply, "nRemoved", removed);
+    BSON_APPEND_INT32(reply, "nUpserted", updated.upserted);
+
+    if (num_errors > 0)
+    {
+        bson_set_error(error, 0, 11000, "Bulk write failed with %u errors", num_errors);
+        return false;
+    }
+
+    return true;
+}
+
+inline void memory_backend::bulk_destroy(bulk_t* bulk) noexcept
+{
+    for (auto& op : bulk->ops)
+    {
+        bson_destroy(op.op_1);
+        if (op.op_2)
+        {
+            bson_destroy(op.op_2);
+        }
+    }
+
+    delete bulk;
+}
+
+inline memory_backend::cursor_t* memory_backend::find(collection_t* collection, const bson_t* filter, const bson_t* opts) noexcept
+{
+    const bson_t* projection = nullptr;
+    bson_t projection_storage;
+    int64_t limit = 0;
+    uint32_t batch_size = 101;
+
+    bson_iter_t iter;
+    if (opts && bson_iter_init(&iter, opts))
+    {
+        while (bson_iter_next(&iter))
+        {
+            std::string_view key = bson_iter_key(&iter);
+            if (key == "projection" && BSON_ITER_HOLDS_DOCUMENT(&iter))
+            {
+                uint32_t len;
+                const uint8_t* data;
+                bson_iter_document(&iter, &len, &data);
+                bson_init_static(&projection_storage, data, len);
+                projection = &projection_storage;
+            }
+            else if (key == "limit")
+            {
+                limit = bson_iter_as_int64(&iter);
+            }
+            else if (key == "batchSize")
+            {
+                batch_size = static_cast<uint32_t>(std::max<int64_t>(1, bson_iter_as_int64(&iter)));
+            }
+        }
+    }
+
+    // Results are a snapshot of the collection at the time of the query
+    auto cursor = new cursor_t { .documents = {}, .position = 0, .batch_size = batch_size };
+
+    collection->mutex.lock();
+    for (auto& [id, document] : collection->documents)
+    {
+        if (bson_utils::matches(document, filter))
+        {
+            bson_t* projected = bson_new();
+            bson_utils::project(document, projection, projected);
+            cursor->documents.push_back(projected);
+
+            if (limit > 0 && cursor->documents.size() == static_cast<std::size_t>(limit))
+            {
+                break;
+            }
+        }
+    }
+    collection->mutex.unlock();
+
+    return cursor;
+}
+
+inline bool memory_backend::cursor_next(cursor_t* cursor, const bson_t** document) noexcept
+{
+    if (cursor->position == cursor->documents.size())
+    {
+        return false;
+    }
+
+    // Each batch is a round-trip
+    if (cursor->position % cursor->batch_size == 0)
+    {
+        simulate_round_trip();
+    }
+
+    *document = cursor->documents[cursor->position++];
+    return true;
+}
+
+inline bool memory_backend::cursor_error(cursor_t* cursor, bson_error_t* error) noexcept
+{
+    // Results are fully materialized when the cursor is created, iterating never fails
+    return false;
+}
+
+inline void memory_backend::cursor_destroy(cursor_t* cursor) noexcept
+{
+    for (auto document : cursor->documents)
+    {
+        bson_destroy(document);
+    }
+
+    delete cursor;
+}
+
+inline void memory_backend::simulate_round_trip() noexcept
+{
+    if (auto latency = _latency_us.load(std::memory_order_relaxed); latency > 0)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(latency));
+    }
+}
+
+inline bool memory_backend::insert_locked(collection_t* collection, const bson_t* document, bson_error_t* error) noexcept
+{
+    bson_iter_t iter;
+    bson_t* stored;
+    std::string key;
+
+    if (bson_iter_init_find(&iter, document, "_id"))
+    {
+        key = bson_utils::value_key(&iter);
+        stored = bson_copy(document);
+    }
+    else
+    {
+        // Generate an id, the server would use an ObjectId
+        int64_t id = collection->next_id++;
+        stored = bson_new();
+        BSON_APPEND_INT64(stored, "_id", id);
+        bson_concat(stored, document);
+
+        bson_iter_init_find(&iter, stored, "_id");
+        key = bson_utils::value_key(&iter);
+    }
+
+    auto [it, inserted] = collection->documents.try_emplace(std::move(key), stored);
+    if (!inserted)
+    {
+        bson_destroy(stored);
+        bson_set_error(error, 0, 11000, "E11000 duplicate key error");
+        return false;
+    }
+
+    return true;
+}
+
+inline bool memory_backend::update_locked(collection_t* collection, const bson_t* selector, const bson_t* update, bool many, bool upsert, update_result& result, bson_error_t* error) noexcept
+{
+    bool matched = false;
+
+    for (auto& [id, document] : collection->documents)
+    {
+        if (!bson_utils::matches(document, selector))
+        {
+            continue;
+        }
+
+        bson_t* updated = bson_new();
+        bson_utils::apply_update(document, update, updated);
+        matched = true;
+        ++result.matched;
+
+        // Updates that leave the document as it was don't count as modified
+        if (updated->len == document->len && memcmp(bson_get_data(updated), bson_get_data(document), document->len) == 0)
+        {
+            bson_destroy(updated);
+        }
+        else
+        {
+            bson_destroy(document);
+            document = updated;
+            ++result.modified;
+        }
+
+        if (!many)
+        {
+            break;
+        }
+    }
+
+    if (matched || !upsert)
+    {
+        return true;
+    }
+
+    bson_t base = BSON_INITIALIZER;
+    bson_utils::filter_to_document(selector, &base);
+
+    bson_t upserted = BSON_INITIALIZER;
+    bson_utils::apply_update(&base, update, &upserted);
+    bool inserted = insert_locked(collection, &upserted, error);
+    result.upserted += inserted;
+
+    bson_destroy(&base);
+    bson_destroy(&upserted);
+    return inserted;
+}
+
+inline uint32_t memory_backend::delete_locked(collection_t* collection, const bson_t* selector, bool many) noexcept
+{
+    uint32_t removed = 0;
+
+    for (auto it = collection->documents.begin(); it != collection->documents.end(); )
+    {
+        if (!bson_utils::matches(it->second, selector))
+        {
+            ++it;
+            continue;
+        }
+
+        bson_destroy(it->second);
+        it = collection->documents.erase(it);
+        ++removed;
+
+        if (!many)
+        {
+            break;
+        }
+    }
+
+    return removed;
+}
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <mongoc/mongoc.h>
+
+#include <string>
+#include <vector>
+
+
+class mongo_backend
+{
+public:
+    using database_t = mongoc_database_t;
+    using collection_t = mongoc_collection_t;
+    using bulk_t = mongoc_bulk_operation_t;
+    using cursor_t = mongoc_cursor_t;
+
+public:
+    mongo_backend() noexcept;
+    ~mongo_backend() noexcept;
+
+    bool init(const char* uri, const std::string& database) noexcept;
+    inline void set_max_connections(uint32_t count) noexcept;
+
+    template <typename F>
+    inline void run(F&& function) noexcept;
+
+    inline collection_t* get_collection(database_t* database, const char* name) noexcept;
+    inline void release_collection(collection_t* collection) noexcept;
+
+    inline bool list_indexes(collection_t* collection, std::vector<bson_t*>& indexes) noexcept;
+    inline bool create_indexes(collection_t* collection, const bson_t* indexes, bson_error_t* error) noexcept;
+
+    inline bool insert_one(collection_t* collection, const bson_t* document, bson_error_t* error) noexcept;
+
+    inline bulk_t* create_bulk(collection_t* collection, bool ordered) noexcept;
+    inline void bulk_insert(bulk_t* bulk, const bson_t* document) noexcept;
+    inline void bulk_update_one(bulk_t* bulk, const bson_t* selector, const bson_t* update, bool upsert) noexcept;
+    inline void bulk_update_many(bulk_t* bulk, const bson_t* selector, const bson_t* update, bool upsert) noexcept;
+    inline void bulk_delete_one(bulk_t* bulk, const bson_t* selector) noexcept;
+    inline void bulk_delete_many(bulk_t* bulk, const bson_t* selector) noexcept;
+    inline bool bulk_execute(bulk_t* bulk, bson_t* reply, bson_error_t* error) noexcept;
+    inline void bulk_destroy(bulk_t* bulk) noexcept;
+
+    inline cursor_t* find(collection_t* collection, const bson_t* filter, const bson_t* opts) noexcept;
+    inline bool cursor_next(cursor_t* cursor, const bson_t** document) noexcept;
+    inline bool cursor_error(cursor_t* cursor, bson_error_t* error) noexcept;
+    inline void cursor_destroy(cursor_t* cursor) noexcept;
+
+private:
+    mongoc_uri_t* _uri;
+    mongoc_client_pool_t* _pool;
+    std::string _database;
+};
+
+
+inline mongo_backend::mongo_backend() noexcept :
+    _uri(nullptr),
+    _pool(nullptr),
+    _database()
+{}
+
+inline mongo_backend::~mongo_backend() noexcept
+{
+    if (_pool)
+    {
+        mongoc_client_pool_destroy(_pool);
+    }
+
+    if (_uri)
+    {
+        mongoc_uri_destroy(_uri);
+    }
+
+    mongoc_cleanup();
+}
+
+inline bool mongo_backend::init(const char* uri, const std::string& database) noexcept
+{
+    // Init db
+    mongoc_init();
+
+    // Check uri
+    bson_error_t error;
+    _uri = mongoc_uri_new_with_error(uri, &error);
+    if (!_uri) 
+    {
+        return false;
+    }
+
+    // Setup pool
+    _pool = mongoc_client_pool_new(_uri);
+    mongoc_client_pool_set_error_api(_pool, 2);
+
+    // Check connection
+    auto client = mongoc_client_pool_pop(_pool);
+
+    bson_t command = BSON_INITIALIZER;
+    BSON_APPEND_INT32(&command, "ping", 1);
+
+    bson_t reply;
+    bool is_connected = mongoc_client_command_simple(client, "admin", &command, NULL, &reply, &error);
+    bson_destroy(&reply);
+    mongoc_client_pool_push(_pool, client);
+
+    // Done
+    _database = database;
+    return is_connected;
+}
+
+inline void mongo_backend::set_max_connections(uint32_t count) noexcept
+{
+    // Clients already popped are kept until pushed back, the pool shrinks as they return
+    if (_pool)
+    {
+        mongoc_client_pool_max_size(_pool, count);
+    }
+}
+
+template <typename F>
+inline void mongo_backend::run(F&& function) noexcept
+{
+    auto client = mongoc_client_pool_pop(_pool);
+    auto database = mongoc_client_get_database(client, _database.c_str());
+    function(database);
+    mongoc_database_destroy(database);
+    mongoc_client_pool_push(_pool, client);
+}
+
+inline mongo_backend::collection_t* mongo_backend::get_collection(database_t* database, const char* name) noexcept
+{
+    return mongoc_database_get_collection(database, name);
+}
+
+inline void mongo_backend::release_collection(collection_t* collection) noexcept
+{
+    mongoc_collection_destroy(collection);
+}
+
+inline bool mongo_backend::list_indexes(collection_t* collection, std::vector<bson_t*>& indexes) noexcept
+{
+    // Collections that don't exist yet have no indexes, the driver returns an empty cursor for them
+    auto cursor = mongoc_collection_find_indexes_with_opts(collection, NULL);
+
+    const bson_t* index;
+    while (mongoc_cursor_next(cursor, &index))
+    {
+        indexes.push_back(bson_copy(index));
+    }
+
+    bool succeeded = !mongoc_cursor_error(cursor, NULL);
+    mongoc_cursor_destroy(cursor);
+    return succeeded;
+}
+
+inline bool mongo_backend::create_indexes(collection_t* collection, const bson_t* indexes, bson_error_t* error) noexcept
+{
+    // All indexes are built by a single command
+    bson_t command = BSON_INITIALIZER;
+    BSON_APPEND_UTF8(&command, "createIndexes", mongoc_collection_get_name(collection));
+    BSON_APPEND_ARRAY(&command, "indexes", indexes);
+
+    bson_t reply;
+    bool succeeded = mongoc_collection_write_command_with_opts(collection, &command, NULL, &reply, error);
+    bson_destroy(&reply);
+    bson_destroy(&command);
+    return succeeded;
+}
+
+inline bool mongo_backend::insert_one(collection_t* collection, const bson_t* document, bson_error_t* error) noexcept
+{
+    return mongoc_collection_insert_one(collection, document, NULL, NULL, error);
+}
+
+inline mongo_backend::bulk_t* mongo_backend::create_bulk(collection_t* collection, bool ordered) noexcept
+{
+    if (ordered)
+    {
+        return mongoc_collection_create_bulk_operation_with_opts(collection, NULL);
+    }
+
+    bson_t opts = BSON_INITIALIZER;
+    BSON_APPEND_BOOL(&opts, "ordered", false);
+    auto bulk = mongoc_collection_create_bulk_operation_with_opts(collection, &opts);
+    bson_destroy(&opts);
+    return bulk;
+}
+
+inline void mongo_backend::bulk_insert(bulk_t* bulk, const bson_t* document) noexcept
+{
+    mongoc_bulk_operation_insert_with_opts(bulk, document, NULL, NULL);
+}
+
+inline void mongo_backend::bulk_update_one(bulk_t* bulk, const bson_t* selector, const bson_t* update, bool upsert) noexcept
+{
+    if (!upsert)
+    {
+        mongoc_bulk_operation_update_one_with_opts(bulk, selector, update, NULL, NULL);
+        return;
+    }
+
+    bson_t opts = BSON_INITIALIZER;
+    BSON_APPEND_BOOL(&opts, "upsert", true);
+    mongoc_bulk_operation_update_one_with_opts(bulk, selector, update, &opts, NULL);
+    bson_destroy(&opts);
+}
+
+inline void mongo_backend::bulk_update_many(bulk_t* bulk, const bson_t* selector, const bson_t* update, bool upsert) noexcept
+{
+    if (!upsert)
+    {
+        mongoc_bulk_operation_update_many_with_opts(bulk, selector, update, NULL, NULL);
+        return;
+    }
+
+    bson_t opts = BSON_INITIALIZER;
+    BSON_APPEND_BOOL(&opts, "upsert", true);
+    mongoc_bulk_operation_update_many_with_opts(bulk, selector, update, &opts, NULL);
+    bson_destroy(&opts);
+}
+
+inline void mongo_backend::bulk_delete_one(bulk_t* bulk, const bson_t* selector) noexcept
+{
+    mongoc_bulk_operation_remove_one_with_opts(bulk, selector, NULL, NULL);
+}
+
+inline void mongo_backend::bulk_delete_many(bulk_t* bulk, const bson_t* selector) noexcept
+{
+    mongoc_bulk_operation_remove_many_with_opts(bulk, selector, NULL, NULL);
+}
+
+inline bool mongo_backend::bulk_execute(bulk_t* bulk, bson_t* reply, bson_error_t* error) noexcept
+{
+    // Reply is always initialized, even on failure
+    return mongoc_bulk_operation_execute(bulk, reply, error) != 0;
+}
+
+inline void mongo_backend::bulk_destroy(bulk_t* bulk) noexcept
+{
+    mongoc_bulk_operation_destroy(bulk);
+}
+
+inline mongo_backend::cursor_t* mongo_backend::find(collection_t* collection, const bson_t* filter, const bson_t* opts) noexcept
+{
+    return mongoc_collection_find_with_opts(collection, filter, opts, NULL);
+}
+
+inline bool mongo_backend::cursor_next(cursor_t* cursor, const bson_t** document) noexcept
+{
+    return mongoc_cursor_next(cursor, document);
+}
+
+inline bool mongo_backend::cursor_error(cursor_t* cursor, bson_error_t* error) noexcept
+{
+    return mongoc_cursor_error(cursor, error);
+}
+
+inline void mongo_backend::cursor_destroy(cursor_t* cursor) noexcept
+{
+    mongoc_cursor_destroy(cursor);
+}
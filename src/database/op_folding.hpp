@@ -0,0 +1,398 @@
+#pragma once
+
+#include "database/bson_utils.hpp"
+#include "database/op_type.hpp"
+
+#include <mongoc/mongoc.h>
+
+#include <algorithm>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+
+// Folds a batch of write operations into an equivalent, smaller one. Only operations addressing a
+//  single document by "_id" are folded, as those are known to commute with operations on other ids:
+//  * Consecutive $set/$inc/$unset updates of a same document are merged into one
+//  * Updates followed by a delete of the same document are dropped
+//  * Inserts followed by updates of the same document insert the updated document instead, which
+//    assumes the insert succeeds
+// Anything else acts as a barrier, nothing is folded across it.
+namespace op_folding
+{
+    enum class field_change { set, unset, inc };
+
+    struct field
+    {
+        field_change change;
+        bson_iter_t value;
+    };
+
+    // Returns a key for the "_id" of filters that are exactly {_id: value}
+    inline bool id_filter_key(const bson_t* filter, std::string& key)
+    {
+        bson_iter_t iter;
+        if (!bson_iter_init(&iter, filter) || !bson_iter_next(&iter) || strcmp(bson_iter_key(&iter), "_id") != 0)
+        {
+            return false;
+        }
+
+        bson_iter_t id = iter;
+        if (bson_iter_next(&iter) || BSON_ITER_HOLDS_DOCUMENT(&id))
+        {
+            return false;
+        }
+
+        key = bson_utils::value_key(&id);
+        return true;
+    }
+
+    inline bool document_id_key(const bson_t* document, std::string& key)
+    {
+        bson_iter_t iter;
+        if (!bson_iter_init_find(&iter, document, "_id"))
+        {
+            return false;
+        }
+
+        key = bson_utils::value_key(&iter);
+        return true;
+    }
+
+    // Collects all changes of a $set/$unset/$inc update, fails on anything else or on dotted keys
+    inline bool collect_fields(const bson_t* update, std::vector<std::pair<std::string_view, field>>& fields)
+    {
+        bson_iter_t iter;
+        if (!bson_utils::is_operator_update(update) || !bson_iter_init(&iter, update))
+        {
+            return false;
+        }
+
+        while (bson_iter_next(&iter))
+        {
+            std::string_view op = bson_iter_key(&iter);
+            field_change change;
+            if (op == "$set") change = field_change::set;
+            else if (op == "$unset") change = field_change::unset;
+            else if (op == "$inc") change = field_change::inc;
+            else return false;
+
+            bson_iter_t values;
+            if (!bson_iter_recurse(&iter, &values))
+            {
+                return false;
+            }
+
+            while (bson_iter_next(&values))
+            {
+                std::string_view key = bson_iter_key(&values);
+                if (key.find('.') != std::string_view::npos)
+                {
+                    return false;
+                }
+
+                if (change == field_change::inc && !bson_utils::is_numeric(bson_iter_type(&values)))
+                {
+                    return false;
+                }
+
+                fields.emplace_back(key, field { change, values });
+            }
+        }
+
+        return true;
+    }
+
+    // Appends the result of adding all increments to a numeric base value, with MongoDB type promotion
+    template <typename I>
+    inline void append_sum(bson_t* out, std::string_view key, const bson_iter_t* base, I&& increments)
+    {
+        bson_type_t type = bson_iter_type(base);
+        double real = bson_iter_as_double(base);
+        int64_t integer = bson_iter_as_int64(base);
+
+        increments([&](const bson_iter_t* increment) {
+            bson_type_t other = bson_iter_type(increment);
+            if (type == BSON_TYPE_DOUBLE || other == BSON_TYPE_DOUBLE) type = BSON_TYPE_DOUBLE;
+            else if (type == BSON_TYPE_INT64 || other == BSON_TYPE_INT64) type = BSON_TYPE_INT64;
+
+            real += bson_iter_as_double(increment);
+            integer += bson_iter_as_int64(increment);
+        });
+
+        if (type == BSON_TYPE_DOUBLE)
+        {
+            bson_append_double(out, key.data(), static_cast<int>(key.size()), real);
+        }
+        else if (type == BSON_TYPE_INT64)
+        {
+            bson_append_int64(out, key.data(), static_cast<int>(key.size()), integer);
+        }
+        else
+        {
+            bson_append_int32(out, key.data(), static_cast<int>(key.size()), static_cast<int32_t>(integer));
+        }
+    }
+
+    inline bool is_foldable_update(const bson_t* update)
+    {
+        std::vector<std::pair<std::string_view, field>> fields;
+        return collect_fields(update, fields);
+    }
+
+    // Writes into "out" (which must be initialized) a single update equivalent to "first" then "second"
+    inline bool merge_updates(const bson_t* first, const bson_t* second, bson_t* out)
+    {
+        std::vector<std::pair<std::string_view, field>> fields;
+        if (!collect_fields(first, fields))
+        {
+            return false;
+        }
+
+        std::vector<std::pair<std::string_view, field>> later;
+        if (!collect_fields(second, later))
+        {
+            return false;
+        }
+
+        // Combine changes on a per-field basis, keeping the first apparition order
+        std::unordered_map<std::string_view, std::size_t> positions;
+        for (std::size_t i = 0; i < fields.size(); ++i)
+        {
+            positions.insert_or_assign(fields[i].first, i);
+        }
+
+        // Increments applied on top of an earlier change are summed when writing the result
+        struct sum
+        {
+            std::size_t position;
+            bson_iter_t increment;
+        };
+        std::vector<sum> sums;
+
+        for (auto& [key, change] : later)
+        {
+            auto it = positions.find(key);
+            if (it == positions.end())
+            {
+                positions.emplace(key, fields.size());
+                fields.emplace_back(key, change);
+                continue;
+            }
+
+            auto& current = fields[it->second].second;
+            if (change.change != field_change::inc)
+            {
+                current = change;
+                std::erase_if(sums, [&](const sum& s) { return s.position == it->second; });
+                continue;
+            }
+
+            if (current.change == field_change::unset)
+            {
+                // Unset then increment is the same as setting the increment
+                current = { field_change::set, change.value };
+                continue;
+            }
+
+            if (current.change == field_change::set && !bson_utils::is_numeric(bson_iter_type(&current.value)))
+            {
+                return false;
+            }
+
+            sums.push_back({ it->second, change.value });
+        }
+
+        // Write them grouped by operator
+        constexpr std::pair<field_change, const char*> operators[] = {
+            { field_change::set, "$set" },
+            { field_change::unset, "$unset" },
+            { field_change::inc, "$inc" }
+        };
+
+        for (auto [change, name] : operators)
+        {
+            bson_t document;
+            bool started = false;
+
+            for (std::size_t i = 0; i < fields.size(); ++i)
+            {
+                auto& [key, field] = fields[i];
+                if (field.change != change)
+                {
+                    continue;
+                }
+
+                if (!started)
+                {
+                    bson_append_document_begin(out, name, -1, &document);
+                    started = true;
+                }
+
+                // Sum all increments applied after the value was set or incremented
+                auto has_sums = std::any_of(sums.begin(), sums.end(), [i](const sum& s) { return s.position == i; });
+                if (!has_sums)
+                {
+                    bson_append_iter(&document, key.data(), static_cast<int>(key.size()), &field.value);
+                    continue;
+                }
+
+                append_sum(&document, key, &field.value, [&sums, i](auto&& callback) {
+                    for (auto& s : sums)
+                    {
+                        if (s.position == i)
+                        {
+                            callback(&s.increment);
+                        }
+                    }
+                });
+            }
+
+            if (started)
+            {
+                bson_append_document_end(out, &document);
+            }
+        }
+
+        return true;
+    }
+
+    // Operations must expose "type", "operation_op_1", "operation_op_2" as heap bson_t* and "destroy()"
+    template <typename T>
+    void fold(std::vector<T>& operations)
+    {
+        struct document_state
+        {
+            // Last operation that later ones can be folded into, if any
+            std::size_t last;
+            bool has_last;
+
+            // Updates since the document was last inserted, a delete makes them useless
+            std::vector<std::size_t> updates;
+        };
+
+        std::unordered_map<std::string, document_state> documents;
+        std::vector<bool> dropped(operations.size(), false);
+        std::string key;
+
+        for (std::size_t i = 0; i < operations.size(); ++i)
+        {
+            auto& operation = operations[i];
+
+            switch (operation.type)
+            {
+                case op_type::insert:
+                {
+                    if (!document_id_key(operation.operation_op_1, key))
+                    {
+                        break;
+                    }
+
+                    auto& state = documents[key];
+                    state.last = i;
+                    state.has_last = true;
+                    state.updates.clear();
+                    break;
+                }
+
+                case op_type::update_one:
+                case op_type::upsert_one:
+                {
+                    if (!id_filter_key(operation.operation_op_1, key))
+                    {
+                        documents.clear();
+                        break;
+                    }
+
+                    auto& state = documents[key];
+                    if (!state.has_last || !is_foldable_update(operation.operation_op_2))
+                    {
+                        state.last = i;
+                        state.has_last = is_foldable_update(operation.operation_op_2);
+                        state.updates.push_back(i);
+                        break;
+                    }
+
+                    auto& previous = operations[state.last];
+                    bson_t* folded = bson_new();
+                    bool merged = false;
+
+                    if (previous.type == op_type::insert)
+                    {
+                        // The inserted document will already contain the changes
+                        bson_utils::apply_update(previous.operation_op_1, operation.operation_op_2, folded);
+                        std::swap(previous.operation_op_1, folded);
+                        merged = true;
+                    }
+                    else if (operation.type == op_type::update_one || previous.type == op_type::upsert_one)
+                    {
+                        // Upserting after an update might create a document the update never saw
+                        merged = merge_updates(previous.operation_op_2, operation.operation_op_2, folded);
+                        if (merged)
+                        {
+                            std::swap(previous.operation_op_2, folded);
+                        }
+                    }
+
+                    bson_destroy(folded);
+
+                    if (merged)
+                    {
+                        dropped[i] = true;
+                    }
+                    else
+                    {
+                        state.last = i;
+                        state.updates.push_back(i);
+                    }
+                    break;
+                }
+
+                case op_type::delete_one:
+                {
+                    if (!id_filter_key(operation.operation_op_1, key))
+                    {
+                        documents.clear();
+                        break;
+                    }
+
+                    if (auto it = documents.find(key); it != documents.end())
+                    {
+                        for (auto index : it->second.updates)
+                        {
+                            dropped[index] = true;
+                        }
+                        documents.erase(it);
+                    }
+                    break;
+                }
+
+                default:
+                    // Might touch any document, can't reason across it
+                    documents.clear();
+                    break;
+            }
+        }
+
+        // Compact, keeping the relative order
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < operations.size(); ++i)
+        {
+            if (dropped[i])
+            {
+                operations[i].destroy();
+                continue;
+            }
+
+            if (count != i)
+            {
+                operations[count] = std::move(operations[i]);
+            }
+            ++count;
+        }
+
+        operations.erase(operations.begin() + count, operations.end());
+    }
+}
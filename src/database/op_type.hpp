@@ -0,0 +1,56 @@
+#pragma once
+
+#include <mongoc/mongoc.h>
+
+#include <inttypes.h>
+
+
+enum class op_type : uint8_t
+{
+    insert,
+    delete_one,
+    delete_many,
+    update_one,
+    update_many,
+    upsert_one,
+    upsert_many
+};
+
+// Adds a write operation to a backend bulk, operation_2 is only used by updates and upserts
+template <typename backend_t>
+inline void bulk_append(backend_t& backend, typename backend_t::bulk_t* bulk, op_type type, const bson_t* operation_1, const bson_t* operation_2)
+{
+    switch (type)
+    {
+        case op_type::insert:
+            backend.bulk_insert(bulk, operation_1);
+            break;
+
+        case op_type::update_one:
+            backend.bulk_update_one(bulk, operation_1, operation_2, false);
+            break;
+
+        case op_type::update_many:
+            backend.bulk_update_many(bulk, operation_1, operation_2, false);
+            break;
+
+        case op_type::upsert_one:
+            backend.bulk_update_one(bulk, operation_1, operation_2, true);
+            break;
+
+        case op_type::upsert_many:
+            backend.bulk_update_many(bulk, operation_1, operation_2, true);
+            break;
+
+        case op_type::delete_one:
+            backend.bulk_delete_one(bulk, operation_1);
+            break;
+
+        case op_type::delete_many:
+            backend.bulk_delete_many(bulk, operation_1);
+            break;
+
+        default:
+            break;
+    }
+}
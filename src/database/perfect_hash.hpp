@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string.h>
+#include <string_view>
+
+
+// FNV-1a, where different seeds give unrelated hashes
+constexpr uint32_t seeded_hash(uint32_t seed, const char* str, std::size_t len)
+{
+    uint32_t hash = 2166136261u ^ (seed * 0x9E3779B9u);
+
+    for (std::size_t i = 0; i < len; ++i)
+    {
+        hash = hash ^ static_cast<uint8_t>(str[i]);
+        hash = hash * 16777619u;
+    }
+
+    return hash;
+}
+
+constexpr std::size_t next_power_of_two(std::size_t value)
+{
+    std::size_t power = 1;
+    while (power < value)
+    {
+        power <<= 1;
+    }
+    return power;
+}
+
+// Perfect hash over a set of keys known at compile time, built by hash and displace: keys are
+//  split into buckets, and each bucket gets its own seed sending all its keys to empty slots.
+//  Lookups filter by length, hash twice and confirm the candidate with a single memcmp.
+template <std::size_t N>
+struct perfect_hash
+{
+    static constexpr std::size_t buckets_count = next_power_of_two(N);
+    static constexpr std::size_t slots_count = next_power_of_two(2 * N);
+    static constexpr uint8_t empty = 0xFF;
+    static_assert(N < empty, "Too many keys for a perfect hash");
+
+    constexpr perfect_hash(const std::array<std::string_view, N>& keys);
+
+    inline int find(const char* key, std::size_t len) const noexcept;
+
+    std::array<std::string_view, N> keys;
+    std::array<uint32_t, buckets_count> seeds;
+    std::array<uint8_t, slots_count> slots;
+    std::size_t min_length;
+    std::size_t max_length;
+};
+
+
+template <std::size_t N>
+constexpr perfect_hash<N>::perfect_hash(const std::array<std::string_view, N>& keys) :
+    keys(keys),
+    seeds(),
+    slots(),
+    min_length(N ? std::numeric_limits<std::size_t>::max() : 0),
+    max_length(0)
+{
+    slots.fill(empty);
+
+    std::array<std::size_t, N> bucket_of {};
+    std::array<std::size_t, buckets_count> sizes {};
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        bucket_of[i] = seeded_hash(0, keys[i].data(), keys[i].size()) & (buckets_count - 1);
+        ++sizes[bucket_of[i]];
+
+        min_length = std::min(min_length, keys[i].size());
+        max_length = std::max(max_length, keys[i].size());
+    }
+
+    // Largest buckets first, while there are still plenty of empty slots
+    std::array<std::size_t, buckets_count> order {};
+    for (std::size_t i = 0; i < buckets_count; ++i)
+    {
+        std::size_t j = i;
+        for (; j > 0 && sizes[order[j - 1]] < sizes[i]; --j)
+        {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+
+    for (std::size_t bucket : order)
+    {
+        if (sizes[bucket] == 0)
+        {
+            break;
+        }
+
+        for (uint32_t seed = 1; ; ++seed)
+        {
+            if (seed == (1 << 20))
+            {
+                throw std::logic_error("Could not build perfect hash, are there duplicated keys?");
+            }
+
+            std::array<std::size_t, N> chosen_slots {};
+            std::array<std::size_t, N> chosen_keys {};
+            std::size_t count = 0;
+            bool valid = true;
+
+            for (std::size_t i = 0; i < N && valid; ++i)
+            {
+                if (bucket_of[i] != bucket)
+                {
+                    continue;
+                }
+
+                std::size_t slot = seeded_hash(seed, keys[i].data(), keys[i].size()) & (slots_count - 1);
+                valid = slots[slot] == empty;
+                for (std::size_t k = 0; k < count && valid; ++k)
+                {
+                    valid = chosen_slots[k] != slot;
+                }
+
+                chosen_slots[count] = slot;
+                chosen_keys[count] = i;
+                ++count;
+            }
+
+            if (valid)
+            {
+                for (std::size_t k = 0; k < count; ++k)
+                {
+                    slots[chosen_slots[k]] = static_cast<uint8_t>(chosen_keys[k]);
+                }
+                seeds[bucket] = seed;
+                break;
+            }
+        }
+    }
+}
+
+template <std::size_t N>
+inline int perfect_hash<N>::find(const char* key, std::size_t len) const noexcept
+{
+    if (len < min_length || len > max_length)
+    {
+        return -1;
+    }
+
+    std::size_t bucket = seeded_hash(0, key, len) & (buckets_count - 1);
+    uint8_t index = slots[seeded_hash(seeds[bucket], key, len) & (slots_count - 1)];
+
+    // Anything not in the set also lands somewhere, confirm it
+    if (index == empty || keys[index].size() != len || memcmp(keys[index].data(), key, len) != 0)
+    {
+        return -1;
+    }
+
+    return index;
+}
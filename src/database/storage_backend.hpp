@@ -0,0 +1,57 @@
+#pragma once
+
+#include <mongoc/mongoc.h>
+
+#include <concepts>
+#include <string>
+#include <vector>
+
+
+// Operations a storage backend has to provide for database and transaction to work on top of it.
+//  Documents are always libbson documents, regardless of how the backend stores them.
+template <typename B>
+concept storage_backend = requires (
+    B backend,
+    const char* uri,
+    const std::string& name,
+    typename B::database_t* database,
+    typename B::collection_t* collection,
+    typename B::bulk_t* bulk,
+    typename B::cursor_t* cursor,
+    const bson_t* document,
+    const bson_t** next,
+    bson_t* reply,
+    bson_error_t* error,
+    std::vector<bson_t*>& indexes,
+    uint32_t count,
+    bool flag)
+{
+    // Connection and per-task database handles
+    { backend.init(uri, name) } -> std::same_as<bool>;
+    { backend.set_max_connections(count) };
+    { backend.run([](typename B::database_t*) {}) };
+    { backend.get_collection(database, uri) } -> std::same_as<typename B::collection_t*>;
+    { backend.release_collection(collection) };
+
+    // Schema, listed indexes are heap copies owned by the caller and created ones an array of
+    //  createIndexes specifications
+    { backend.list_indexes(collection, indexes) } -> std::same_as<bool>;
+    { backend.create_indexes(collection, document, error) } -> std::same_as<bool>;
+
+    // Writes
+    { backend.insert_one(collection, document, error) } -> std::same_as<bool>;
+    { backend.create_bulk(collection, flag) } -> std::same_as<typename B::bulk_t*>;
+    { backend.bulk_insert(bulk, document) };
+    { backend.bulk_update_one(bulk, document, document, flag) };
+    { backend.bulk_update_many(bulk, document, document, flag) };
+    { backend.bulk_delete_one(bulk, document) };
+    { backend.bulk_delete_many(bulk, document) };
+    { backend.bulk_execute(bulk, reply, error) } -> std::same_as<bool>;
+    { backend.bulk_destroy(bulk) };
+
+    // Reads
+    { backend.find(collection, document, document) } -> std::same_as<typename B::cursor_t*>;
+    { backend.cursor_next(cursor, next) } -> std::same_as<bool>;
+    { backend.cursor_error(cursor, error) } -> std::same_as<bool>;
+    { backend.cursor_destroy(cursor) };
+};
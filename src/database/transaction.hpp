@@ -1,33 +1,33 @@
 #pragma once
 
 #include "database/database.hpp"
+#include "database/op_folding.hpp"
+#include "database/op_type.hpp"
+#include "database/write_outcome.hpp"
 
 #include <boost/circular_buffer.hpp>
 #include <function2/function2.hpp>
 #include <mongoc/mongoc.h>
+#include <synchronization/mutex.hpp>
 #include <tao/tuple/tuple.hpp>
 #include <inplace_function.h>
 
 #include <atomic>
+#include <chrono>
+#include <memory>
 #include <optional>
-#include <set>
+#include <vector>
 
 
-enum class op_type
-{
-    insert,
-    delete_one,
-    delete_many,
-    update_one,
-    update_many,
-    upsert_one,
-    upsert_many
-};
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+class transaction_manager;
 
-template <uint32_t callable_size>
+template <uint32_t callable_size, typename backend_t = mongo_backend>
 class transaction
 {
-    using callable_t = stdext::inplace_function<void(mongoc_collection_t*), callable_size>;
+    template <typename, uint32_t, typename> friend class transaction_manager;
+
+    using callable_t = stdext::inplace_function<void(typename backend_t::collection_t*), callable_size>;
 
     struct transaction_info
     {
@@ -37,22 +37,95 @@ class transaction
             uint64_t id;
         };
 
+        inline void destroy();
+
+        uint64_t id;
         std::optional<struct dependency> dependency;
         op_type type;
-        bson_t operation_op_1;
-        bson_t operation_op_2;
+        bson_t* operation_op_1;
+        bson_t* operation_op_2;
         std::optional<callable_t> callable;
-        bool pending;
-        bool done;
+        bool ordered;
     };
 
+    // Operations that have not been sent yet live in a ring indexed by "id - first_id", sending them
+    //  moves them out of it. Batches of a collection are sent one at a time, in order, thus every
+    //  id below "completed_id" is known to be done.
+    // Other transactions depending on an id register their own collection_info as waiter, which
+    //  unlike the transaction does not move, and are woken up through it as soon as the id completes.
+    //  Ids that were never issued, as well as owners that are destroyed, count as completed.
+    // Operations that failed with a transient error are parked, and sent again before anything else
+    //  once their backoff expires.
+    // Journaled batches are done as soon as they are in the journal, and deferred without any backoff
+    //  while it is full.
     struct collection_info
     {
+        struct waiter
+        {
+            uint64_t id;
+            collection_info* info;
+        };
+
         collection_info();
 
+        transaction_info& emplace_back();
+        void complete(uint64_t final_id);
+        void complete(uint64_t final_id, std::vector<transaction_info>&& failed);
+        void defer(uint64_t final_id, std::vector<transaction_info>&& pending);
+        inline void report(uint8_t collection, write_failure failure, const transaction_info& transaction) const;
+
+        // Releases every waiter on an id below "final_id"
+        void release_waiters(uint64_t final_id);
+        // Marks the dependency this collection waits on as met and wakes its transaction
+        inline void release();
+
         uint64_t first_id;
         std::atomic<uint64_t> current_id;
-        std::unordered_map<uint64_t, transaction_info> transactions;
+        std::atomic<uint64_t> completed_id;
+        std::atomic<bool> in_flight;
+        boost::circular_buffer<transaction_info> transactions;
+
+        // Failed operations waiting to be retried
+        std::vector<transaction_info> retry;
+        uint64_t retry_final_id;
+        uint32_t retry_attempts;
+        std::chrono::steady_clock::time_point retry_at;
+
+        // Dependency at the front of the ring, if any, is waiting to be released
+        bool waiting;
+        std::atomic<bool> dependency_released;
+
+        // Also guards "owner", which moves along with the transaction
+        np::mutex waiters_mutex;
+        std::vector<waiter> waiters;
+        transaction* owner;
+
+        write_failure_callback_t on_failure;
+    };
+
+    // Ready write operations handed to a sink, which sends them and flags their completion
+    struct write_batch
+    {
+        collection_info* info;
+        uint8_t collection;
+        uint64_t final_id;
+        std::vector<transaction_info> operations;
+    };
+
+    // Unordered callables run concurrently, the last one to finish completes the batch
+    struct parallel_batch
+    {
+        collection_info* info;
+        uint64_t final_id;
+        std::vector<transaction_info> transactions;
+        std::atomic<uint32_t> remaining;
+    };
+
+    // Managed transactions are linked here while they have work to do
+    struct active_list
+    {
+        std::atomic<transaction*> head;
+        std::atomic<uint32_t> wakeups;
     };
 
 public:
@@ -64,72 +137,279 @@ public:
         _since_last_execution(other._since_last_execution),
         _pending_callables(static_cast<uint8_t>(other._pending_callables)),
         _flagged(other._flagged),
-        _scheduled(other._scheduled)
-    {}
+        _scheduled(other._scheduled),
+        _fold_operations(other._fold_operations),
+        _active_list(other._active_list),
+        _next_active(nullptr),
+        _enlisted(false),
+        _woken(false),
+        _managed_id(other._managed_id)
+    {
+        adopt_collections();
+        _woken = static_cast<bool>(other._woken.exchange(false));
+    }
 
     transaction& operator=(transaction&& other) noexcept
     {
+        release_collections();
         _collections = std::move(other._collections);
+        adopt_collections();
         _execute_every = other._execute_every;
         _since_last_execution = other._since_last_execution;
         _pending_callables = static_cast<uint8_t>(other._pending_callables);
         _flagged = other._flagged;
         _scheduled = other._scheduled;
+        _fold_operations = other._fold_operations;
+        _active_list = other._active_list;
+        _next_active = nullptr;
+        _enlisted = false;
+        _woken = static_cast<bool>(other._woken.exchange(false));
+        _managed_id = other._managed_id;
 
         return *this;
     }
 
+    ~transaction() noexcept
+    {
+        release_collections();
+    }
+
     template <typename traits>
-    void init(database<traits>* database, uint64_t execute_every) noexcept;
+    void init(database<traits, backend_t>* database, uint64_t execute_every) noexcept;
 
     template <typename F, typename traits>
-    bool update(uint64_t diff, database<traits>* database, F&& id_to_transaction_getter) noexcept;
+    bool update(uint64_t diff, database<traits, backend_t>* database, F&& id_to_transaction_getter, std::vector<write_batch>* sink = nullptr) noexcept;
 
     uint64_t push_operation(uint8_t collection, op_type type, bson_t& operation);
     uint64_t push_operation(uint8_t collection, op_type type, bson_t& operation_1, bson_t& operation_2);
-    uint64_t push_callable(uint8_t collection, callable_t&& callable);
+    // Callables that don't need to keep order are run concurrently with each other, but never with
+    //  write operations or ordered callables
+    uint64_t push_callable(uint8_t collection, callable_t&& callable, bool ordered = true);
     void push_dependency(uint8_t collection, uint64_t owner, uint64_t id);
 
     inline void flag_deletion();
     inline void unflag_deletion();
 
+    // Merge, drop and combine ready write operations before sending them, see op_folding.hpp
+    inline void set_folding(bool enabled) noexcept;
+
+    // Operations dropped after being sent, or applied without the requested write concern, are
+    //  reported here. Journaled ones are reported by the database, see set_journal_failure_callback
+    void set_failure_callback(const write_failure_callback_t& callback) noexcept;
+
 private:
     template <typename F>
-    std::vector<transaction_info*> get_pending_operations(uint8_t collection, F&& id_to_transaction_getter, bool& has_non_callable_transactions);
-    transaction_info* get_transaction(uint8_t collection, uint64_t id);
+    std::vector<transaction_info> get_pending_operations(uint8_t collection, F&& id_to_transaction_getter, bool& has_non_callable_transactions, bool& has_unordered_callables);
+    bool wait_for(uint8_t collection, uint64_t id, collection_info* waiter);
+    uint64_t append_to_journal(write_journal* journal, uint8_t collection, std::vector<transaction_info>& transactions);
+
+    // Wakes go through collection_info, which must point back to wherever the transaction lives now
+    void adopt_collections() noexcept;
+    // Dependencies on a transaction that goes away are met
+    void release_collections() noexcept;
+
+    // Managed transactions are only updated while they have some work to do
+    inline bool has_work() noexcept;
+    inline void enlist() noexcept;
+    inline void wake() noexcept;
 
 private:
-    std::unordered_map<uint8_t, collection_info*> _collections;
+    std::unordered_map<uint8_t, std::unique_ptr<collection_info>> _collections;
     uint64_t _execute_every;
     uint64_t _since_last_execution;
     std::atomic<uint8_t> _pending_callables;
     bool _flagged;
     bool _scheduled;
+    bool _fold_operations;
+
+    // Intrusive list of active transactions, owned by the manager
+    active_list* _active_list;
+    transaction* _next_active;
+    std::atomic<bool> _enlisted;
+    std::atomic<bool> _woken;
+    uint64_t _managed_id;
 };
 
 
-template <uint32_t callable_size>
-transaction<callable_size>::collection_info::collection_info() :
+template <uint32_t callable_size, typename backend_t>
+inline void transaction<callable_size, backend_t>::transaction_info::destroy()
+{
+    if (operation_op_1)
+    {
+        bson_destroy(operation_op_1);
+        operation_op_1 = nullptr;
+    }
+
+    if (operation_op_2)
+    {
+        bson_destroy(operation_op_2);
+        operation_op_2 = nullptr;
+    }
+}
+
+template <uint32_t callable_size, typename backend_t>
+transaction<callable_size, backend_t>::collection_info::collection_info() :
     first_id(0),
-    current_id(0)
+    current_id(0),
+    completed_id(0),
+    in_flight(false),
+    transactions(64),
+    retry(),
+    retry_final_id(0),
+    retry_attempts(0),
+    retry_at(),
+    waiting(false),
+    dependency_released(false),
+    waiters_mutex(),
+    waiters(),
+    owner(nullptr),
+    on_failure()
 {}
 
-template <uint32_t callable_size>
+template <uint32_t callable_size, typename backend_t>
+typename transaction<callable_size, backend_t>::transaction_info& transaction<callable_size, backend_t>::collection_info::emplace_back()
+{
+    // A full ring would overwrite its oldest entry, grow it instead
+    if (transactions.full())
+    {
+        transactions.set_capacity(transactions.capacity() * 2);
+    }
+
+    transactions.push_back({});
+    transactions.back().id = current_id++;
+    return transactions.back();
+}
+
+template <uint32_t callable_size, typename backend_t>
+void transaction<callable_size, backend_t>::collection_info::complete(uint64_t final_id, std::vector<transaction_info>&& failed)
+{
+    constexpr auto retry_base = std::chrono::milliseconds(50);
+    constexpr uint32_t retry_max_shift = 7;
+
+    if (failed.empty())
+    {
+        retry_attempts = 0;
+        complete(final_id);
+        return;
+    }
+
+    // Everything before the first failed operation is done, ids are kept for the retry
+    uint64_t first_failed_id = failed.front().id;
+    retry = std::move(failed);
+    retry_final_id = final_id;
+    retry_at = std::chrono::steady_clock::now() + retry_base * (1 << std::min(retry_attempts, retry_max_shift));
+    ++retry_attempts;
+
+    complete(first_failed_id);
+}
+
+template <uint32_t callable_size, typename backend_t>
+void transaction<callable_size, backend_t>::collection_info::defer(uint64_t final_id, std::vector<transaction_info>&& pending)
+{
+    // Nothing failed, they go first on the next update without touching the backoff
+    uint64_t first_pending_id = pending.front().id;
+    retry = std::move(pending);
+    retry_final_id = final_id;
+    retry_at = std::chrono::steady_clock::now();
+
+    complete(first_pending_id);
+}
+
+template <uint32_t callable_size, typename backend_t>
+void transaction<callable_size, backend_t>::collection_info::complete(uint64_t final_id)
+{
+    completed_id.store(final_id, std::memory_order_release);
+
+    // Release anyone waiting on the now completed ids
+    release_waiters(final_id);
+
+    // Last, as the transaction can be destroyed as soon as nothing is in flight
+    in_flight.store(false, std::memory_order_release);
+}
+
+template <uint32_t callable_size, typename backend_t>
+void transaction<callable_size, backend_t>::collection_info::release_waiters(uint64_t final_id)
+{
+    // Waiters are released outside of the lock, they take their own
+    std::vector<collection_info*> released;
+
+    waiters_mutex.lock();
+    std::erase_if(waiters, [final_id, &released](const waiter& waiter) {
+        if (waiter.id >= final_id)
+        {
+            return false;
+        }
+
+        released.push_back(waiter.info);
+        return true;
+    });
+    waiters_mutex.unlock();
+
+    for (auto info : released)
+    {
+        info->release();
+    }
+}
+
+template <uint32_t callable_size, typename backend_t>
+inline void transaction<callable_size, backend_t>::collection_info::release()
+{
+    waiters_mutex.lock();
+    dependency_released.store(true, std::memory_order_release);
+    if (owner)
+    {
+        owner->wake();
+    }
+    waiters_mutex.unlock();
+}
+
+template <uint32_t callable_size, typename backend_t>
+inline void transaction<callable_size, backend_t>::collection_info::report(uint8_t collection, write_failure failure, const transaction_info& transaction) const
+{
+    if (on_failure)
+    {
+        on_failure(collection, failure, transaction.type, transaction.operation_op_1, transaction.operation_op_2);
+    }
+}
+
+template <uint32_t callable_size, typename backend_t>
 template <typename traits>
-void transaction<callable_size>::init(database<traits>* database, uint64_t execute_every) noexcept
+void transaction<callable_size, backend_t>::init(database<traits, backend_t>* database, uint64_t execute_every) noexcept
 {
     // Avoid race conditions by creating now the whole set of collections now
     for (const auto& [key, name] : database->get_all_collections())
     {
-        _collections.emplace(key, new collection_info());
+        if (!_collections.contains(key))
+        {
+            _collections.emplace(key, std::make_unique<collection_info>());
+        }
     }
+    adopt_collections();
 
     // Clear inner collections, there is no need to reallocate
     for (auto& [id, collection] : _collections)
     {
+        for (auto& transaction : collection->transactions)
+        {
+            transaction.destroy();
+        }
+
         collection->first_id = 0;
         collection->current_id = 0;
+        collection->completed_id = 0;
+        collection->in_flight = false;
         collection->transactions.clear();
+        for (auto& transaction : collection->retry)
+        {
+            transaction.destroy();
+        }
+        collection->retry.clear();
+        collection->retry_attempts = 0;
+        assert((!collection->waiting || collection->dependency_released) && "Transactions can't be reset while waiting on a dependency");
+        collection->waiting = false;
+        collection->dependency_released = false;
+        collection->release_waiters(UINT64_MAX);
+        collection->on_failure = nullptr;
     }
 
     _execute_every = execute_every;
@@ -137,11 +417,16 @@ void transaction<callable_size>::init(database<traits>* database, uint64_t execu
     _pending_callables = 0;
     _flagged = false;
     _scheduled = false;
+    _fold_operations = false;
+    _active_list = nullptr;
+    _next_active = nullptr;
+    _enlisted = false;
+    _woken = false;
 }
 
-template <uint32_t callable_size>
+template <uint32_t callable_size, typename backend_t>
 template <typename F, typename traits>
-bool transaction<callable_size>::update(uint64_t diff, database<traits>* database, F&& id_to_transaction_getter) noexcept
+bool transaction<callable_size, backend_t>::update(uint64_t diff, database<traits, backend_t>* database, F&& id_to_transaction_getter, std::vector<write_batch>* sink) noexcept
 {
     if (_flagged)
     {
@@ -156,13 +441,8 @@ bool transaction<callable_size>::update(uint64_t diff, database<traits>* databas
         // We will only delete if all transactions are done
         for (auto& [collection, info] : _collections)
         {
-            if (info->first_id != info->current_id)
-            {
-                can_delete = false;
-                break;
-            }
-
-            if (auto it = info->transactions.find(info->current_id - 1); it != info->transactions.end() && !it->second.done)
+            // Completions touch their collection until they clear the flag
+            if (info->first_id != info->current_id || info->completed_id != info->current_id || info->in_flight.load(std::memory_order_acquire))
             {
                 can_delete = false;
                 break;
@@ -180,8 +460,10 @@ bool transaction<callable_size>::update(uint64_t diff, database<traits>* databas
     // We have to execute if
     //  a) Too much time has elapsed
     //  b) There are pending callables
+    //  c) A dependency has just been met
     _since_last_execution += diff;
-    if (_pending_callables == 0 && _since_last_execution < _execute_every)
+    bool woken = _woken.exchange(false);
+    if (_pending_callables == 0 && !woken && _since_last_execution < _execute_every)
     {
         // Nothing to do here
         return true;
@@ -191,104 +473,186 @@ bool transaction<callable_size>::update(uint64_t diff, database<traits>* databas
     // Transactions are pending when ids don't match
     for (auto& [collection, info] : _collections)
     {
-        if (info->first_id == info->current_id)
+        // Wait for the previous batch to complete, operations must be applied in order. Its completion
+        //  publishes any failed operations before clearing the flag, thus they can only be read after
+        if (info->in_flight.load(std::memory_order_acquire))
         {
             continue;
         }
-    
+
+        bool retrying = !info->retry.empty();
+        if (!retrying && info->first_id == info->current_id)
+        {
+            continue;
+        }
+
+        // Failed operations go first, once their backoff has expired
+        if (retrying && std::chrono::steady_clock::now() < info->retry_at)
+        {
+            continue;
+        }
+
+        // Don't queue more work on a saturated database, it would only get stale
+        if (database->is_saturated(collection))
+        {
+            continue;
+        }
+
         // Get any pending operation
-        bool has_non_callable_transactions;
-        std::vector<transaction_info*> transactions = get_pending_operations(collection, id_to_transaction_getter, has_non_callable_transactions);
-        auto final_id = info->first_id;
-        
+        bool has_non_callable_transactions = true;
+        bool has_unordered_callables = false;
+        std::vector<transaction_info> transactions;
+        uint64_t final_id;
+
+        if (retrying)
+        {
+            transactions = std::move(info->retry);
+            info->retry.clear();
+            final_id = info->retry_final_id;
+        }
+        else
+        {
+            transactions = get_pending_operations(collection, id_to_transaction_getter, has_non_callable_transactions, has_unordered_callables);
+            final_id = info->first_id;
+        }
+
         if (transactions.empty())
         {
-            break;
+            // Maybe some dependencies were met, which need no execution at all
+            info->complete(final_id);
+            continue;
         }
 
         // Everything is write ops
         if (has_non_callable_transactions)
         {
+            if (_fold_operations && !retrying)
+            {
+                op_folding::fold(transactions);
+            }
+
+            // Journaled writes are done once appended, the drainer applies them in order and reports
+            //  its failures through the database. When the journal is full they wait until it makes
+            //  room, writing them directly could overtake older journaled ones.
+            // NOTE(gpascualg): Batches larger than the whole journal never fit, size it accordingly
+            if (auto journal = database->journal())
+            {
+                if (append_to_journal(journal, collection, transactions))
+                {
+                    info->complete(final_id);
+                }
+                else
+                {
+                    info->defer(final_id, std::move(transactions));
+                }
+
+                database->drain_journal();
+                continue;
+            }
+
+            info->in_flight = true;
+
+            // Let the sink merge them with the writes of other transactions
+            if (sink)
+            {
+                sink->push_back({ .info = info.get(), .collection = collection, .final_id = final_id, .operations = std::move(transactions) });
+                continue;
+            }
+
+            database->acquire_in_flight(collection);
             database->execute([
                 database,
+                info = info.get(),
                 collection = collection,
+                final_id,
                 transactions = std::move(transactions)
-            ](auto mongo_database)
+            ](auto mongo_database) mutable
             {
+                auto& backend = database->backend();
                 auto col = database->get_collection(mongo_database, collection);
-                auto bulk = mongoc_collection_create_bulk_operation_with_opts(col, NULL);
+                auto bulk = backend.create_bulk(col, true);
 
-                for (auto t : transactions)
+                for (auto& t : transactions)
                 {
-                    switch (t->type)
-                    {
-                        case op_type::insert:
-                            mongoc_bulk_operation_insert(bulk, &t->operation_op_1);
-                            break;
-
-                        case op_type::update_one:
-                            mongoc_bulk_operation_update_one_with_opts(bulk, &t->operation_op_1, &t->operation_op_2, nullptr, nullptr);
-                            break;
-
-                        case op_type::update_many:
-                            mongoc_bulk_operation_update_many_with_opts(bulk, &t->operation_op_1, &t->operation_op_2, nullptr, nullptr);
-                            break;
-
-                        case op_type::upsert_one:
-                        case op_type::upsert_many:
-                            // TODO(gpascualg): Use mongoc_bulk_operation_update_many_with_opts specifying opts
-                            mongoc_bulk_operation_update(bulk, &t->operation_op_1, &t->operation_op_2, true);
-                            break;
-
-                        case op_type::delete_one:
-                        case op_type::delete_many:
-                            mongoc_bulk_operation_delete(bulk, &t->operation_op_1);
-                            break;
-
-                        default:
-                            break;
-                    }
-
-                    // Destroy data, it's already in the bulk
-                    bson_destroy(&t->operation_op_1);
-                    bson_destroy(&t->operation_op_2);
+                    bulk_append(backend, bulk, t.type, t.operation_op_1, t.operation_op_2);
                 }
 
                 // Send transactions
                 bson_error_t error;
                 bson_t reply;
-                bool ret = mongoc_bulk_operation_execute(bulk, &reply, &error);
-                // TODO(gpascualg): Handle bulk error
+                bool ret = backend.bulk_execute(bulk, &reply, &error);
+                auto outcome = bulk_outcome::of(ret, &reply, transactions.size());
                 bson_destroy(&reply);
-                (void)ret;
 
-                // Once we get here, they are all executed, so flag them and destroy bulk
-                mongoc_bulk_operation_destroy(bulk);
-                for (auto t : transactions)
+                backend.bulk_destroy(bulk);
+                backend.release_collection(col);
+
+                // Ordered bulks stop at the first error, anything after it has not been applied
+                std::size_t dropped = outcome.retryable ? 0 : outcome.failed;
+                for (std::size_t i = 0; i < outcome.applied + dropped; ++i)
                 {
-                    // Flag
-                    t->done = true;
-                    t->pending = false;
+                    if (i >= outcome.applied || outcome.unacknowledged)
+                    {
+                        info->report(collection, i >= outcome.applied ? outcome.failure : write_failure::unacknowledged, transactions[i]);
+                    }
+                    transactions[i].destroy();
                 }
+                transactions.erase(transactions.begin(), transactions.begin() + outcome.applied + dropped);
+
+                database->release_in_flight(collection);
+                info->complete(final_id, std::move(transactions));
             });
         }
-        // Everything is callable ops
+        // Everything is unordered callable ops, fan them out
+        else if (has_unordered_callables)
+        {
+            info->in_flight = true;
+
+            auto batch = std::make_shared<parallel_batch>();
+            batch->info = info.get();
+            batch->final_id = final_id;
+            batch->transactions = std::move(transactions);
+            batch->remaining = static_cast<uint32_t>(batch->transactions.size());
+
+            database->acquire_in_flight(collection);
+            for (std::size_t i = 0; i < batch->transactions.size(); ++i)
+            {
+                database->execute([database, collection = collection, batch, i](auto mongo_database) {
+                    auto col = database->get_collection(mongo_database, collection);
+                    (*batch->transactions[i].callable)(col);
+                    database->backend().release_collection(col);
+
+                    if (batch->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    {
+                        database->release_in_flight(collection);
+                        batch->info->complete(batch->final_id);
+                    }
+                });
+            }
+        }
+        // Everything is ordered callable ops
         else
         {
+            info->in_flight = true;
+            database->acquire_in_flight(collection);
             database->execute([
                 database,
+                info = info.get(),
                 collection = collection,
+                final_id,
                 transactions = std::move(transactions)
-            ](auto mongo_database)
+            ](auto mongo_database) mutable
             {
                 auto col = database->get_collection(mongo_database, collection);
 
-                for (auto t : transactions)
+                for (auto& t : transactions)
                 {
-                    (*t->callable)(col);
-                    t->done = true;
-                    t->pending = false;
+                    (*t.callable)(col);
                 }
+
+                database->backend().release_collection(col);
+                database->release_in_flight(collection);
+                info->complete(final_id);
             });
         }
     }
@@ -297,36 +661,35 @@ bool transaction<callable_size>::update(uint64_t diff, database<traits>* databas
     return true;
 }
 
-template <uint32_t callable_size>
-uint64_t transaction<callable_size>::push_operation(uint8_t collection, op_type type, bson_t& operation)
+template <uint32_t callable_size, typename backend_t>
+uint64_t transaction<callable_size, backend_t>::push_operation(uint8_t collection, op_type type, bson_t& operation)
 {
-    collection_info* info = _collections[collection];
-    uint64_t slot = info->current_id++;
-    transaction_info* transaction = &info->transactions[slot];
+    collection_info* info = _collections[collection].get();
+    uint64_t slot = info->current_id;
+    transaction_info* transaction = &info->emplace_back();
 
     bson_error_t error;
     BSON_ASSERT(bson_validate_with_error(&operation, BSON_VALIDATE_NONE, &error));
 
     transaction->dependency = std::nullopt;
     transaction->type = type;
-    transaction->operation_op_2 = BSON_INITIALIZER;
+    transaction->operation_op_2 = nullptr;
     transaction->callable = std::nullopt;
-    transaction->done = false;
-    transaction->pending = false;
 
-    // Copy ops
-    bson_copy_to(& operation, &transaction->operation_op_1);
+    // Copy ops, slots are moved around thus documents must live in the heap
+    transaction->operation_op_1 = bson_copy(&operation);
     bson_destroy(&operation);
+    enlist();
 
     return slot;
 }
 
-template <uint32_t callable_size>
-uint64_t transaction<callable_size>::push_operation(uint8_t collection, op_type type, bson_t& operation_1, bson_t& operation_2)
+template <uint32_t callable_size, typename backend_t>
+uint64_t transaction<callable_size, backend_t>::push_operation(uint8_t collection, op_type type, bson_t& operation_1, bson_t& operation_2)
 {
-    collection_info* info = _collections[collection];
-    uint64_t slot = info->current_id++;
-    transaction_info* transaction = &info->transactions[slot];
+    collection_info* info = _collections[collection].get();
+    uint64_t slot = info->current_id;
+    transaction_info* transaction = &info->emplace_back();
 
     bson_error_t error;
     BSON_ASSERT(bson_validate_with_error(&operation_1, BSON_VALIDATE_NONE, &error));
@@ -335,91 +698,89 @@ uint64_t transaction<callable_size>::push_operation(uint8_t collection, op_type
     transaction->dependency = std::nullopt;
     transaction->type = type;
     transaction->callable = std::nullopt;
-    transaction->done = false;
-    transaction->pending = false;
 
-    // Copy ops
-    bson_copy_to(&operation_1, &transaction->operation_op_1);
+    // Copy ops, slots are moved around thus documents must live in the heap
+    transaction->operation_op_1 = bson_copy(&operation_1);
     bson_destroy(&operation_1);
 
     // Copy ops
-    bson_copy_to(&operation_2, &transaction->operation_op_2);
+    transaction->operation_op_2 = bson_copy(&operation_2);
     bson_destroy(&operation_2);
+    enlist();
 
     return slot;
 }
 
-template <uint32_t callable_size>
-uint64_t transaction<callable_size>::push_callable(uint8_t collection, callable_t&& callable)
+template <uint32_t callable_size, typename backend_t>
+uint64_t transaction<callable_size, backend_t>::push_callable(uint8_t collection, callable_t&& callable, bool ordered)
 {
-    collection_info* info = _collections[collection];
-    uint64_t slot = info->current_id++;
-    transaction_info* transaction = &info->transactions[slot];
+    collection_info* info = _collections[collection].get();
+    uint64_t slot = info->current_id;
+    transaction_info* transaction = &info->emplace_back();
 
     transaction->dependency = std::nullopt;
-    transaction->operation_op_1 = BSON_INITIALIZER;
-    transaction->operation_op_2 = BSON_INITIALIZER;
+    transaction->operation_op_1 = nullptr;
+    transaction->operation_op_2 = nullptr;
     transaction->callable = std::move(callable);
-    transaction->done = false;
-    transaction->pending = false;
+    transaction->ordered = ordered;
     ++_pending_callables;
+    enlist();
 
     return slot;
 }
 
-template <uint32_t callable_size>
-void transaction<callable_size>::push_dependency(uint8_t collection, uint64_t owner, uint64_t id)
+template <uint32_t callable_size, typename backend_t>
+void transaction<callable_size, backend_t>::push_dependency(uint8_t collection, uint64_t owner, uint64_t id)
 {
-    collection_info* info = _collections[collection];
-    uint64_t slot = info->current_id++;
-    transaction_info* transaction = &info->transactions[slot];
+    collection_info* info = _collections[collection].get();
+    transaction_info* transaction = &info->emplace_back();
 
     transaction->dependency = { .owner = owner, .id = id };
+    transaction->operation_op_1 = nullptr;
+    transaction->operation_op_2 = nullptr;
     transaction->callable = std::nullopt;
-    transaction->done = false;
-    transaction->pending = false;
+    enlist();
 }
 
-template <uint32_t callable_size>
+template <uint32_t callable_size, typename backend_t>
 template <typename F>
-std::vector<typename transaction<callable_size>::transaction_info*> transaction<callable_size>::get_pending_operations(uint8_t collection, F&& id_to_transaction_getter, bool& has_non_callable_transactions)
+std::vector<typename transaction<callable_size, backend_t>::transaction_info> transaction<callable_size, backend_t>::get_pending_operations(uint8_t collection, F&& id_to_transaction_getter, bool& has_non_callable_transactions, bool& has_unordered_callables)
 {
-    collection_info* info = _collections[collection];
-    std::vector<transaction_info*> transactions;
-    std::set<uint64_t> ids;
+    collection_info* info = _collections[collection].get();
+    std::vector<transaction_info> transactions;
 
     has_non_callable_transactions = false;
+    has_unordered_callables = false;
     bool has_callable_transactions = false;
 
-    uint64_t id = info->first_id;
-    for (; id != info->current_id; ++id)
+    std::size_t index = 0;
+    for (; index != info->transactions.size(); ++index)
     {
-        auto& transaction = info->transactions[id];
+        auto& transaction = info->transactions[index];
 
-        // This transaction has been sent and is still pending
-        if (transaction.pending)
+        if (transaction.dependency)
         {
-            break;
-        }
+            // Already registered, we will be woken up once it completes
+            if (info->waiting)
+            {
+                if (!info->dependency_released.load(std::memory_order_acquire))
+                {
+                    break;
+                }
 
-        if (transaction.done)
-        {
-            // TODO(gpascualg): Log why should this case happen at all
-            continue;
-        }
+                info->waiting = false;
+                info->dependency_released = false;
+                continue;
+            }
 
-        if (transaction.dependency)
-        {
             auto dependency = *transaction.dependency;
             if (auto other = id_to_transaction_getter(dependency.owner))
             {
-                if (auto info = other->get_transaction(collection, dependency.id))
+                if (other->wait_for(collection, dependency.id, info))
                 {
-                    if (!info->done)
-                    {
-                        // Stop here if there is a dependency that has not yet completed
-                        break;
-                    }
+                    // Stop here if there is a dependency that has not yet completed
+                    info->waiting = true;
+                    break;
                 }
             }
 
@@ -427,7 +788,8 @@ std::vector<typename transaction<callable_size>::transaction_info*> transaction<
             continue;
         }
 
-        // Callable transactions can only be executed if there is no pending operation
+        // Callable transactions can only be executed if there is no pending operation, and ordered
+        //  ones are never mixed with unordered ones
         if (transaction.callable.has_value())
         {
             if (has_non_callable_transactions)
@@ -435,7 +797,13 @@ std::vector<typename transaction<callable_size>::transaction_info*> transaction<
                 break;
             }
 
+            if (has_callable_transactions && has_unordered_callables == transaction.ordered)
+            {
+                break;
+            }
+
             has_callable_transactions = true;
+            has_unordered_callables = !transaction.ordered;
             --_pending_callables;
         }
         else
@@ -448,38 +816,164 @@ std::vector<typename transaction<callable_size>::transaction_info*> transaction<
             has_non_callable_transactions = true;
         }
 
-        transaction.pending = true;
-        transactions.push_back(&transaction);
+        transactions.push_back(std::move(transaction));
     }
 
-    info->first_id = id;
+    // Reclaim all slots up to here, their operations now belong to the batch
+    info->transactions.erase_begin(index);
+    info->first_id += index;
     return transactions;
 }
 
-template <uint32_t callable_size>
-typename transaction<callable_size>::transaction_info* transaction<callable_size>::get_transaction(uint8_t collection, uint64_t id)
+template <uint32_t callable_size, typename backend_t>
+bool transaction<callable_size, backend_t>::wait_for(uint8_t collection, uint64_t id, collection_info* waiter)
 {
-    if (auto at = _collections.find(collection); at != _collections.end())
+    auto at = _collections.find(collection);
+    if (at == _collections.end())
     {
-        auto& info = at->second;
-        if (auto it = info->transactions.find(id); it != info->transactions.end())
-        {
-            return &it->second;
-        }
+        return false;
+    }
+
+    // Completion publishes its id before taking the lock, thus we either see it here or it sees us.
+    //  Ids not issued yet might never be, and would wait forever.
+    auto info = at->second.get();
+    info->waiters_mutex.lock();
+    bool registered = id < info->current_id.load(std::memory_order_acquire) && id >= info->completed_id.load(std::memory_order_acquire);
+    if (registered)
+    {
+        info->waiters.push_back({ .id = id, .info = waiter });
     }
+    info->waiters_mutex.unlock();
 
-    return nullptr;
+    return registered;
 }
 
-template <uint32_t callable_size>
-inline void transaction<callable_size>::flag_deletion()
+template <uint32_t callable_size, typename backend_t>
+uint64_t transaction<callable_size, backend_t>::append_to_journal(write_journal* journal, uint8_t collection, std::vector<transaction_info>& transactions)
+{
+    std::vector<write_journal::op> ops;
+    ops.reserve(transactions.size());
+    for (auto& t : transactions)
+    {
+        ops.push_back({ .type = t.type, .operation_1 = t.operation_op_1, .operation_2 = t.operation_op_2 });
+    }
+
+    // Journal full, they are kept for later
+    uint64_t sequence = journal->append(collection, ops);
+    if (sequence == 0)
+    {
+        return 0;
+    }
+
+    for (auto& t : transactions)
+    {
+        t.destroy();
+    }
+
+    return sequence;
+}
+
+template <uint32_t callable_size, typename backend_t>
+inline void transaction<callable_size, backend_t>::flag_deletion()
 {
     _flagged = true;
+    enlist();
 }
 
-template <uint32_t callable_size>
-inline void transaction<callable_size>::unflag_deletion()
+template <uint32_t callable_size, typename backend_t>
+inline void transaction<callable_size, backend_t>::unflag_deletion()
 {
     _flagged = false;
     _scheduled = false;
 }
+
+template <uint32_t callable_size, typename backend_t>
+inline void transaction<callable_size, backend_t>::set_folding(bool enabled) noexcept
+{
+    _fold_operations = enabled;
+}
+
+template <uint32_t callable_size, typename backend_t>
+void transaction<callable_size, backend_t>::set_failure_callback(const write_failure_callback_t& callback) noexcept
+{
+    for (auto& [id, collection] : _collections)
+    {
+        collection->on_failure = callback;
+    }
+}
+
+template <uint32_t callable_size, typename backend_t>
+void transaction<callable_size, backend_t>::adopt_collections() noexcept
+{
+    for (auto& [id, info] : _collections)
+    {
+        info->waiters_mutex.lock();
+        info->owner = this;
+        info->waiters_mutex.unlock();
+    }
+}
+
+template <uint32_t callable_size, typename backend_t>
+void transaction<callable_size, backend_t>::release_collections() noexcept
+{
+    for (auto& [id, info] : _collections)
+    {
+        // Completions would write to freed memory
+        assert(!info->in_flight.load(std::memory_order_acquire) && "Transactions can't be destroyed while batches are in flight");
+
+        // Nothing would remove it from the waiters of the other transaction
+        assert((!info->waiting || info->dependency_released) && "Transactions can't be destroyed while waiting on a dependency");
+        info->release_waiters(UINT64_MAX);
+    }
+}
+
+template <uint32_t callable_size, typename backend_t>
+inline bool transaction<callable_size, backend_t>::has_work() noexcept
+{
+    if (_flagged || _pending_callables > 0)
+    {
+        return true;
+    }
+
+    for (auto& [collection, info] : _collections)
+    {
+        if (info->completed_id.load(std::memory_order_acquire) == info->current_id)
+        {
+            continue;
+        }
+
+        // Blocked by a dependency, completing it will wake us up
+        if (info->waiting && !info->in_flight && !info->dependency_released.load(std::memory_order_acquire))
+        {
+            continue;
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+template <uint32_t callable_size, typename backend_t>
+inline void transaction<callable_size, backend_t>::enlist() noexcept
+{
+    if (!_active_list || _enlisted.exchange(true))
+    {
+        return;
+    }
+
+    _next_active = _active_list->head.load(std::memory_order_relaxed);
+    while (!_active_list->head.compare_exchange_weak(_next_active, this, std::memory_order_release, std::memory_order_relaxed))
+    {}
+}
+
+template <uint32_t callable_size, typename backend_t>
+inline void transaction<callable_size, backend_t>::wake() noexcept
+{
+    _woken = true;
+    if (_active_list)
+    {
+        ++_active_list->wakeups;
+        enlist();
+    }
+}
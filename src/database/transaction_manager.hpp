@@ -0,0 +1,539 @@
+#pragma once
+
+#include "core/instrumentation.hpp"
+#include "database/database.hpp"
+#include "database/transaction.hpp"
+
+#include <pool/fiber_pool.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// Owns all transactions and updates them in parallel chunks on the core pool. Transactions enlist
+//  themselves whenever they get new work, thus idle ones cost nothing during updates.
+// Dependencies met during an update wake their waiters, which get another pass within the same
+//  update instead of waiting for the next tick.
+// Ready writes of all transactions are merged per collection into large ordered bulks, which are
+//  split whenever they exceed the configured number of operations or bytes. Batches touching the
+//  same document go into separate rounds, so that an earlier one is always applied first. Failed
+//  operations are handed back to their transaction, which retries them with backoff when transient
+//  and reports them to its failure callback otherwise.
+// NOTE(gpascualg): Creating, destroying and pushing to transactions must not overlap with update
+template <typename pool_traits, uint32_t callable_size, typename backend_t = mongo_backend>
+class transaction_manager
+{
+public:
+    using database_t = database<pool_traits, backend_t>;
+    using transaction_t = transaction<callable_size, backend_t>;
+
+private:
+    using write_batch_t = typename transaction_t::write_batch;
+    using active_list_t = typename transaction_t::active_list;
+
+public:
+    transaction_manager() noexcept;
+    ~transaction_manager() noexcept;
+
+    void init(database_t* database, uint64_t execute_every, uint32_t chunk_size = 256) noexcept;
+
+    transaction_t* create(uint64_t id) noexcept;
+    inline transaction_t* get(uint64_t id) noexcept;
+
+    // Transactions are only deleted once all their operations have completed
+    void destroy(uint64_t id) noexcept;
+
+    template <typename core_loop_t>
+    void update(uint64_t diff, core_loop_t* core_loop) noexcept;
+
+    void set_bulk_limits(uint32_t max_operations, uint32_t max_bytes) noexcept;
+    inline void set_max_passes(uint32_t max_passes) noexcept;
+    inline void set_folding(bool enabled) noexcept;
+    inline void set_failure_callback(const write_failure_callback_t& callback) noexcept;
+    inline std::size_t size() const noexcept;
+
+    // Whether any batch is still being written, the manager can't be destroyed until none is as
+    //  database fibers complete them through their transactions
+    bool has_in_flight() const noexcept;
+
+private:
+    template <typename core_loop_t>
+    void update_active(uint64_t diff, core_loop_t* core_loop) noexcept;
+    void flush_writes() noexcept;
+
+    // Groups batches so that no two of a group touch the same document, each batch going into the
+    //  group right after the last one it conflicts with
+    static std::vector<std::vector<std::size_t>> assign_rounds(const std::vector<write_batch_t>& batches) noexcept;
+
+private:
+    database_t* _database;
+    uint64_t _execute_every;
+    uint32_t _chunk_size;
+    std::unordered_map<uint64_t, std::unique_ptr<transaction_t>> _transactions;
+    active_list_t _active;
+    std::vector<transaction_t*> _updating;
+    std::vector<transaction_t*> _updated;
+    std::vector<uint8_t> _keep;
+    std::vector<std::vector<write_batch_t>> _chunk_batches;
+    std::unordered_map<uint8_t, std::vector<write_batch_t>> _collection_batches;
+    uint32_t _max_bulk_operations;
+    uint32_t _max_bulk_bytes;
+    uint32_t _max_passes;
+    bool _fold_operations;
+    write_failure_callback_t _on_failure;
+};
+
+
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+transaction_manager<pool_traits, callable_size, backend_t>::transaction_manager() noexcept :
+    _database(nullptr),
+    _execute_every(0),
+    _chunk_size(256),
+    _transactions(),
+    _active(),
+    _updating(),
+    _updated(),
+    _keep(),
+    _chunk_batches(),
+    _collection_batches(),
+    _max_bulk_operations(1000),
+    _max_bulk_bytes(8 * 1024 * 1024),
+    _max_passes(4),
+    _fold_operations(false),
+    _on_failure()
+{
+    _active.head = nullptr;
+    _active.wakeups = 0;
+}
+
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+transaction_manager<pool_traits, callable_size, backend_t>::~transaction_manager() noexcept
+{
+    assert(!has_in_flight() && "Transactions can't be destroyed while batches are in flight");
+
+    // Make sure nothing tries to enlist into a list that no longer exists
+    for (auto& [id, transaction] : _transactions)
+    {
+        transaction->_active_list = nullptr;
+    }
+
+    // Transactions are destroyed in any order, none can be left waiting on another
+    for (auto& [id, transaction] : _transactions)
+    {
+        for (auto& [collection, info] : transaction->_collections)
+        {
+            info->release_waiters(UINT64_MAX);
+        }
+    }
+}
+
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+void transaction_manager<pool_traits, callable_size, backend_t>::init(database_t* database, uint64_t execute_every, uint32_t chunk_size) noexcept
+{
+    _database = database;
+    _execute_every = execute_every;
+    _chunk_size = chunk_size;
+    _transactions.clear();
+    _active.head = nullptr;
+    _active.wakeups = 0;
+}
+
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+typename transaction_manager<pool_traits, callable_size, backend_t>::transaction_t* transaction_manager<pool_traits, callable_size, backend_t>::create(uint64_t id) noexcept
+{
+    assert(_database && "Manager has not been initialized");
+
+    auto [it, inserted] = _transactions.try_emplace(id, std::make_unique<transaction_t>());
+    assert(inserted && "Transaction id already exists");
+
+    auto transaction = it->second.get();
+    transaction->init(_database, _execute_every);
+    transaction->_active_list = &_active;
+    transaction->_managed_id = id;
+    transaction->set_folding(_fold_operations);
+    transaction->set_failure_callback(_on_failure);
+    return transaction;
+}
+
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+inline typename transaction_manager<pool_traits, callable_size, backend_t>::transaction_t* transaction_manager<pool_traits, callable_size, backend_t>::get(uint64_t id) noexcept
+{
+    if (auto it = _transactions.find(id); it != _transactions.end())
+    {
+        return it->second.get();
+    }
+
+    return nullptr;
+}
+
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+void transaction_manager<pool_traits, callable_size, backend_t>::destroy(uint64_t id) noexcept
+{
+    if (auto transaction = get(id))
+    {
+        transaction->flag_deletion();
+    }
+}
+
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+template <typename core_loop_t>
+void transaction_manager<pool_traits, callable_size, backend_t>::update(uint64_t diff, core_loop_t* core_loop) noexcept
+{
+    _updated.clear();
+    _active.wakeups = 0;
+    update_active(diff, core_loop);
+
+    // Whoever got woken up during the pass gets dispatched now
+    for (uint32_t pass = 1; pass < _max_passes && _active.wakeups.exchange(0) > 0; ++pass)
+    {
+        update_active(0, core_loop);
+    }
+
+    flush_writes();
+
+    // Anything not yet done is updated again during the next tick
+    for (auto transaction : _updated)
+    {
+        if (transaction->has_work())
+        {
+            transaction->enlist();
+        }
+    }
+}
+
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+template <typename core_loop_t>
+void transaction_manager<pool_traits, callable_size, backend_t>::update_active(uint64_t diff, core_loop_t* core_loop) noexcept
+{
+    // Take the whole active list at once, anything enlisted from now on waits for the next pass
+    _updating.clear();
+    for (auto transaction = _active.head.exchange(nullptr, std::memory_order_acquire); transaction; )
+    {
+        auto next = transaction->_next_active;
+        transaction->_next_active = nullptr;
+        transaction->_enlisted = false;
+        _updating.push_back(transaction);
+        transaction = next;
+    }
+
+    if (_updating.empty())
+    {
+        return;
+    }
+
+    // Update in chunks, transactions returning false have completed their deletion
+    _keep.resize(_updating.size());
+    _chunk_batches.resize((_updating.size() + _chunk_size - 1) / _chunk_size);
+    np::counter counter;
+    for (std::size_t begin = 0; begin < _updating.size(); begin += _chunk_size)
+    {
+        std::size_t end = std::min<std::size_t>(begin + _chunk_size, _updating.size());
+        auto sink = &_chunk_batches[begin / _chunk_size];
+        core_loop->execute([this, diff, begin, end, sink]() {
+            auto getter = [this](uint64_t id) { return get(id); };
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                _keep[i] = _updating[i]->update(diff, _database, getter, sink);
+            }
+        }, counter);
+    }
+
+    {
+        INSTRUMENT_SUSPEND();
+        counter.wait();
+    }
+
+    // Deletions happen serially
+    for (std::size_t i = 0; i < _updating.size(); ++i)
+    {
+        auto transaction = _updating[i];
+        if (!_keep[i])
+        {
+            // It might be still listed from a previous pass
+            std::erase(_updated, transaction);
+            _transactions.erase(transaction->_managed_id);
+        }
+        else
+        {
+            _updated.push_back(transaction);
+        }
+    }
+}
+
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+inline void transaction_manager<pool_traits, callable_size, backend_t>::set_max_passes(uint32_t max_passes) noexcept
+{
+    _max_passes = max_passes;
+}
+
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+inline void transaction_manager<pool_traits, callable_size, backend_t>::set_folding(bool enabled) noexcept
+{
+    // Only applies to transactions created from now on
+    _fold_operations = enabled;
+}
+
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+inline void transaction_manager<pool_traits, callable_size, backend_t>::set_failure_callback(const write_failure_callback_t& callback) noexcept
+{
+    // Only applies to transactions created from now on
+    _on_failure = callback;
+}
+
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+void transaction_manager<pool_traits, callable_size, backend_t>::set_bulk_limits(uint32_t max_operations, uint32_t max_bytes) noexcept
+{
+    _max_bulk_operations = max_operations;
+    _max_bulk_bytes = max_bytes;
+}
+
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+void transaction_manager<pool_traits, callable_size, backend_t>::flush_writes() noexcept
+{
+    for (auto& batches : _chunk_batches)
+    {
+        for (auto& batch : batches)
+        {
+            _collection_batches[batch.collection].push_back(std::move(batch));
+        }
+        batches.clear();
+    }
+
+    for (auto& [collection, batches] : _collection_batches)
+    {
+        if (batches.empty())
+        {
+            continue;
+        }
+
+        _database->acquire_in_flight(collection);
+        _database->execute([this, collection = collection, batches = std::move(batches)](auto database) mutable {
+            auto& backend = _database->backend();
+            auto col = _database->get_collection(database, collection);
+
+            // Batches are applied in order up to their first failed operation. Operations before "next"
+            //  are known to be applied, and the "dropped" ones from "failed" will never be.
+            struct batch_state
+            {
+                std::size_t next;
+                std::size_t failed;
+                std::size_t dropped;
+                write_failure failure;
+            };
+            std::vector<batch_state> states(batches.size());
+            for (std::size_t i = 0; i < batches.size(); ++i)
+            {
+                states[i] = { 0, batches[i].operations.size(), 0, write_failure::rejected };
+            }
+
+            // Which batch owns each operation in the current bulk
+            std::vector<std::size_t> owners;
+            typename backend_t::bulk_t* bulk = nullptr;
+
+            auto send = [&]() {
+                bson_error_t error;
+                bson_t reply;
+                bool ret = backend.bulk_execute(bulk, &reply, &error);
+                auto outcome = bulk_outcome::of(ret, &reply, owners.size());
+
+                for (std::size_t i = 0; i < outcome.applied; ++i)
+                {
+                    auto& state = states[owners[i]];
+                    if (outcome.unacknowledged)
+                    {
+                        batches[owners[i]].info->report(collection, write_failure::unacknowledged, batches[owners[i]].operations[state.next]);
+                    }
+                    ++state.next;
+                }
+
+                // Ordered bulks stop at their first error, anything after it is sent again unless its
+                //  batch stopped
+                for (std::size_t i = outcome.applied; i < outcome.applied + outcome.failed; ++i)
+                {
+                    auto& state = states[owners[i]];
+                    if (state.next < state.failed)
+                    {
+                        state = { state.next, state.next, 0, outcome.failure };
+                    }
+
+                    if (!outcome.retryable)
+                    {
+                        ++state.dropped;
+                    }
+                }
+
+                bson_destroy(&reply);
+                backend.bulk_destroy(bulk);
+                bulk = nullptr;
+                owners.clear();
+            };
+
+            // Each batch goes into a single ordered bulk, together with as many others as possible. A
+            //  batch only waits for the next round if an earlier one touches any of its documents.
+            for (const auto& round : assign_rounds(batches))
+            {
+                while (true)
+                {
+                    uint32_t bytes = 0;
+                    bool full = false;
+                    for (auto i : round)
+                    {
+                        auto& operations = batches[i].operations;
+                        for (std::size_t k = states[i].next; k < states[i].failed; ++k)
+                        {
+                            auto& t = operations[k];
+                            uint32_t size = t.operation_op_1->len + (t.operation_op_2 ? t.operation_op_2->len : 0);
+                            if (bulk && (owners.size() == _max_bulk_operations || bytes + size > _max_bulk_bytes))
+                            {
+                                full = true;
+                                break;
+                            }
+
+                            if (!bulk)
+                            {
+                                bulk = backend.create_bulk(col, true);
+                            }
+
+                            bulk_append(backend, bulk, t.type, t.operation_op_1, t.operation_op_2);
+                            owners.push_back(i);
+                            bytes += size;
+                        }
+
+                        if (full)
+                        {
+                            break;
+                        }
+                    }
+
+                    if (!bulk)
+                    {
+                        break;
+                    }
+
+                    send();
+                }
+            }
+
+            backend.release_collection(col);
+            _database->release_in_flight(collection);
+
+            for (std::size_t i = 0; i < batches.size(); ++i)
+            {
+                // Whatever is left after the dropped operations is retried
+                auto& operations = batches[i].operations;
+                std::size_t done = states[i].failed + states[i].dropped;
+                for (std::size_t k = 0; k < done; ++k)
+                {
+                    if (k >= states[i].failed)
+                    {
+                        batches[i].info->report(collection, states[i].failure, operations[k]);
+                    }
+                    operations[k].destroy();
+                }
+                operations.erase(operations.begin(), operations.begin() + done);
+
+                batches[i].info->complete(batches[i].final_id, std::move(operations));
+            }
+        });
+
+        // Moved-from, but keep it reusable
+        batches.clear();
+    }
+}
+
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+std::vector<std::vector<std::size_t>> transaction_manager<pool_traits, callable_size, backend_t>::assign_rounds(const std::vector<write_batch_t>& batches) noexcept
+{
+    std::vector<std::vector<std::size_t>> rounds;
+
+    // Last round touching each document, operations not addressing a single "_id" touch them all
+    std::unordered_map<std::string, std::size_t> documents;
+    std::size_t any_round = 0;
+    bool has_any = false;
+
+    std::vector<std::string> keys;
+    std::string key;
+
+    for (std::size_t i = 0; i < batches.size(); ++i)
+    {
+        keys.clear();
+        bool touches_any = false;
+        for (const auto& t : batches[i].operations)
+        {
+            bool addressed = t.type == op_type::insert ?
+                op_folding::document_id_key(t.operation_op_1, key) :
+                (t.type == op_type::update_one || t.type == op_type::upsert_one || t.type == op_type::delete_one) && op_folding::id_filter_key(t.operation_op_1, key);
+
+            if (!addressed)
+            {
+                touches_any = true;
+                break;
+            }
+
+            keys.push_back(key);
+        }
+
+        std::size_t round = 0;
+        if (touches_any)
+        {
+            round = rounds.size();
+        }
+        else
+        {
+            round = has_any ? any_round + 1 : 0;
+            for (const auto& k : keys)
+            {
+                if (auto it = documents.find(k); it != documents.end())
+                {
+                    round = std::max(round, it->second + 1);
+                }
+            }
+        }
+
+        if (round == rounds.size())
+        {
+            rounds.emplace_back();
+        }
+        rounds[round].push_back(i);
+
+        if (touches_any)
+        {
+            any_round = round;
+            has_any = true;
+        }
+
+        for (auto& k : keys)
+        {
+            documents[std::move(k)] = round;
+        }
+    }
+
+    return rounds;
+}
+
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+inline std::size_t transaction_manager<pool_traits, callable_size, backend_t>::size() const noexcept
+{
+    return _transactions.size();
+}
+
+template <typename pool_traits, uint32_t callable_size, typename backend_t>
+bool transaction_manager<pool_traits, callable_size, backend_t>::has_in_flight() const noexcept
+{
+    for (const auto& [id, transaction] : _transactions)
+    {
+        for (const auto& [collection, info] : transaction->_collections)
+        {
+            if (info->in_flight.load(std::memory_order_acquire))
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
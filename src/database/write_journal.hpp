@@ -0,0 +1,387 @@
+#pragma once
+
+#include "database/op_type.hpp"
+
+#include <synchronization/mutex.hpp>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <mongoc/mongoc.h>
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string.h>
+#include <vector>
+
+
+// Memory-mapped log of write operations. Writers append whole batches of operations and return
+//  immediately, while a single drainer replays them in order and acknowledges them once the backend
+//  has applied them. Entries that were appended but never acknowledged survive a restart and are
+//  replayed again, thus replays are at-least-once.
+// The journal is a ring: records go from the acknowledged offset (its tail) up to the write offset,
+//  which wraps back to the start whenever a record does not fit at the end. Records are never split,
+//  the skipped end is flagged with an empty record header if there is room for one. When the ring
+//  is full appends fail, and callers must wait for the drainer to catch up.
+// Appended records are numbered in memory, thus writers can tell when theirs have been applied.
+// Durable journals flush records to disk before publishing them, and the header whenever its
+//  offsets change, space is never reused before the acknowledgement freeing it is on disk. Others
+//  leave it to the OS, which only survives process crashes.
+class write_journal
+{
+    static constexpr uint32_t journal_magic = 0x4C4E524A; // "JRNL"
+    static constexpr uint32_t journal_version = 1;
+
+    struct header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t capacity;
+        uint64_t write_offset;
+        uint64_t ack_offset;
+    };
+
+    struct record_header
+    {
+        uint32_t size;
+        uint8_t collection;
+        op_type type;
+        uint16_t reserved;
+        uint32_t operation_1_size;
+        uint32_t operation_2_size;
+    };
+
+public:
+    // Operations that only need one document leave operation_2 as null
+    struct op
+    {
+        op_type type;
+        const bson_t* operation_1;
+        const bson_t* operation_2;
+    };
+
+    struct record
+    {
+        uint8_t collection;
+        op_type type;
+        bson_t operation_1;
+        bson_t operation_2;
+    };
+
+public:
+    write_journal() noexcept;
+
+    bool open(const std::string& path, uint64_t capacity, bool durable = true) noexcept;
+
+    // Appends all operations or none of them, returns the sequence number of the last one or 0 if
+    //  they did not fit
+    uint64_t append(uint8_t collection, const std::vector<op>& ops) noexcept;
+    inline bool is_acknowledged(uint64_t sequence) noexcept;
+
+    inline bool has_pending() noexcept;
+    inline uint64_t pending_begin() noexcept;
+    inline uint64_t pending_end() noexcept;
+
+    // Reads the record at offset and returns the offset of the next one, records point to mapped memory
+    inline uint64_t read(uint64_t offset, record& record) noexcept;
+
+    // Flags everything up to offset, which is "count" records, as applied, and rewinds the journal if
+    //  it has been fully drained
+    void acknowledge(uint64_t offset, uint64_t count) noexcept;
+
+private:
+    static constexpr uint64_t align(uint64_t size) noexcept
+    {
+        return (size + 7) & ~uint64_t(7);
+    }
+
+    static inline uint32_t length(const bson_t* document) noexcept
+    {
+        return document ? document->len : 0;
+    }
+
+    static inline uint64_t record_size(const op& op) noexcept
+    {
+        return align(sizeof(record_header) + length(op.operation_1) + length(op.operation_2));
+    }
+
+    // Where a record of "size" bytes written at "offset" starts, either there or at the start of the
+    //  ring, or 0 if it would reach "tail"
+    inline uint64_t reserve(uint64_t offset, uint64_t tail, uint64_t size) noexcept;
+
+    // Offset of the record at "offset", which is the start of the ring if the end was skipped
+    inline uint64_t wrap(uint64_t offset) noexcept;
+
+    // Synchronously writes [begin, end) back to the file, if durable
+    inline void flush(uint64_t begin, uint64_t end) noexcept;
+
+    inline header* get_header() noexcept;
+
+private:
+    boost::interprocess::file_mapping _file;
+    boost::interprocess::mapped_region _region;
+    uint8_t* _data;
+    bool _durable;
+    np::mutex _mutex;
+    std::atomic<uint64_t> _appended;
+    std::atomic<uint64_t> _acknowledged;
+};
+
+
+inline write_journal::write_journal() noexcept :
+    _file(),
+    _region(),
+    _data(nullptr),
+    _durable(true),
+    _mutex(),
+    _appended(0),
+    _acknowledged(0)
+{}
+
+inline bool write_journal::open(const std::string& path, uint64_t capacity, bool durable) noexcept
+{
+    using namespace boost::interprocess;
+
+    _durable = durable;
+    std::error_code error;
+    uint64_t file_size = sizeof(header) + align(capacity);
+    bool exists = std::filesystem::exists(path, error);
+
+    // Create and size the file, keeping its contents if it already exists
+    if (!exists)
+    {
+        std::ofstream(path, std::ios::binary);
+    }
+
+    if (std::filesystem::file_size(path, error) != file_size)
+    {
+        exists = false;
+        std::filesystem::resize_file(path, file_size, error);
+        if (error)
+        {
+            return false;
+        }
+    }
+
+    try
+    {
+        _file = file_mapping(path.c_str(), read_write);
+        _region = mapped_region(_file, read_write);
+    }
+    catch (const interprocess_exception&)
+    {
+        return false;
+    }
+
+    _data = static_cast<uint8_t*>(_region.get_address());
+
+    // Recover pending records if this is a valid journal, start from scratch otherwise
+    auto header = get_header();
+    if (!exists || header->magic != journal_magic || header->version != journal_version || header->capacity != file_size)
+    {
+        header->magic = journal_magic;
+        header->version = journal_version;
+        header->capacity = file_size;
+        header->write_offset = sizeof(struct header);
+        header->ack_offset = sizeof(struct header);
+        flush(0, sizeof(struct header));
+    }
+
+    // Recovered records are numbered too, as the drainer will acknowledge them
+    record record;
+    for (uint64_t offset = header->ack_offset; offset != header->write_offset; )
+    {
+        offset = read(offset, record);
+        ++_appended;
+    }
+
+    return true;
+}
+
+inline uint64_t write_journal::append(uint8_t collection, const std::vector<op>& ops) noexcept
+{
+    _mutex.lock();
+
+    // The tail only moves forward meanwhile, which never makes a record that fits stop doing so
+    auto header = get_header();
+    uint64_t tail = std::atomic_ref<uint64_t>(header->ack_offset).load(std::memory_order_acquire);
+    uint64_t offset = header->write_offset;
+
+    // Either everything fits or nothing is written
+    for (uint64_t end = offset; const auto& op : ops)
+    {
+        uint64_t at = reserve(end, tail, record_size(op));
+        if (at == 0)
+        {
+            _mutex.unlock();
+            return 0;
+        }
+
+        end = at + record_size(op);
+    }
+
+    uint64_t written = offset;
+    for (const auto& op : ops)
+    {
+        uint64_t start = reserve(offset, tail, record_size(op));
+        if (start != offset)
+        {
+            // Flag the end as skipped
+            if (header->capacity - offset >= sizeof(record_header))
+            {
+                record_header skipped {};
+                memcpy(_data + offset, &skipped, sizeof(record_header));
+                offset += sizeof(record_header);
+            }
+
+            flush(written, offset);
+            written = start;
+        }
+        offset = start;
+
+        record_header record {
+            .size = static_cast<uint32_t>(record_size(op)),
+            .collection = collection,
+            .type = op.type,
+            .reserved = 0,
+            .operation_1_size = length(op.operation_1),
+            .operation_2_size = length(op.operation_2)
+        };
+
+        uint8_t* at = _data + offset;
+        memcpy(at, &record, sizeof(record_header));
+        if (op.operation_1)
+        {
+            memcpy(at + sizeof(record_header), bson_get_data(op.operation_1), record.operation_1_size);
+        }
+        if (op.operation_2)
+        {
+            memcpy(at + sizeof(record_header) + record.operation_1_size, bson_get_data(op.operation_2), record.operation_2_size);
+        }
+        offset += record.size;
+    }
+
+    // Publish only once all records are fully written
+    flush(written, offset);
+    std::atomic_ref<uint64_t>(header->write_offset).store(offset, std::memory_order_release);
+    flush(0, sizeof(struct header));
+    uint64_t sequence = _appended += ops.size();
+    _mutex.unlock();
+
+    return sequence;
+}
+
+inline bool write_journal::is_acknowledged(uint64_t sequence) noexcept
+{
+    return _acknowledged.load(std::memory_order_acquire) >= sequence;
+}
+
+inline bool write_journal::has_pending() noexcept
+{
+    return pending_begin() != pending_end();
+}
+
+inline uint64_t write_journal::pending_begin() noexcept
+{
+    return std::atomic_ref<uint64_t>(get_header()->ack_offset).load(std::memory_order_acquire);
+}
+
+inline uint64_t write_journal::pending_end() noexcept
+{
+    return std::atomic_ref<uint64_t>(get_header()->write_offset).load(std::memory_order_acquire);
+}
+
+inline uint64_t write_journal::read(uint64_t offset, record& record) noexcept
+{
+    offset = wrap(offset);
+
+    record_header header;
+    memcpy(&header, _data + offset, sizeof(record_header));
+
+    const uint8_t* operation_1 = _data + offset + sizeof(record_header);
+    record.collection = header.collection;
+    record.type = header.type;
+    bson_init_static(&record.operation_1, operation_1, header.operation_1_size);
+
+    // Missing documents are read as empty ones
+    if (header.operation_2_size == 0)
+    {
+        bson_init(&record.operation_2);
+    }
+    else
+    {
+        bson_init_static(&record.operation_2, operation_1 + header.operation_1_size, header.operation_2_size);
+    }
+
+    return offset + header.size;
+}
+
+inline void write_journal::acknowledge(uint64_t offset, uint64_t count) noexcept
+{
+    _mutex.lock();
+
+    auto header = get_header();
+    if (offset == header->write_offset)
+    {
+        // Fully drained, start writing from the beginning again, so that records don't need to wrap
+        std::atomic_ref<uint64_t>(header->write_offset).store(sizeof(struct header), std::memory_order_release);
+        std::atomic_ref<uint64_t>(header->ack_offset).store(sizeof(struct header), std::memory_order_release);
+    }
+    else
+    {
+        std::atomic_ref<uint64_t>(header->ack_offset).store(offset, std::memory_order_release);
+    }
+    flush(0, sizeof(struct header));
+
+    _acknowledged.fetch_add(count, std::memory_order_release);
+    _mutex.unlock();
+}
+
+inline uint64_t write_journal::reserve(uint64_t offset, uint64_t tail, uint64_t size) noexcept
+{
+    auto header = get_header();
+    uint64_t begin = sizeof(struct header);
+
+    // Free space is [offset, tail) once wrapped, and the end plus [begin, tail) otherwise. Writing
+    //  must never catch up with the tail, it would look like an empty journal.
+    if (offset < tail)
+    {
+        return offset + size < tail ? offset : 0;
+    }
+
+    if (offset + size <= header->capacity)
+    {
+        return offset;
+    }
+
+    return begin + size < tail ? begin : 0;
+}
+
+inline uint64_t write_journal::wrap(uint64_t offset) noexcept
+{
+    auto header = get_header();
+    if (header->capacity - offset < sizeof(record_header))
+    {
+        return sizeof(struct header);
+    }
+
+    // Real records are never empty
+    uint32_t size;
+    memcpy(&size, _data + offset, sizeof(uint32_t));
+    return size == 0 ? sizeof(struct header) : offset;
+}
+
+inline void write_journal::flush(uint64_t begin, uint64_t end) noexcept
+{
+    // Ranges are aligned down to a page by the region itself
+    if (_durable && end > begin)
+    {
+        _region.flush(static_cast<std::size_t>(begin), static_cast<std::size_t>(end - begin), false);
+    }
+}
+
+inline write_journal::header* write_journal::get_header() noexcept
+{
+    return reinterpret_cast<header*>(_data);
+}
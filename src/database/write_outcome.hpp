@@ -0,0 +1,77 @@
+#pragma once
+
+#include "database/bson_utils.hpp"
+#include "database/op_type.hpp"
+
+#include <function2/function2.hpp>
+#include <mongoc/mongoc.h>
+
+#include <cstddef>
+#include <stdint.h>
+
+
+// Why a write operation was reported to a failure callback
+enum class write_failure
+{
+    // Rejected by the server with a non transient error, it is dropped
+    rejected,
+    // Applied, but not acknowledged with the requested write concern
+    unacknowledged,
+    // Might or might not have been applied, sending it again could apply it twice, it is dropped
+    unknown
+};
+
+// Called from a database fiber, operations are destroyed right after
+using write_failure_callback_t = fu2::function<void(uint8_t collection, write_failure failure, op_type type, const bson_t* operation_1, const bson_t* operation_2)>;
+
+// How far an ordered bulk got: operations before "applied" are done, the next "failed" ones must not
+//  be sent again unless "retryable" (after a backoff), and anything after them was not applied
+struct bulk_outcome
+{
+    std::size_t applied;
+    std::size_t failed;
+    bool retryable;
+    bool unacknowledged;
+    write_failure failure;
+
+    static inline bulk_outcome of(bool succeeded, const bson_t* reply, std::size_t count);
+};
+
+
+inline bulk_outcome bulk_outcome::of(bool succeeded, const bson_t* reply, std::size_t count)
+{
+    bulk_outcome outcome { .applied = count, .failed = 0, .retryable = true, .unacknowledged = false, .failure = write_failure::rejected };
+    outcome.unacknowledged = bson_utils::has_write_concern_errors(reply);
+    if (succeeded)
+    {
+        return outcome;
+    }
+
+    if (!bson_utils::has_write_errors(reply))
+    {
+        // Everything was applied, only the write concern failed
+        if (outcome.unacknowledged)
+        {
+            return outcome;
+        }
+
+        // The bulk failed as a whole. If nothing was written it can be sent again, otherwise there is
+        //  no telling which operations were applied, and repeating them might not be idempotent.
+        outcome.applied = 0;
+        outcome.failed = count;
+        outcome.retryable = bson_utils::written_count(reply) == 0;
+        outcome.failure = write_failure::unknown;
+        return outcome;
+    }
+
+    bson_utils::for_each_write_error(reply, [&](uint32_t index, int32_t code) {
+        if (index < outcome.applied)
+        {
+            outcome.applied = index;
+            outcome.failed = 1;
+            outcome.retryable = bson_utils::is_transient_error(code);
+        }
+    });
+
+    return outcome;
+}